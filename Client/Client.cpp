@@ -2,11 +2,17 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <map>
 #include <cstring>
 #include <cstdint>
 #include <string>
+#include <sstream>
 #include <limits> // Required for std::numeric_limits
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <memory>
 // Platform-specific includes
 #ifdef _WIN32
 #include <winsock2.h>
@@ -15,20 +21,82 @@
 typedef int socklen_t;
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #define SOCKET int
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
+#define closesocket close
+#define WSAPoll poll
+typedef pollfd WSAPOLLFD;
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SNAPSHOT_DELTA_SSE2
+#endif
+
+// Optional LZ4 pass over snapshot deltas; define USE_LZ4 and link liblz4 to enable
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+// Optional allocation self-test (--alloc-test); define CLIENT_ALLOC_TEST to
+// build it. It replaces the global operator new with a counting one.
+#ifdef CLIENT_ALLOC_TEST
+#include <new>
+#include <cstdlib>
 #endif
 
 #define PORT 54000
+const uint16_t SPECTATOR_PORT = PORT + 2;
+
+// Bulk sends are written to the socket once this many bytes are buffered
+const size_t BULK_FLUSH_THRESHOLD = 64 * 1024;
+
+// Bytes read per recv() call in single-threaded mode
+const size_t RECV_CHUNK_SIZE = 64 * 1024;
+
+#ifdef CLIENT_ALLOC_TEST
+// Allocation self-test
+const size_t SELF_TEST_MESSAGES = 20000;
+const size_t SELF_TEST_SNAPSHOT_SIZE = 200;
+const size_t SELF_TEST_SENDERS = 8;
+const size_t SELF_TEST_BURST = 64; // Snapshots per write; the sender stays at most two writes ahead
+const size_t SELF_TEST_LINK_BYTES = 64 * 1024; // Bytes in flight on the memory link, like a socket buffer
+#endif
+
+// Voice Constants
+// Voice datagrams: type, sender, token, sequence, level, then the codec frame
+const size_t VOICE_HEADER_SIZE = 1 + 1 + 4 + 2 + 1;
+const size_t VOICE_MAX_DATAGRAM = 1200;
+const std::chrono::seconds VOICE_KEEPALIVE(1); // Keeps the server's view of our address fresh while silent
 
 // Message Type Constants
 const uint8_t TEXT_MESSAGE = 0;
 const uint8_t EVENT_MESSAGE = 1;
 const uint8_t SNAPSHOT_MESSAGE = 2;
+const uint8_t SNAPSHOT_DELTA_MESSAGE = 3;  // Server -> client, snapshot encoded against the previous one from the same sender
+const uint8_t SNAPSHOT_RESYNC_MESSAGE = 4; // Client -> server, enables deltas and asks for full snapshots next
+const uint8_t PING_MESSAGE = 5;            // Server -> client, echoed back unchanged as a pong
+const uint8_t PONG_MESSAGE = 6;            // Client -> server
+const uint8_t PLAYER_STATE_MESSAGE = 7;    // Client -> server, position and team; the server sends fewer snapshots of distant players
+const uint8_t COSMETIC_EVENT_MESSAGE = 8;  // Event the server may drop when it is overloaded
+const uint8_t VISIBILITY_MESSAGE = 9;      // Server -> client, players that came into or went out of view
+const uint8_t VOICE_SETUP_MESSAGE = 10;    // Server -> client, voice port and our voice token
+const uint8_t VOICE_MESSAGE = 11;          // Voice datagram over UDP, in both directions
+const uint8_t SPECTATE_MESSAGE = 12;       // Spectator -> feed, the match ID to watch
+const uint8_t SPECTATOR_KEYFRAME_MESSAGE = 13; // Feed -> spectator, every player's snapshot frame back to back
+const uint8_t SPECTATOR_DELTA_MESSAGE = 14;    // Feed -> spectator, the next bundle as a delta on the previous one
+const uint8_t IDENTIFY_MESSAGE = 15;       // Client -> server, the player's persistent 64-bit ID
+
+// Snapshot Delta Constants
+const size_t DELTA_HEADER_SIZE = 2 + 1 + 4;  // Baseline sequence, flags, raw size
+const uint8_t DELTA_FLAG_LZ4 = 0x1;
 
 // Message Base Class
 class BaseMessage {
@@ -39,6 +107,12 @@ public:
     BaseMessage(uint8_t type, uint8_t sender)
         : messageType(type), senderID(sender) {}
 
+    // Messages are move-only so payloads are never deep-copied by accident
+    BaseMessage(const BaseMessage&) = delete;
+    BaseMessage& operator=(const BaseMessage&) = delete;
+    BaseMessage(BaseMessage&&) = default;
+    BaseMessage& operator=(BaseMessage&&) = default;
+
     virtual ~BaseMessage() {}
 };
 
@@ -55,62 +129,605 @@ class EventMessage : public BaseMessage {
 public:
     std::vector<uint8_t> eventData;
 
-    EventMessage(uint8_t sender, const std::string& data)
-        : BaseMessage(EVENT_MESSAGE, sender), eventData(data.begin(), data.end()) {}
+    EventMessage(uint8_t sender, const std::string& data, bool cosmetic = false)
+        : BaseMessage(cosmetic ? COSMETIC_EVENT_MESSAGE : EVENT_MESSAGE, sender), eventData(data.begin(), data.end()) {}
 };
 
 class SnapshotMessage : public BaseMessage {
 public:
     std::vector<uint8_t> snapshotData;
 
-    // Default constructor
-    SnapshotMessage() : BaseMessage(SNAPSHOT_MESSAGE, 0), snapshotData() {}
-
-    // Parameterized constructor
     SnapshotMessage(uint8_t sender, const std::string& data)
         : BaseMessage(SNAPSHOT_MESSAGE, sender), snapshotData(data.begin(), data.end()) {}
 };
 
+// Receive Buffer Pool
+// Receive buffers are recycled instead of freed, so steady-state receiving
+// does not allocate. A buffer goes back to its pool when the last BufferRef
+// to it is released; pooled buffers must not outlive their Client.
+class BufferPool;
+
+struct PooledBuffer {
+    std::atomic<int> refs;
+    BufferPool* pool;
+    std::vector<uint8_t> data;
+};
+
+// Move-only handle to a pooled buffer. share() hands out another reference
+// explicitly, e.g. for several messages decoded from the same read.
+class BufferRef {
+private:
+    PooledBuffer* buffer;
+
+public:
+    BufferRef() : buffer(nullptr) {}
+    explicit BufferRef(PooledBuffer* b) : buffer(b) {}
+    BufferRef(BufferRef&& other) noexcept : buffer(other.buffer) { other.buffer = nullptr; }
+    BufferRef& operator=(BufferRef&& other) noexcept;
+    BufferRef(const BufferRef&) = delete;
+    BufferRef& operator=(const BufferRef&) = delete;
+    ~BufferRef() { reset(); }
+
+    BufferRef share() const;
+    bool isShared() const { return buffer && buffer->refs.load(std::memory_order_acquire) > 1; }
+    explicit operator bool() const { return buffer != nullptr; }
+    std::vector<uint8_t>& bytes() const { return buffer->data; }
+    void reset();
+};
+
+// Keeps at least MAX_FREE_BUFFERS free buffers, and as many as were ever in
+// use at once, so a deferred backlog recycles its buffers instead of freeing
+// them and allocating new ones for the next backlog.
+class BufferPool {
+private:
+    static const size_t MAX_FREE_BUFFERS = 64;
+
+    std::mutex poolMutex;
+    std::vector<PooledBuffer*> freeBuffers;
+    size_t inUse;     // Guarded by poolMutex, like the two below
+    size_t peakInUse;
+    bool threadSafe;
+
+public:
+    BufferPool() : inUse(0), peakInUse(0), threadSafe(true) {}
+    ~BufferPool();
+
+    void setThreadSafe(bool enabled) { threadSafe = enabled; }
+    BufferRef acquire(size_t capacity);
+    void release(PooledBuffer* buffer);
+};
+
+// Latest Snapshot Store
+// Newest snapshot per sender, kept in a dense array of triple buffers. The
+// receive path publishes and a single render thread reads; both sides are
+// wait-free, and publishing never allocates.
+class LatestSnapshotStore {
+private:
+    static const size_t MAX_SENDERS = 256;
+    static const uint8_t DIRTY_BIT = 0x4;
+
+    struct Slot {
+        std::atomic<uint8_t> middle; // Buffer shared by both sides, plus DIRTY_BIT when it holds unread data
+        uint8_t back;                // Only touched by the writer
+        uint8_t front;               // Only touched by the reader
+        uint32_t sizes[3];
+        uint64_t sequences[3];
+        uint64_t published;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::unique_ptr<uint8_t[]> storage;
+    size_t capacity;
+    std::atomic<uint64_t> droppedSnapshots;
+
+    uint8_t* bufferFor(uint8_t senderID, uint8_t index) const {
+        return storage.get() + ((size_t)senderID * 3 + index) * capacity;
+    }
+
+public:
+    LatestSnapshotStore() : capacity(0), droppedSnapshots(0) {}
+
+    void enable(size_t maxSnapshotBytes);
+    bool isEnabled() const { return capacity > 0; }
+
+    bool publish(uint8_t senderID, const uint8_t* data, size_t size);
+    bool read(uint8_t senderID, const uint8_t*& data, size_t& size, uint64_t& sequence);
+    uint64_t getDroppedSnapshots() const { return droppedSnapshots.load(std::memory_order_relaxed); }
+};
+
+// World Mirror
+// Client-side copy of every remote player in view, one entity per sender.
+// Components are kept in parallel arrays indexed by slot, and an entity's
+// state is its newest snapshot, held in a fixed-size row that deltas are
+// decoded into in place. Handles carry the slot's generation, so a handle
+// kept past a destroy stops resolving once the slot is reused.
+typedef uint32_t EntityHandle; // Generation in the high 16 bits, slot in the low 16
+const EntityHandle INVALID_ENTITY = 0;
+
+class WorldMirror {
+private:
+    static const size_t MAX_ENTITIES = 256;
+
+    size_t stateCapacity;
+
+    // Components, indexed by slot
+    std::vector<uint16_t> generations;       // Never 0, so no live handle equals INVALID_ENTITY
+    std::vector<uint8_t> alive;
+    std::vector<uint8_t> owners;             // Sender ID
+    std::vector<uint32_t> stateSizes;
+    std::vector<uint16_t> baselineSequences; // Delta sequence the row is at
+    std::vector<uint8_t> baselineValid;
+    std::vector<uint64_t> updates;           // Snapshots applied to the row
+    std::vector<uint64_t> revisions;         // Bumped on every change to the slot, never reset
+    std::vector<uint8_t> states;             // stateCapacity bytes per slot
+
+    int16_t slotBySender[256];               // -1 for senders without an entity
+    std::vector<uint16_t> freeSlots;
+    size_t entityCount;
+    uint64_t droppedSnapshots;
+
+    uint8_t* rowFor(size_t slot) { return states.data() + slot * stateCapacity; }
+
+public:
+    WorldMirror();
+
+    void enable(size_t maxStateBytes);
+    bool isEnabled() const { return stateCapacity > 0; }
+
+    EntityHandle create(uint8_t senderID);
+    void destroy(uint8_t senderID);
+    EntityHandle find(uint8_t senderID) const;
+
+    // Snapshot application, false if the row could not be updated
+    bool applySnapshot(uint8_t senderID, const uint8_t* data, size_t size);
+    bool applyDelta(uint8_t senderID, uint16_t sequence, const uint8_t* delta, size_t deltaSize, uint32_t rawSize);
+    void invalidateBaselines();
+
+    // Brings this copy up to date with other, copying only the rows that changed
+    void copyChangedFrom(const WorldMirror& other);
+
+    // Reading, by handle or by iterating slots [0, getSlotCount()) that are alive
+    bool getState(EntityHandle handle, const uint8_t*& data, size_t& size) const;
+    size_t getSlotCount() const { return alive.size(); }
+    bool isAlive(size_t slot) const { return alive[slot] != 0; }
+    EntityHandle handleAt(size_t slot) const { return ((EntityHandle)generations[slot] << 16) | (EntityHandle)slot; }
+    uint8_t getOwner(size_t slot) const { return owners[slot]; }
+    uint64_t getUpdates(size_t slot) const { return updates[slot]; }
+    const uint8_t* getStateData(size_t slot) const { return states.data() + slot * stateCapacity; }
+    size_t getStateSize(size_t slot) const { return stateSizes[slot]; }
+    size_t getEntityCount() const { return entityCount; }
+    uint64_t getDroppedSnapshots() const { return droppedSnapshots; }
+};
+
+// Transport
+// Moves the bytes of the connection to the server: a socket, or a memory
+// link that simulates one inside the process. send() and receive() behave
+// like the socket calls, blocking or not as set, and return a byte count, 0
+// from receive once the peer has closed, or WOULD_BLOCK or FAILED.
+class Transport {
+public:
+    enum { WOULD_BLOCK = -1, FAILED = -2 };
+
+    virtual ~Transport() {}
+
+    virtual int send(const uint8_t* data, size_t size) = 0;
+    virtual int receive(uint8_t* data, size_t size) = 0;
+    virtual void setBlocking(bool blocking) = 0;
+    virtual bool isWritable() = 0;
+    // Waits up to timeoutMs for data or the peer closing; false on timeout
+    virtual bool waitReadable(int timeoutMs) = 0;
+    // The socket to poll together with others, INVALID_SOCKET if there is none
+    virtual SOCKET pollHandle() const { return INVALID_SOCKET; }
+    virtual void close() = 0;
+};
+
+class SocketTransport : public Transport {
+private:
+    SOCKET socket;
+
+public:
+    explicit SocketTransport(SOCKET sock) : socket(sock) {}
+
+    int send(const uint8_t* data, size_t size) override;
+    int receive(uint8_t* data, size_t size) override;
+    void setBlocking(bool blocking) override;
+    bool isWritable() override;
+    bool waitReadable(int timeoutMs) override;
+    SOCKET pollHandle() const override { return socket; }
+    void close() override { ::closesocket(socket); }
+};
+
+// Memory Link
+// One direction of a simulated connection. Bytes go through a fixed-size
+// ring, so neither end allocates once the link exists, and a full ring makes
+// the writer wait or see WOULD_BLOCK the way a full socket buffer would.
+class MemoryLink {
+private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<uint8_t> ring;
+    size_t head;
+    size_t used;
+    bool closed;
+
+public:
+    explicit MemoryLink(size_t capacity) : ring(capacity), head(0), used(0), closed(false) {}
+
+    int write(const uint8_t* data, size_t size, bool blocking);
+    int read(uint8_t* data, size_t size, bool blocking);
+    bool waitReadable(int timeoutMs);
+    bool hasRoom();
+    void close();
+};
+
+class MemoryTransport : public Transport {
+private:
+    std::shared_ptr<MemoryLink> inbound;
+    std::shared_ptr<MemoryLink> outbound;
+    bool blocking;
+
+public:
+    MemoryTransport(std::shared_ptr<MemoryLink> in, std::shared_ptr<MemoryLink> out)
+        : inbound(std::move(in)), outbound(std::move(out)), blocking(true) {}
+
+    // Both ends of a new connection; each reads what the other writes
+    static void createPair(size_t capacity, std::unique_ptr<Transport>& first, std::unique_ptr<Transport>& second);
+
+    int send(const uint8_t* data, size_t size) override { return outbound->write(data, size, blocking); }
+    int receive(uint8_t* data, size_t size) override { return inbound->read(data, size, blocking); }
+    void setBlocking(bool enabled) override { blocking = enabled; }
+    bool isWritable() override { return outbound->hasRoom(); }
+    bool waitReadable(int timeoutMs) override { return inbound->waitReadable(timeoutMs); }
+    void close() override {
+        inbound->close();
+        outbound->close();
+    }
+};
+
+// Message Dispatch
+const size_t MAX_MESSAGE_TYPES = 16;
+
+// Zero-copy view of a received message. The payload points into the receive
+// buffer and is only valid while the buffer is referenced.
+struct MessageView {
+    uint8_t messageType;
+    uint8_t senderID;
+    const uint8_t* payload;
+    size_t payloadSize;
+};
+
+// A received message together with the pooled buffer its view points into.
+// Move-only; ownership travels from the receive path to the handler, which
+// may move the message out to keep it.
+class ReceivedMessage {
+public:
+    MessageView view;
+    BufferRef buffer;
+
+    ReceivedMessage() : view{} {}
+    ReceivedMessage(const MessageView& v, BufferRef&& b) : view(v), buffer(std::move(b)) {}
+    ReceivedMessage(ReceivedMessage&&) noexcept = default;
+    ReceivedMessage& operator=(ReceivedMessage&&) noexcept = default;
+    ReceivedMessage(const ReceivedMessage&) = delete;
+    ReceivedMessage& operator=(const ReceivedMessage&) = delete;
+};
+
+typedef std::function<void(ReceivedMessage&)> MessageHandler;
+typedef std::function<void(uint8_t speakerID, uint8_t level, const uint8_t* frame, size_t size)> VoiceHandler;
+
+enum DispatchMode {
+    DISPATCH_IMMEDIATE,         // Called on the receiving thread as soon as the message is decoded
+    DISPATCH_DEFERRED,          // Buffer is moved to a queue and handled by processMessages()
+    DISPATCH_LATEST_PER_SENDER  // Like deferred, but only the newest message per sender is kept
+};
+
+bool parseMessageView(const uint8_t* data, size_t size, MessageView& view);
+
 class Client {
 private:
-    SOCKET serverSocket;
+    std::unique_ptr<Transport> transport;
     std::thread receiveThread;
     bool isConnected;
     uint8_t clientID;
 
-    std::vector<TextMessage> textMessages;
-    std::vector<EventMessage> eventMessages;
-    std::map<uint8_t, SnapshotMessage> snapshotMessages;
-
-    std::mutex messageMutex; // Mutex for thread-safe access to message containers
+    BufferPool bufferPool; // Declared first so it outlives every buffer reference below
+    LatestSnapshotStore snapshotStore;
+    WorldMirror world;
+
+    // Handlers indexed by message type
+    struct HandlerEntry {
+        MessageHandler handler;
+        DispatchMode mode;
+    };
+    HandlerEntry handlers[MAX_MESSAGE_TYPES];
+
+    // Messages waiting for processMessages(), in arrival order. Both queues
+    // are swapped rather than reallocated, so they keep their capacity.
+    std::vector<ReceivedMessage> deferredMessages;
+    std::vector<ReceivedMessage> processingMessages;
+    std::vector<uint32_t> latestSlots;  // (type, sender) -> slot + 1 in deferredMessages
+    std::vector<uint16_t> latestKeys;   // Keys set in latestSlots for the current batch
+
+    std::mutex messageMutex; // Mutex for thread-safe access to the deferred queue
+    std::mutex sendMutex;    // Keeps frames from different threads from interleaving
+    std::mutex coalesceMutex; // Guards pendingSnapshot in threaded mode, where the receive thread also flushes it
+
+    // Decode worker: the receive path only queues snapshot frames, and the
+    // worker applies them to the world, then publishes a copy that the game
+    // thread swaps in with swapWorld()
+    bool decodeWorker;
+    bool decodeRunning;
+    std::thread decodeThread;
+    std::mutex decodeMutex;
+    std::condition_variable decodeReady;
+    std::vector<ReceivedMessage> decodeQueue;
+    std::mutex worldMutex;
+    WorldMirror readyWorld; // Newest published state, guarded by worldMutex
+    WorldMirror frontWorld; // What the game thread reads
+    bool worldPublished;
+
+    // Last snapshot per sender, the baseline for the next delta
+    struct SnapshotBaseline {
+        BufferRef buffer;
+        size_t size;
+        uint16_t sequence;
+        bool valid;
+    };
+    std::unique_ptr<SnapshotBaseline[]> snapshotBaselines;
+    std::vector<uint8_t> deltaScratch;
+    bool deltaSnapshots;
+    std::atomic<bool> resyncPending;
+    std::atomic<uint8_t> resyncSender; // Whose full snapshot answers the pending resync; 0 for anyone's
+    std::atomic<bool> resyncRequested; // Set by the decode worker for step() to send in single-threaded mode
+
+    // Spectating: the current match bundle, rebuilt from keyframes and deltas
+    BufferRef spectatorBundle;
+    size_t spectatorBundleSize;
+    uint16_t spectatorSequence;
+    bool spectatorValid;
+
+    // Voice channel, opened once the server sends the voice setup. Voice
+    // arrives on its own UDP socket, so it never waits behind snapshots.
+    SOCKET voiceSocket;
+    std::atomic<bool> voiceOpen;
+    uint32_t voiceToken;
+    uint16_t voiceSequence;
+    sockaddr_in serverAddress;
+    std::chrono::steady_clock::time_point lastKeepalive;
+    std::thread voiceThread;
+    VoiceHandler voiceHandler;
+
+    std::vector<uint8_t> sendBuffer;      // Reusable output buffer for bulk sends
+    std::vector<uint8_t> pendingSnapshot; // Newest coalesced snapshot frame not yet written
+    std::atomic<bool> snapshotPending;    // pendingSnapshot is not empty, readable without the lock
+    bool coalesceSnapshots;               // Keep only the newest snapshot when the socket is busy
+
+    // Single-threaded mode state, only touched from step()
+    bool singleThreaded;
+    BufferRef inBuffer;
+    size_t inStart;
+    size_t inEnd;
+    std::vector<uint8_t> outBuffer;
+    size_t outStart;
+
+    bool sendAll(const uint8_t* data, size_t size);
+    bool isWritable();
+    bool writeSnapshotChunk(const uint8_t* frames, size_t size, size_t newestFrame);
+
+    void readAvailable();
+    void decodeAvailable();
+    void flushOutput();
+    void onSocketReady(short revents);
+
+    void dispatchMessage(ReceivedMessage& msg);
+    bool openConnection(const std::string& serverIP, uint16_t port, bool singleThreadedMode);
+    void attachTransport(std::unique_ptr<Transport> link, bool singleThreadedMode);
+    bool applySnapshotDelta(ReceivedMessage& msg);
+    void applySpectatorFrame(ReceivedMessage& msg);
+    bool unpackSnapshotDelta(const MessageView& view, uint16_t& sequence, uint32_t& rawSize, const uint8_t*& body, size_t& bodySize);
+    void applyToWorld(const MessageView& view);
+    void recordSnapshotBaseline(const ReceivedMessage& msg);
+    void requestSnapshotResync(uint8_t senderID = 0);
+    void requestWorldResync(uint8_t senderID);
+    void answerResync(uint8_t senderID);
+    void sendSnapshotResync();
+    void sendRequestedResync();
+    void deferMessage(ReceivedMessage& msg);
+    void openVoiceChannel(const MessageView& view);
+    void closeVoiceChannel();
+    void receiveVoice();
+    void keepVoiceAlive();
+    void runVoice();
+    void queueForDecode(ReceivedMessage&& msg);
+    void decodeSnapshots();
+    void stopDecodeWorker();
+    void dispatchDeferred();
 
 public:
-    Client() : isConnected(false) {}
+    Client();
+    ~Client() {
+        stopDecodeWorker();
+        closeVoiceChannel();
+    }
 
-    bool connectToServer(const std::string& serverIP);
+    bool connectToServer(const std::string& serverIP, bool singleThreadedMode = false);
+    // Same as connectToServer, over a transport that is already connected,
+    // e.g. one end of a MemoryTransport pair
+    void connectTransport(std::unique_ptr<Transport> link, bool singleThreadedMode = false);
+
+    // Watches a match, delayed, from a server's or relay's spectator feed.
+    // The match arrives as every player's snapshots, through the same
+    // handlers and world mirror as when playing.
+    bool spectate(const std::string& serverIP, uint32_t matchID, uint16_t port = SPECTATOR_PORT, bool singleThreadedMode = false);
+
+    // Single-threaded mode: drives receive, decode, dispatch and flush without threads
+    bool step(int timeoutMs = 0);
+    static size_t pollAll(const std::vector<Client*>& clients, int timeoutMs);
     void disconnect();
     void sendMessage(BaseMessage* msg);
+    void sendPlayerState(float x, float y, float z, uint8_t team);
+    void identify(uint64_t playerID);
+
+    // Bulk snapshot sending
+    template <typename Payload>
+    size_t sendSnapshotBatch(const Payload* payloads, size_t count);
+    template <typename Generator>
+    size_t sendSnapshotBatch(size_t count, Generator generate);
+    void setSnapshotCoalescing(bool enabled);
+    bool isSnapshotCoalescing() const { return coalesceSnapshots; }
+    bool flushPendingSnapshot(bool wait);
     void receiveMessages();
 
-    // Updated Function Names
-    void sortMessageByType(BaseMessage* msg);
+    // Handlers must be registered before connecting
+    void setMessageHandler(uint8_t messageType, MessageHandler handler, DispatchMode mode = DISPATCH_IMMEDIATE);
+
+    // Voice handlers run on the thread that receives voice: the voice thread,
+    // or step() and pollAll() in single-threaded mode
+    void setVoiceHandler(VoiceHandler handler) { voiceHandler = std::move(handler); }
+    // Sends one codec frame; level is how loud it is, 0-255. False if the
+    // voice channel is not open yet or the frame is too large.
+    bool sendVoice(const uint8_t* frame, size_t size, uint8_t level);
     void processMessages();
 
-    void displayTextMessage(TextMessage* tm);
-    void processEventMessage(EventMessage* em);
-    void processSnapshotMessage(SnapshotMessage* sm);
+    void displayTextMessage(const MessageView& view);
+    void processEventMessage(const MessageView& view);
+    void processSnapshotMessage(const MessageView& view);
+    void processVisibilityMessage(const MessageView& view);
+
+    // Wait-free access to the newest snapshot per sender, e.g. from a render
+    // thread. Must be enabled before connecting; read() is single-reader.
+    void enableSnapshotStore(size_t maxSnapshotBytes) { snapshotStore.enable(maxSnapshotBytes); }
+
+    // Ask the server for delta-encoded snapshots; must be called before connecting
+    void enableSnapshotDeltas();
+    bool readLatestSnapshot(uint8_t senderID, const uint8_t*& data, size_t& size, uint64_t& sequence) {
+        return snapshotStore.read(senderID, data, size, sequence);
+    }
+
+    // Keep remote players in a world mirror instead of dispatching their
+    // snapshots. Must be enabled before connecting. The mirror is written by
+    // the receive path, so read it from immediate handlers, or between step()
+    // calls in single-threaded mode.
+    void enableWorldMirror(size_t maxStateBytes) { world.enable(maxStateBytes); }
+    const WorldMirror& getWorld() const { return decodeWorker ? frontWorld : world; }
+
+    // Apply snapshots to the world on a worker thread instead of the receive
+    // path. Needs the world mirror; must be enabled before connecting. The
+    // game thread then calls swapWorld() once per frame, and getWorld() stays
+    // unchanged between swaps. Returns false if nothing new was published.
+    void enableDecodeWorker() { decodeWorker = world.isEnabled(); }
+    bool swapWorld();
+
+#ifdef CLIENT_ALLOC_TEST
+    // Self-test: receives messages from a loopback sender and returns the heap
+    // allocations made after the first quarter of them, UINT64_MAX on failure
+    static uint64_t measureReceiveAllocations(bool singleThreadedMode, DispatchMode mode, size_t messages);
+#endif
 };
 // Serialization and Deserialization Functions
 void serializeMessage(BaseMessage* msg, std::vector<uint8_t>& buffer);
 BaseMessage* deserializeMessage(const std::vector<uint8_t>& buffer);
+size_t frameSize(size_t payloadSize);
+void appendFrame(std::vector<uint8_t>& buffer, uint8_t type, uint8_t sender, const uint8_t* data, size_t size);
+bool decodeSnapshotDelta(const uint8_t* delta, size_t deltaSize, uint8_t* target, size_t size);
+bool parseVisibilityRecord(const MessageView& view, const uint8_t*& entered, size_t& enteredCount,
+    const uint8_t*& left, size_t& leftCount);
+
+// Sends every payload as a snapshot. Frames are encoded straight into the
+// reusable send buffer and written in BULK_FLUSH_THRESHOLD sized chunks.
+template <typename Payload>
+size_t Client::sendSnapshotBatch(const Payload* payloads, size_t count) {
+    // Size the buffer once for the whole batch (capped at one flush)
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += frameSize(payloads[i].size());
+    }
+    sendBuffer.clear();
+    sendBuffer.reserve(std::min(total, BULK_FLUSH_THRESHOLD + frameSize(0)));
+
+    return sendSnapshotBatch(count, [payloads](size_t i) -> const Payload& { return payloads[i]; });
+}
 
-bool Client::connectToServer(const std::string& serverIP) {
+// Same as above, but payloads are produced on demand by generate(index).
+// Returns the number of snapshots handed to the socket (coalesced ones excluded).
+template <typename Generator>
+size_t Client::sendSnapshotBatch(size_t count, Generator generate) {
+    size_t sent = 0;
+    size_t chunkStart = 0;  // Index of the first snapshot in sendBuffer
+    size_t newestFrame = 0; // Offset of the last frame appended to sendBuffer
+    sendBuffer.clear();
+
+    for (size_t i = 0; i < count; i++) {
+        const auto& payload = generate(i);
+        newestFrame = sendBuffer.size();
+        appendFrame(sendBuffer, SNAPSHOT_MESSAGE, 0, (const uint8_t*)payload.data(), payload.size());
+        if (sendBuffer.size() < BULK_FLUSH_THRESHOLD && i + 1 < count) continue;
+
+        bool written = writeSnapshotChunk(sendBuffer.data(), sendBuffer.size(), newestFrame);
+        sendBuffer.clear();
+        if (written) {
+            sent += i + 1 - chunkStart;
+        }
+        else if (!coalesceSnapshots || !isConnected) {
+            return sent;
+        }
+        chunkStart = i + 1;
+    }
+    return sent;
+}
+
+Client::Client() : isConnected(false), decodeWorker(false), decodeRunning(false), worldPublished(false),
+    deltaSnapshots(false), resyncPending(false), resyncSender(0), resyncRequested(false), spectatorBundleSize(0), spectatorSequence(0), spectatorValid(false), voiceSocket(INVALID_SOCKET), voiceOpen(false), voiceToken(0), voiceSequence(0),
+    serverAddress{}, snapshotPending(false), coalesceSnapshots(false), singleThreaded(false), inStart(0), inEnd(0), outStart(0) {
+    for (HandlerEntry& entry : handlers) {
+        entry.mode = DISPATCH_IMMEDIATE;
+    }
+
+    // Default handlers keep the original behaviour: everything is handled by
+    // processMessages(), and only the newest snapshot per client is kept
+    setMessageHandler(TEXT_MESSAGE, [this](ReceivedMessage& msg) { displayTextMessage(msg.view); }, DISPATCH_DEFERRED);
+    setMessageHandler(EVENT_MESSAGE, [this](ReceivedMessage& msg) { processEventMessage(msg.view); }, DISPATCH_DEFERRED);
+    setMessageHandler(COSMETIC_EVENT_MESSAGE, [this](ReceivedMessage& msg) { processEventMessage(msg.view); }, DISPATCH_DEFERRED);
+    setMessageHandler(SNAPSHOT_MESSAGE, [this](ReceivedMessage& msg) { processSnapshotMessage(msg.view); }, DISPATCH_LATEST_PER_SENDER);
+    setMessageHandler(VISIBILITY_MESSAGE, [this](ReceivedMessage& msg) { processVisibilityMessage(msg.view); }, DISPATCH_DEFERRED);
+    setVoiceHandler([](uint8_t speakerID, uint8_t level, const uint8_t*, size_t size) {
+        std::cout << "Voice from Client " << (int)speakerID << " (" << size << " bytes, level " << (int)level << ")" << std::endl;
+    });
+}
+
+bool Client::connectToServer(const std::string& serverIP, bool singleThreadedMode) {
+    if (!openConnection(serverIP, PORT, singleThreadedMode)) return false;
+
+    if (deltaSnapshots) {
+        requestSnapshotResync();
+    }
+    return true;
+}
+
+void Client::connectTransport(std::unique_ptr<Transport> link, bool singleThreadedMode) {
+    attachTransport(std::move(link), singleThreadedMode);
+
+    if (deltaSnapshots) {
+        requestSnapshotResync();
+    }
+}
+
+bool Client::spectate(const std::string& serverIP, uint32_t matchID, uint16_t port, bool singleThreadedMode) {
+    if (!openConnection(serverIP, port, singleThreadedMode)) return false;
+
+    uint32_t payload = htonl(matchID);
+    std::vector<uint8_t> frame;
+    appendFrame(frame, SPECTATE_MESSAGE, 0, (const uint8_t*)&payload, sizeof(payload));
+    return sendAll(frame.data(), frame.size());
+}
+
+bool Client::openConnection(const std::string& serverIP, uint16_t port, bool singleThreadedMode) {
 #ifdef _WIN32
     WSADATA wsData;
     WSAStartup(MAKEWORD(2, 2), &wsData);
 #endif
 
-    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket == INVALID_SOCKET) {
         std::cerr << "Error creating socket.\n";
         return false;
@@ -118,138 +735,963 @@ bool Client::connectToServer(const std::string& serverIP) {
 
     sockaddr_in serverHint{};
     serverHint.sin_family = AF_INET;
-    serverHint.sin_port = htons(PORT);
+    serverHint.sin_port = htons(port);
     inet_pton(AF_INET, serverIP.c_str(), &serverHint.sin_addr);
 
     if (connect(serverSocket, (sockaddr*)&serverHint, sizeof(serverHint)) == SOCKET_ERROR) {
         std::cerr << "Cannot connect to server.\n";
         return false;
     }
+    serverAddress = serverHint;
+
+    attachTransport(std::unique_ptr<Transport>(new SocketTransport(serverSocket)), singleThreadedMode);
+    std::cout << "Connected to server.\n";
+    return true;
+}
 
+void Client::attachTransport(std::unique_ptr<Transport> link, bool singleThreadedMode) {
+    transport = std::move(link);
     isConnected = true;
+    singleThreaded = singleThreadedMode;
+    bufferPool.setThreadSafe(!singleThreaded || decodeWorker);
+
+    if (decodeWorker) {
+        decodeRunning = true;
+        decodeThread = std::thread(&Client::decodeSnapshots, this);
+    }
+
+    // Everything is driven from step() in single-threaded mode, so the transport must never block
+    transport->setBlocking(!singleThreaded);
+    if (!singleThreaded) {
+        // Start receive thread
+        receiveThread = std::thread(&Client::receiveMessages, this);
+        receiveThread.detach();
+    }
+}
+
+void Client::disconnect() {
+    if (!isConnected) return;
+    isConnected = false;
+    stopDecodeWorker();
+    closeVoiceChannel();
+    transport->close();
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+void Client::sendMessage(BaseMessage* msg) {
+    std::vector<uint8_t> buffer;
+    serializeMessage(msg, buffer);
+
+    uint32_t msgSize = htonl(buffer.size());
+    buffer.insert(buffer.begin(), (uint8_t*)&msgSize, (uint8_t*)&msgSize + sizeof(msgSize));
+
+    if (coalesceSnapshots && msg->messageType == SNAPSHOT_MESSAGE) {
+        writeSnapshotChunk(buffer.data(), buffer.size(), 0);
+        return;
+    }
+
+    sendAll(buffer.data(), buffer.size());
+}
+
+// Reports where the player is, so the server can rank how relevant others are
+// to it. Team 0 means no team.
+void Client::sendPlayerState(float x, float y, float z, uint8_t team) {
+    float position[3] = { x, y, z };
+    uint8_t payload[3 * sizeof(uint32_t) + 1];
+    for (int i = 0; i < 3; i++) {
+        uint32_t bits;
+        memcpy(&bits, &position[i], sizeof(bits));
+        bits = htonl(bits);
+        memcpy(payload + i * sizeof(bits), &bits, sizeof(bits));
+    }
+    payload[3 * sizeof(uint32_t)] = team;
+
+    std::vector<uint8_t> frame;
+    appendFrame(frame, PLAYER_STATE_MESSAGE, 0, payload, sizeof(payload));
+    sendAll(frame.data(), frame.size());
+}
+
+// Tells the server which player this is, so it can keep the player's record
+// across sessions. Only the first identification of a connection counts.
+void Client::identify(uint64_t playerID) {
+    uint8_t payload[sizeof(uint64_t)];
+    for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = (uint8_t)(playerID >> (8 * (sizeof(payload) - 1 - i)));
+    }
+
+    std::vector<uint8_t> frame;
+    appendFrame(frame, IDENTIFY_MESSAGE, 0, payload, sizeof(payload));
+    sendAll(frame.data(), frame.size());
+}
+
+// Writes the whole buffer, retrying on partial sends. In single-threaded
+// mode the data is queued and written as far as the socket allows.
+bool Client::sendAll(const uint8_t* data, size_t size) {
+    if (singleThreaded) {
+        outBuffer.insert(outBuffer.end(), data, data + size);
+        flushOutput();
+        return isConnected;
+    }
+
+    std::lock_guard<std::mutex> lock(sendMutex);
+    size_t totalSent = 0;
+    while (totalSent < size) {
+        int bytesSent = transport->send(data + totalSent, size - totalSent);
+        if (bytesSent <= 0) {
+            return false;
+        }
+        totalSent += bytesSent;
+    }
+    return true;
+}
+
+// Checks whether the socket can take more data without blocking
+bool Client::isWritable() {
+    if (singleThreaded) {
+        flushOutput();
+        return outStart == outBuffer.size();
+    }
+    return transport->isWritable();
+}
+
+// Writes a chunk of snapshot frames. With coalescing on, a chunk the socket
+// cannot take right now is dropped except for its newest frame, which
+// replaces the pending snapshot. Returns true if the chunk was written.
+bool Client::writeSnapshotChunk(const uint8_t* frames, size_t size, size_t newestFrame) {
+    if (!coalesceSnapshots) return sendAll(frames, size);
+
+    std::unique_lock<std::mutex> lock(coalesceMutex, std::defer_lock);
+    if (!singleThreaded) lock.lock();
+    if (!isWritable()) {
+        pendingSnapshot.assign(frames + newestFrame, frames + size);
+        snapshotPending.store(true, std::memory_order_relaxed);
+        return false;
+    }
+
+    // The pending snapshot is older than anything in the chunk, so it goes first
+    if (!pendingSnapshot.empty()) {
+        sendAll(pendingSnapshot.data(), pendingSnapshot.size());
+        pendingSnapshot.clear();
+        snapshotPending.store(false, std::memory_order_relaxed);
+    }
+    return sendAll(frames, size);
+}
+
+void Client::setSnapshotCoalescing(bool enabled) {
+    if (!enabled && snapshotPending.load(std::memory_order_relaxed)) {
+        flushPendingSnapshot(true);
+    }
+    coalesceSnapshots = enabled;
+}
+
+// Writes the pending coalesced snapshot. Unless wait is set, the snapshot
+// stays pending (and may be replaced by a newer one) while the socket is busy.
+// step() and pollAll() retry it once the socket drains; in threaded mode the
+// receive thread retries it after every message it reads.
+bool Client::flushPendingSnapshot(bool wait) {
+    std::unique_lock<std::mutex> lock(coalesceMutex, std::defer_lock);
+    if (!singleThreaded) lock.lock();
+    if (pendingSnapshot.empty()) return false;
+    if (!wait && !isWritable()) return false;
+
+    bool ok = sendAll(pendingSnapshot.data(), pendingSnapshot.size());
+    pendingSnapshot.clear();
+    snapshotPending.store(false, std::memory_order_relaxed);
+    return ok;
+}
+
+void Client::receiveMessages() {
+    while (isConnected) {
+        // The length prefix can arrive split across reads too
+        uint32_t msgSize;
+        size_t prefixReceived = 0;
+        int bytesReceived = 0;
+        while (prefixReceived < sizeof(msgSize)) {
+            bytesReceived = transport->receive((uint8_t*)&msgSize + prefixReceived, sizeof(msgSize) - prefixReceived);
+            if (bytesReceived <= 0) {
+                break;
+            }
+            prefixReceived += bytesReceived;
+        }
+        if (bytesReceived <= 0) {
+            break;
+        }
+        msgSize = ntohl(msgSize);
+
+        // Receive straight into a pooled buffer that the message will own
+        BufferRef buffer = bufferPool.acquire(msgSize);
+        uint8_t* data = buffer.bytes().data();
+        size_t totalReceived = 0;
+        while (totalReceived < msgSize) {
+            bytesReceived = transport->receive(data + totalReceived, msgSize - totalReceived);
+            if (bytesReceived <= 0) {
+                break;
+            }
+            totalReceived += bytesReceived;
+        }
+        if (bytesReceived <= 0) {
+            break;
+        }
+
+        ReceivedMessage msg;
+        if (parseMessageView(data, msgSize, msg.view)) {
+            msg.buffer = std::move(buffer);
+            dispatchMessage(msg);
+        }
+        if (snapshotPending.load(std::memory_order_relaxed)) {
+            flushPendingSnapshot(false);
+        }
+    }
+
+    disconnect();
+}
+
+// Runs one iteration of the single-threaded loop, waiting up to timeoutMs
+// for the socket. Returns false once the connection is gone.
+bool Client::step(int timeoutMs) {
+    if (!isConnected) return false;
+    sendRequestedResync();
+
+    SOCKET serverSocket = transport->pollHandle();
+    if (serverSocket == INVALID_SOCKET) {
+        // Nothing to poll; the voice channel needs a server address and never opens here
+        bool output = outStart < outBuffer.size() || !pendingSnapshot.empty();
+        short revents = output ? POLLOUT : 0;
+        if (transport->waitReadable(output ? 0 : timeoutMs)) revents |= POLLIN;
+        if (revents) onSocketReady(revents);
+        dispatchDeferred();
+        return isConnected;
+    }
+
+    WSAPOLLFD entries[2] = {};
+    entries[0].fd = serverSocket;
+    entries[0].events = POLLIN;
+    if (outStart < outBuffer.size() || !pendingSnapshot.empty()) entries[0].events |= POLLOUT;
+    entries[1].fd = voiceSocket;
+    entries[1].events = POLLIN;
+    bool voice = voiceOpen.load(std::memory_order_acquire);
+
+    if (WSAPoll(entries, voice ? 2 : 1, timeoutMs) > 0) {
+        if (entries[0].revents) onSocketReady(entries[0].revents);
+        if (voice && entries[1].revents) receiveVoice();
+    }
+    if (voice) keepVoiceAlive();
+    dispatchDeferred();
+    return isConnected;
+}
+
+// Drives many single-threaded clients with one poll() call. Clients on a
+// transport without a socket are serviced on every call instead, and keep
+// the poll from waiting. Returns the number of clients that are still connected.
+size_t Client::pollAll(const std::vector<Client*>& clients, int timeoutMs) {
+    // Reused across calls so polling does not allocate
+    thread_local std::vector<WSAPOLLFD> pollSet;
+    thread_local std::vector<Client*> polled;
+    pollSet.clear();
+    polled.clear();
+
+    size_t serviced = 0;
+    for (Client* client : clients) {
+        if (!client->isConnected) continue;
+        client->sendRequestedResync();
+        SOCKET serverSocket = client->transport->pollHandle();
+        if (serverSocket == INVALID_SOCKET) {
+            client->onSocketReady(POLLIN | POLLOUT);
+            client->dispatchDeferred();
+            if (client->isConnected) serviced++;
+            continue;
+        }
+        WSAPOLLFD entry{};
+        entry.fd = serverSocket;
+        entry.events = POLLIN;
+        if (client->outStart < client->outBuffer.size() || !client->pendingSnapshot.empty()) entry.events |= POLLOUT;
+        pollSet.push_back(entry);
+        polled.push_back(client);
+
+        if (client->voiceOpen.load(std::memory_order_acquire)) {
+            WSAPOLLFD voiceEntry{};
+            voiceEntry.fd = client->voiceSocket;
+            voiceEntry.events = POLLIN;
+            pollSet.push_back(voiceEntry);
+            polled.push_back(client);
+            client->keepVoiceAlive();
+        }
+    }
+    if (pollSet.empty()) return serviced;
+
+    if (WSAPoll(pollSet.data(), (unsigned long)pollSet.size(), serviced > 0 ? 0 : timeoutMs) > 0) {
+        for (size_t i = 0; i < pollSet.size(); i++) {
+            if (!pollSet[i].revents) continue;
+            if (pollSet[i].fd == polled[i]->voiceSocket) {
+                polled[i]->receiveVoice();
+                continue;
+            }
+            polled[i]->onSocketReady(pollSet[i].revents);
+            polled[i]->dispatchDeferred();
+        }
+    }
+
+    size_t connected = serviced;
+    for (Client* client : polled) {
+        if (client->isConnected) connected++;
+    }
+    return connected;
+}
+
+void Client::onSocketReady(short revents) {
+    if (revents & (POLLIN | POLLERR | POLLHUP)) {
+        readAvailable();
+        decodeAvailable();
+    }
+    if (isConnected) {
+        flushOutput();
+    }
+    if (isConnected && !pendingSnapshot.empty()) {
+        flushPendingSnapshot(false);
+    }
+}
+
+// Reads into the current pooled input buffer. Leftover bytes of a partial
+// frame move to the front, or into a fresh buffer while messages decoded
+// earlier still reference the current one.
+void Client::readAvailable() {
+    size_t leftover = inEnd - inStart;
+    size_t needed = RECV_CHUNK_SIZE;
+    if (leftover >= sizeof(uint32_t)) {
+        uint32_t msgSize;
+        memcpy(&msgSize, inBuffer.bytes().data() + inStart, sizeof(msgSize));
+        needed = std::max(needed, sizeof(uint32_t) + (size_t)ntohl(msgSize));
+    }
+
+    if (!inBuffer || inBuffer.isShared() || inBuffer.bytes().size() < needed) {
+        BufferRef fresh = bufferPool.acquire(needed);
+        if (leftover > 0) {
+            memcpy(fresh.bytes().data(), inBuffer.bytes().data() + inStart, leftover);
+        }
+        inBuffer = std::move(fresh);
+        inStart = 0;
+        inEnd = leftover;
+    }
+    else if (inStart > 0) {
+        memmove(inBuffer.bytes().data(), inBuffer.bytes().data() + inStart, leftover);
+        inStart = 0;
+        inEnd = leftover;
+    }
+
+    std::vector<uint8_t>& bytes = inBuffer.bytes();
+    while (isConnected && inEnd < bytes.size()) {
+        int bytesReceived = transport->receive(bytes.data() + inEnd, bytes.size() - inEnd);
+        if (bytesReceived > 0) {
+            inEnd += bytesReceived;
+            continue;
+        }
+        if (bytesReceived == Transport::WOULD_BLOCK) break;
+        disconnect();
+    }
+}
+
+// Decodes every complete frame in the input buffer and dispatches it right
+// away. Each message shares the input buffer rather than copying out of it.
+void Client::decodeAvailable() {
+    while (inEnd - inStart >= sizeof(uint32_t)) {
+        const uint8_t* bytes = inBuffer.bytes().data();
+        uint32_t msgSize;
+        memcpy(&msgSize, bytes + inStart, sizeof(msgSize));
+        msgSize = ntohl(msgSize);
+        if (inEnd - inStart - sizeof(uint32_t) < msgSize) break;
+
+        const uint8_t* data = bytes + inStart + sizeof(uint32_t);
+        inStart += sizeof(uint32_t) + msgSize;
+
+        ReceivedMessage msg;
+        if (parseMessageView(data, msgSize, msg.view)) {
+            msg.buffer = inBuffer.share();
+            dispatchMessage(msg);
+        }
+    }
+}
+
+void Client::flushOutput() {
+    while (isConnected && outStart < outBuffer.size()) {
+        int bytesSent = transport->send(outBuffer.data() + outStart, outBuffer.size() - outStart);
+        if (bytesSent > 0) {
+            outStart += bytesSent;
+            continue;
+        }
+        if (bytesSent == Transport::WOULD_BLOCK) break;
+        disconnect();
+    }
+
+    if (outStart == outBuffer.size()) {
+        outBuffer.clear();
+        outStart = 0;
+    }
+    else if (outStart > outBuffer.size() / 2) {
+        outBuffer.erase(outBuffer.begin(), outBuffer.begin() + outStart);
+        outStart = 0;
+    }
+}
+
+void Client::setMessageHandler(uint8_t messageType, MessageHandler handler, DispatchMode mode) {
+    if (messageType >= MAX_MESSAGE_TYPES) return;
+    handlers[messageType].handler = std::move(handler);
+    handlers[messageType].mode = mode;
+}
+
+void Client::dispatchMessage(ReceivedMessage& msg) {
+    if (msg.view.messageType >= MAX_MESSAGE_TYPES) return;
+
+    if (msg.view.messageType == PING_MESSAGE) {
+        // Answered right away, so the server measures the round trip and not the handlers
+        std::vector<uint8_t> pong;
+        appendFrame(pong, PONG_MESSAGE, 0, msg.view.payload, msg.view.payloadSize);
+        sendAll(pong.data(), pong.size());
+        return;
+    }
+
+    if (world.isEnabled()) {
+        if (msg.view.messageType == SNAPSHOT_MESSAGE || msg.view.messageType == SNAPSHOT_DELTA_MESSAGE) {
+            // Snapshots only update the world; nothing reaches the handlers
+            if (decodeWorker) queueForDecode(std::move(msg));
+            else applyToWorld(msg.view);
+            return;
+        }
+        if (msg.view.messageType == VISIBILITY_MESSAGE) {
+            if (decodeWorker) queueForDecode(ReceivedMessage(msg.view, msg.buffer.share()));
+            else applyToWorld(msg.view);
+        }
+    }
+
+    if (msg.view.messageType == VOICE_SETUP_MESSAGE) {
+        openVoiceChannel(msg.view);
+        return;
+    }
+    if (msg.view.messageType == SPECTATOR_KEYFRAME_MESSAGE || msg.view.messageType == SPECTATOR_DELTA_MESSAGE) {
+        applySpectatorFrame(msg);
+        return;
+    }
+
+    if (deltaSnapshots) {
+        if (msg.view.messageType == SNAPSHOT_DELTA_MESSAGE) {
+            // Turns the message into the full snapshot it encodes
+            if (!applySnapshotDelta(msg)) return;
+        }
+        else if (msg.view.messageType == SNAPSHOT_MESSAGE) {
+            recordSnapshotBaseline(msg);
+        }
+    }
+
+    if (msg.view.messageType == SNAPSHOT_MESSAGE && snapshotStore.isEnabled()) {
+        snapshotStore.publish(msg.view.senderID, msg.view.payload, msg.view.payloadSize);
+    }
+
+    HandlerEntry& entry = handlers[msg.view.messageType];
+    if (!entry.handler) return;
+
+    if (entry.mode == DISPATCH_IMMEDIATE) {
+        entry.handler(msg);
+    }
+    else {
+        deferMessage(msg);
+    }
+}
+
+// Moves the message into the deferred queue
+void Client::deferMessage(ReceivedMessage& msg) {
+    std::unique_lock<std::mutex> lock(messageMutex, std::defer_lock);
+    if (!singleThreaded) lock.lock(); // Lock for thread safety
+
+    if (handlers[msg.view.messageType].mode == DISPATCH_LATEST_PER_SENDER) {
+        uint16_t key = (uint16_t)((msg.view.messageType << 8) | msg.view.senderID);
+        if (latestSlots.empty()) {
+            latestSlots.resize(MAX_MESSAGE_TYPES << 8, 0);
+        }
+        if (latestSlots[key] != 0) {
+            deferredMessages[latestSlots[key] - 1] = std::move(msg); // Replace the older message in place
+            return;
+        }
+        latestSlots[key] = (uint32_t)deferredMessages.size() + 1;
+        latestKeys.push_back(key);
+    }
+    deferredMessages.push_back(std::move(msg));
+}
+
+void Client::enableSnapshotDeltas() {
+    deltaSnapshots = true;
+    snapshotBaselines.reset(new SnapshotBaseline[256]);
+    for (size_t i = 0; i < 256; i++) {
+        snapshotBaselines[i].size = 0;
+        snapshotBaselines[i].sequence = 0;
+        snapshotBaselines[i].valid = false;
+    }
+}
+
+// Drops every baseline and asks the server to send full snapshots again.
+// senderID is the sender whose delta could not be applied; the resync stays
+// pending until a full snapshot from that sender arrives.
+void Client::requestSnapshotResync(uint8_t senderID) {
+    for (size_t i = 0; i < 256; i++) {
+        snapshotBaselines[i].valid = false;
+    }
+    // The decode worker owns the world when there is one
+    if (!decodeWorker) world.invalidateBaselines();
+    resyncSender = senderID;
+    resyncPending = true;
+    sendSnapshotResync();
+}
+
+// The world's version of requestSnapshotResync, run wherever the world is
+// updated. The decode worker must not touch the single-threaded output
+// buffer, so there the request is left for step() to send.
+void Client::requestWorldResync(uint8_t senderID) {
+    world.invalidateBaselines();
+    resyncSender = senderID;
+    resyncPending = true;
+    if (singleThreaded) {
+        resyncRequested.store(true, std::memory_order_release);
+    }
+    else {
+        sendSnapshotResync();
+    }
+}
+
+void Client::sendRequestedResync() {
+    if (resyncRequested.load(std::memory_order_relaxed) && resyncRequested.exchange(false, std::memory_order_acquire)) {
+        sendSnapshotResync();
+    }
+}
+
+void Client::sendSnapshotResync() {
+    uint8_t frame[sizeof(uint32_t) + 2 + sizeof(uint32_t)];
+    uint32_t msgSize = htonl(2 + sizeof(uint32_t));
+    uint32_t length = 0;
+    memcpy(frame, &msgSize, sizeof(msgSize));
+    frame[4] = SNAPSHOT_RESYNC_MESSAGE;
+    frame[5] = 0;
+    memcpy(frame + 6, &length, sizeof(length));
+    sendAll(frame, sizeof(frame));
+}
+
+// Keeps a full snapshot as the baseline for the next delta from its sender
+void Client::recordSnapshotBaseline(const ReceivedMessage& msg) {
+    SnapshotBaseline& baseline = snapshotBaselines[msg.view.senderID];
+    if (!baseline.buffer || baseline.buffer.isShared() || baseline.buffer.bytes().size() < msg.view.payloadSize) {
+        baseline.buffer = bufferPool.acquire(msg.view.payloadSize);
+    }
+    if (msg.view.payloadSize > 0) {
+        memcpy(baseline.buffer.bytes().data(), msg.view.payload, msg.view.payloadSize);
+    }
+    baseline.size = msg.view.payloadSize;
+    baseline.sequence = 1;
+    baseline.valid = true;
+    answerResync(msg.view.senderID);
+}
+
+// Full snapshots also arrive when a delta would not pay off, and those may
+// have left the server before it saw the request. Only the one from the
+// sender that needed the resync ends it.
+void Client::answerResync(uint8_t senderID) {
+    uint8_t waitingFor = resyncSender.load(std::memory_order_relaxed);
+    if (resyncPending.load(std::memory_order_relaxed) && (waitingFor == 0 || waitingFor == senderID)) {
+        resyncPending = false;
+    }
+}
+
+// Reads the delta header and undoes the LZ4 pass if there is one. body is
+// left pointing at the run-length encoded delta. Returns false if the delta
+// cannot be used; what to do then is up to the caller.
+bool Client::unpackSnapshotDelta(const MessageView& view, uint16_t& sequence, uint32_t& rawSize,
+    const uint8_t*& body, size_t& bodySize) {
+    if (view.payloadSize < DELTA_HEADER_SIZE) return false;
+
+    memcpy(&sequence, view.payload, sizeof(sequence));
+    uint8_t flags = view.payload[2];
+    memcpy(&rawSize, view.payload + 3, sizeof(rawSize));
+    sequence = ntohs(sequence);
+    rawSize = ntohl(rawSize);
+
+    body = view.payload + DELTA_HEADER_SIZE;
+    bodySize = view.payloadSize - DELTA_HEADER_SIZE;
+
+    if (flags & DELTA_FLAG_LZ4) {
+#ifdef USE_LZ4
+        uint32_t rleSize;
+        if (bodySize < sizeof(rleSize)) return false;
+        memcpy(&rleSize, body, sizeof(rleSize));
+        rleSize = ntohl(rleSize);
+        deltaScratch.resize(rleSize);
+        int decoded = LZ4_decompress_safe((const char*)body + sizeof(rleSize), (char*)deltaScratch.data(),
+            (int)(bodySize - sizeof(rleSize)), (int)rleSize);
+        if (decoded != (int)rleSize) return false;
+        body = deltaScratch.data();
+        bodySize = rleSize;
+#else
+        return false;
+#endif
+    }
+    return true;
+}
+
+// Rebuilds the snapshot from its baseline and rewrites msg to point at it.
+// The baseline is patched in place unless a handler still holds it.
+bool Client::applySnapshotDelta(ReceivedMessage& msg) {
+    SnapshotBaseline& baseline = snapshotBaselines[msg.view.senderID];
+    if (!baseline.valid) {
+        if (!resyncPending) requestSnapshotResync(msg.view.senderID);
+        return false;
+    }
+
+    uint16_t sequence;
+    uint32_t rawSize;
+    const uint8_t* body;
+    size_t bodySize;
+    if (!unpackSnapshotDelta(msg.view, sequence, rawSize, body, bodySize)) {
+        requestSnapshotResync(msg.view.senderID);
+        return false;
+    }
+    if (baseline.sequence != sequence) {
+        // Deltas sent before the server saw our last resync request are expected to miss
+        if (!resyncPending) requestSnapshotResync(msg.view.senderID);
+        return false;
+    }
+
+    // Make the target hold the baseline, zero-padded to the new size
+    if (baseline.buffer.isShared() || baseline.buffer.bytes().size() < rawSize) {
+        BufferRef target = bufferPool.acquire(rawSize);
+        memcpy(target.bytes().data(), baseline.buffer.bytes().data(), std::min(baseline.size, (size_t)rawSize));
+        baseline.buffer = std::move(target);
+    }
+    uint8_t* data = baseline.buffer.bytes().data();
+    if (rawSize > baseline.size) {
+        memset(data + baseline.size, 0, rawSize - baseline.size);
+    }
+
+    if (!decodeSnapshotDelta(body, bodySize, data, rawSize)) {
+        requestSnapshotResync(msg.view.senderID);
+        return false;
+    }
+    baseline.size = rawSize;
+    baseline.sequence++;
+
+    msg.view.messageType = SNAPSHOT_MESSAGE;
+    msg.view.payload = data;
+    msg.view.payloadSize = rawSize;
+    msg.buffer = baseline.buffer.share();
+    return true;
+}
+
+// Rebuilds the match bundle from a spectator frame, then dispatches every
+// snapshot in it as though the server had relayed it. A broken delta chain
+// waits for the next keyframe instead of asking for one.
+void Client::applySpectatorFrame(ReceivedMessage& msg) {
+    size_t size;
+    if (msg.view.messageType == SPECTATOR_KEYFRAME_MESSAGE) {
+        size = msg.view.payloadSize;
+        if (!spectatorBundle || spectatorBundle.isShared() || spectatorBundle.bytes().size() < size) {
+            spectatorBundle = bufferPool.acquire(size);
+        }
+        if (size > 0) {
+            memcpy(spectatorBundle.bytes().data(), msg.view.payload, size);
+        }
+        spectatorSequence = 1;
+        spectatorValid = true;
+    }
+    else {
+        uint16_t sequence;
+        uint32_t rawSize;
+        const uint8_t* body;
+        size_t bodySize;
+        if (!spectatorValid) return;
+        if (!unpackSnapshotDelta(msg.view, sequence, rawSize, body, bodySize) || sequence != spectatorSequence) {
+            spectatorValid = false;
+            return;
+        }
+
+        // Patched in place unless a handler still holds a snapshot from it
+        if (spectatorBundle.isShared() || spectatorBundle.bytes().size() < rawSize) {
+            BufferRef target = bufferPool.acquire(rawSize);
+            memcpy(target.bytes().data(), spectatorBundle.bytes().data(), std::min(spectatorBundleSize, (size_t)rawSize));
+            spectatorBundle = std::move(target);
+        }
+        uint8_t* data = spectatorBundle.bytes().data();
+        if (rawSize > spectatorBundleSize) {
+            memset(data + spectatorBundleSize, 0, rawSize - spectatorBundleSize);
+        }
+        if (!decodeSnapshotDelta(body, bodySize, data, rawSize)) {
+            spectatorValid = false;
+            return;
+        }
+        size = rawSize;
+        spectatorSequence++;
+    }
+    spectatorBundleSize = size;
+
+    // The bundle is the players' snapshot frames back to back
+    const uint8_t* data = spectatorBundle.bytes().data();
+    size_t offset = 0;
+    while (size - offset >= sizeof(uint32_t)) {
+        uint32_t msgSize;
+        memcpy(&msgSize, data + offset, sizeof(msgSize));
+        msgSize = ntohl(msgSize);
+        if (size - offset - sizeof(uint32_t) < msgSize) break;
+
+        ReceivedMessage snapshot;
+        if (parseMessageView(data + offset + sizeof(uint32_t), msgSize, snapshot.view)) {
+            snapshot.buffer = spectatorBundle.share();
+            dispatchMessage(snapshot);
+        }
+        offset += sizeof(uint32_t) + msgSize;
+    }
+}
+
+// Applies snapshots, deltas and visibility records straight to the world
+void Client::applyToWorld(const MessageView& view) {
+    switch (view.messageType) {
+    case SNAPSHOT_MESSAGE:
+        if (world.applySnapshot(view.senderID, view.payload, view.payloadSize)) {
+            answerResync(view.senderID);
+        }
+        break;
+    case SNAPSHOT_DELTA_MESSAGE: {
+        uint16_t sequence;
+        uint32_t rawSize;
+        const uint8_t* body;
+        size_t bodySize;
+        if (!unpackSnapshotDelta(view, sequence, rawSize, body, bodySize)) {
+            requestWorldResync(view.senderID);
+            return;
+        }
+        if (!world.applyDelta(view.senderID, sequence, body, bodySize, rawSize) && !resyncPending) {
+            requestWorldResync(view.senderID);
+        }
+        break;
+    }
+    case VISIBILITY_MESSAGE: {
+        const uint8_t* entered;
+        const uint8_t* left;
+        size_t enteredCount, leftCount;
+        if (!parseVisibilityRecord(view, entered, enteredCount, left, leftCount)) return;
+        for (size_t i = 0; i < enteredCount; i++) {
+            world.create(entered[i]);
+        }
+        for (size_t i = 0; i < leftCount; i++) {
+            world.destroy(left[i]);
+        }
+        break;
+    }
+    }
+}
+
+// Voice Channel
+
+// Payload: voice port, then our voice token; the sender field is our own ID
+void Client::openVoiceChannel(const MessageView& view) {
+    if (view.payloadSize < sizeof(uint16_t) + sizeof(uint32_t) || voiceOpen.load(std::memory_order_acquire)) return;
+
+    uint16_t port;
+    memcpy(&port, view.payload, sizeof(port));
+    memcpy(&voiceToken, view.payload + sizeof(port), sizeof(voiceToken));
+    voiceToken = ntohl(voiceToken);
+    clientID = view.senderID;
+    serverAddress.sin_port = port; // Already in network order
+
+    voiceSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (voiceSocket == INVALID_SOCKET) {
+        std::cerr << "Error creating voice socket.\n";
+        return;
+    }
+#ifdef _WIN32
+    u_long mode = 1;
+    ioctlsocket(voiceSocket, FIONBIO, &mode);
+#else
+    fcntl(voiceSocket, F_SETFL, fcntl(voiceSocket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+    voiceOpen.store(true, std::memory_order_release);
+    lastKeepalive = std::chrono::steady_clock::time_point();
+    // The first keepalive registers our address right away
+    if (singleThreaded) {
+        keepVoiceAlive();
+    }
+    else {
+        voiceThread = std::thread(&Client::runVoice, this);
+    }
+}
 
-    // Start receive thread
-    receiveThread = std::thread(&Client::receiveMessages, this);
-    receiveThread.detach();
+void Client::closeVoiceChannel() {
+    if (!voiceOpen.exchange(false)) return;
+    if (voiceThread.joinable() && voiceThread.get_id() != std::this_thread::get_id()) {
+        voiceThread.join();
+    }
+    closesocket(voiceSocket);
+}
 
-    std::cout << "Connected to server.\n";
+bool Client::sendVoice(const uint8_t* frame, size_t size, uint8_t level) {
+    if (!voiceOpen.load(std::memory_order_acquire) || VOICE_HEADER_SIZE + size > VOICE_MAX_DATAGRAM) return false;
+
+    uint8_t datagram[VOICE_MAX_DATAGRAM];
+    uint32_t token = htonl(voiceToken);
+    uint16_t sequence = htons(size > 0 ? voiceSequence++ : 0); // Keepalives come from the voice thread and do not count
+    datagram[0] = VOICE_MESSAGE;
+    datagram[1] = clientID;
+    memcpy(datagram + 2, &token, sizeof(token));
+    memcpy(datagram + 6, &sequence, sizeof(sequence));
+    datagram[8] = level;
+    if (size > 0) {
+        memcpy(datagram + VOICE_HEADER_SIZE, frame, size);
+    }
+    return sendto(voiceSocket, (const char*)datagram, (int)(VOICE_HEADER_SIZE + size), 0,
+        (const sockaddr*)&serverAddress, sizeof(serverAddress)) != SOCKET_ERROR;
+}
 
-    return true;
+// A datagram without a frame tells the server where we listen
+void Client::keepVoiceAlive() {
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastKeepalive < VOICE_KEEPALIVE) return;
+    lastKeepalive = now;
+    sendVoice(nullptr, 0, 0);
 }
 
-void Client::disconnect() {
-    isConnected = false;
-    closesocket(serverSocket);
-#ifdef _WIN32
-    WSACleanup();
-#endif
+// Hands every datagram waiting on the voice socket to the voice handler
+void Client::receiveVoice() {
+    uint8_t datagram[VOICE_MAX_DATAGRAM];
+    for (;;) {
+        sockaddr_in from{};
+        socklen_t fromSize = sizeof(from);
+        int received = recvfrom(voiceSocket, (char*)datagram, sizeof(datagram), 0, (sockaddr*)&from, &fromSize);
+        if (received < 0) return;
+        if (from.sin_addr.s_addr != serverAddress.sin_addr.s_addr || from.sin_port != serverAddress.sin_port) continue;
+        if ((size_t)received <= VOICE_HEADER_SIZE || datagram[0] != VOICE_MESSAGE) continue;
+        if (voiceHandler) {
+            voiceHandler(datagram[1], datagram[8], datagram + VOICE_HEADER_SIZE, received - VOICE_HEADER_SIZE);
+        }
+    }
 }
 
-void Client::sendMessage(BaseMessage* msg) {
-    std::vector<uint8_t> buffer;
-    serializeMessage(msg, buffer);
+void Client::runVoice() {
+    WSAPOLLFD entry{};
+    entry.fd = voiceSocket;
+    entry.events = POLLIN;
+    while (voiceOpen.load(std::memory_order_acquire)) {
+        // The timeout paces keepalives and bounds how long closing waits
+        if (WSAPoll(&entry, 1, 100) > 0) {
+            receiveVoice();
+        }
+        keepVoiceAlive();
+    }
+}
 
-    uint32_t msgSize = htonl(buffer.size());
+// Decode Worker
 
-    send(serverSocket, (char*)&msgSize, sizeof(msgSize), 0);
-    send(serverSocket, (char*)buffer.data(), buffer.size(), 0);
+void Client::queueForDecode(ReceivedMessage&& msg) {
+    {
+        std::lock_guard<std::mutex> lock(decodeMutex);
+        decodeQueue.push_back(std::move(msg));
+    }
+    decodeReady.notify_one();
 }
 
-void Client::receiveMessages() {
-    while (isConnected) {
-        uint32_t msgSize;
-        int bytesReceived = recv(serverSocket, (char*)&msgSize, sizeof(msgSize), 0);
-        if (bytesReceived <= 0) {
-            break;
+// Applies everything queued so far to the world, then publishes the result.
+// Publishing copies only the rows changed since the ready copy last caught up.
+void Client::decodeSnapshots() {
+    std::vector<ReceivedMessage> batch;
+    std::unique_lock<std::mutex> lock(decodeMutex);
+    while (decodeRunning) {
+        if (decodeQueue.empty()) {
+            decodeReady.wait(lock);
+            continue;
         }
-        msgSize = ntohl(msgSize);
+        batch.swap(decodeQueue);
+        lock.unlock();
 
-        std::vector<uint8_t> buffer(msgSize);
-        size_t totalReceived = 0;
-        while (totalReceived < msgSize) {
-            bytesReceived = recv(serverSocket, (char*)buffer.data() + totalReceived, msgSize - totalReceived, 0);
-            if (bytesReceived <= 0) {
-                break;
-            }
-            totalReceived += bytesReceived;
+        for (ReceivedMessage& msg : batch) {
+            applyToWorld(msg.view);
         }
-        if (bytesReceived <= 0) {
-            break;
-        }
-
-        BaseMessage* msg = deserializeMessage(buffer);
-        if (msg) {
-            sortMessageByType(msg); // Call renamed function
-            delete msg;
+        batch.clear(); // Releases the buffers back to the pool
+        {
+            std::lock_guard<std::mutex> worldLock(worldMutex);
+            readyWorld.copyChangedFrom(world);
+            worldPublished = true;
         }
+        lock.lock();
     }
-
-    disconnect();
 }
 
-void Client::sortMessageByType(BaseMessage* msg) {
-    std::lock_guard<std::mutex> lock(messageMutex); // Lock for thread safety
-
-    switch (msg->messageType) {
-    case TEXT_MESSAGE: {
-        TextMessage* tm = static_cast<TextMessage*>(msg);
-        textMessages.push_back(*tm);
-        break;
+void Client::stopDecodeWorker() {
+    {
+        std::lock_guard<std::mutex> lock(decodeMutex);
+        if (!decodeRunning) return;
+        decodeRunning = false;
     }
-    case EVENT_MESSAGE: {
-        EventMessage* em = static_cast<EventMessage*>(msg);
-        eventMessages.push_back(*em);
-        break;
+    decodeReady.notify_one();
+    if (decodeThread.joinable()) {
+        decodeThread.join();
     }
-    case SNAPSHOT_MESSAGE: {
-        SnapshotMessage* sm = static_cast<SnapshotMessage*>(msg);
-        snapshotMessages[sm->senderID] = *sm;
-        break;
+}
+
+bool Client::swapWorld() {
+    std::lock_guard<std::mutex> lock(worldMutex);
+    if (!worldPublished) return false;
+    std::swap(readyWorld, frontWorld);
+    worldPublished = false;
+    return true;
+}
+
+// Runs the deferred handlers for everything queued so far
+void Client::dispatchDeferred() {
+    {
+        std::unique_lock<std::mutex> lock(messageMutex, std::defer_lock);
+        if (!singleThreaded) lock.lock(); // Lock for thread safety
+        processingMessages.swap(deferredMessages);
+        for (uint16_t key : latestKeys) {
+            latestSlots[key] = 0;
+        }
+        latestKeys.clear();
     }
+
+    // Handlers run outside the lock, so the receive thread is never held up
+    for (ReceivedMessage& msg : processingMessages) {
+        handlers[msg.view.messageType].handler(msg);
     }
+    processingMessages.clear(); // Releases the buffers back to the pool
 }
+
 void Client::processMessages() {
     while (isConnected) {
-        {
-            std::lock_guard<std::mutex> lock(messageMutex); // Lock for thread safety
-
-            // Process and remove each TextMessage
-            for (auto it = textMessages.begin(); it != textMessages.end(); ) {
-                displayTextMessage(&(*it));
-                it = textMessages.erase(it); // Erase and advance the iterator
-            }
-
-            // Process and remove each EventMessage
-            for (auto it = eventMessages.begin(); it != eventMessages.end(); ) {
-                processEventMessage(&(*it));
-                it = eventMessages.erase(it); // Erase and advance the iterator
-            }
-
-            // Process and remove each SnapshotMessage
-            for (auto it = snapshotMessages.begin(); it != snapshotMessages.end(); ) {
-                processSnapshotMessage(&it->second);
-                it = snapshotMessages.erase(it); // Erase and advance the iterator
-            }
-        }
+        dispatchDeferred();
 
         std::this_thread::sleep_for(std::chrono::milliseconds(100)); // Prevent tight loop
     }
 }
 
-void Client::displayTextMessage(TextMessage* tm) {
-    std::cout << "Received text message from Client " << (int)tm->senderID << ": ";
-    for (auto ch : tm->text) {
-        std::cout << (char)ch;
-    }
+void Client::displayTextMessage(const MessageView& view) {
+    std::cout << "Received text message from Client " << (int)view.senderID << ": ";
+    std::cout.write((const char*)view.payload, view.payloadSize);
     std::cout << std::endl;
 }
 
-void Client::processEventMessage(EventMessage* em) {
-    std::cout << "Processing event message from Client " << (int)em->senderID << std::endl;
+void Client::processEventMessage(const MessageView& view) {
+    std::cout << "Processing event message from Client " << (int)view.senderID << std::endl;
+}
+
+void Client::processSnapshotMessage(const MessageView& view) {
+    std::cout << "Received snapshot from Client " << (int)view.senderID << std::endl;
 }
 
-void Client::processSnapshotMessage(SnapshotMessage* sm) {
-    std::cout << "Received snapshot from Client " << (int)sm->senderID << std::endl;
+void Client::processVisibilityMessage(const MessageView& view) {
+    const uint8_t* entered;
+    const uint8_t* left;
+    size_t enteredCount, leftCount;
+    if (!parseVisibilityRecord(view, entered, enteredCount, left, leftCount)) return;
+
+    for (size_t i = 0; i < enteredCount; i++) {
+        std::cout << "Client " << (int)entered[i] << " came into view" << std::endl;
+    }
+    for (size_t i = 0; i < leftCount; i++) {
+        std::cout << "Client " << (int)left[i] << " went out of view" << std::endl;
+    }
 }
 
 // Serialization Function
@@ -265,7 +1707,8 @@ void serializeMessage(BaseMessage* msg, std::vector<uint8_t>& buffer) {
         buffer.insert(buffer.end(), tm->text.begin(), tm->text.end());
         break;
     }
-    case EVENT_MESSAGE: {
+    case EVENT_MESSAGE:
+    case COSMETIC_EVENT_MESSAGE: {
         EventMessage* em = static_cast<EventMessage*>(msg);
         uint32_t length = htonl(em->eventData.size());
         buffer.insert(buffer.end(), (uint8_t*)&length, (uint8_t*)&length + sizeof(length));
@@ -282,6 +1725,477 @@ void serializeMessage(BaseMessage* msg, std::vector<uint8_t>& buffer) {
     }
 }
 
+// Latest Snapshot Store
+
+void LatestSnapshotStore::enable(size_t maxSnapshotBytes) {
+    capacity = maxSnapshotBytes;
+    storage.reset(new uint8_t[MAX_SENDERS * 3 * capacity]);
+    slots.reset(new Slot[MAX_SENDERS]);
+    for (size_t i = 0; i < MAX_SENDERS; i++) {
+        Slot& slot = slots[i];
+        slot.middle.store(1, std::memory_order_relaxed);
+        slot.back = 0;
+        slot.front = 2;
+        slot.published = 0;
+        for (int b = 0; b < 3; b++) {
+            slot.sizes[b] = 0;
+            slot.sequences[b] = 0;
+        }
+    }
+}
+
+// Copies the snapshot into the writer's buffer and swaps it with the shared one.
+// Snapshots larger than the configured capacity are dropped.
+bool LatestSnapshotStore::publish(uint8_t senderID, const uint8_t* data, size_t size) {
+    if (size > capacity) {
+        droppedSnapshots.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    Slot& slot = slots[senderID];
+    memcpy(bufferFor(senderID, slot.back), data, size);
+    slot.sizes[slot.back] = (uint32_t)size;
+    slot.sequences[slot.back] = ++slot.published;
+
+    uint8_t previous = slot.middle.exchange(slot.back | DIRTY_BIT, std::memory_order_acq_rel);
+    slot.back = previous & ~DIRTY_BIT;
+    return true;
+}
+
+// Returns the newest snapshot from the sender. The data stays valid until the
+// next read() for the same sender. Returns false if nothing was ever published.
+bool LatestSnapshotStore::read(uint8_t senderID, const uint8_t*& data, size_t& size, uint64_t& sequence) {
+    if (!isEnabled()) return false;
+
+    Slot& slot = slots[senderID];
+    if (slot.middle.load(std::memory_order_relaxed) & DIRTY_BIT) {
+        uint8_t previous = slot.middle.exchange(slot.front, std::memory_order_acq_rel);
+        slot.front = previous & ~DIRTY_BIT;
+    }
+
+    sequence = slot.sequences[slot.front];
+    if (sequence == 0) return false;
+    data = bufferFor(senderID, slot.front);
+    size = slot.sizes[slot.front];
+    return true;
+}
+
+// World Mirror
+
+WorldMirror::WorldMirror() : stateCapacity(0), entityCount(0), droppedSnapshots(0) {
+    for (int16_t& slot : slotBySender) {
+        slot = -1;
+    }
+}
+
+void WorldMirror::enable(size_t maxStateBytes) {
+    stateCapacity = maxStateBytes;
+    generations.assign(MAX_ENTITIES, 1);
+    alive.assign(MAX_ENTITIES, 0);
+    owners.assign(MAX_ENTITIES, 0);
+    stateSizes.assign(MAX_ENTITIES, 0);
+    baselineSequences.assign(MAX_ENTITIES, 0);
+    baselineValid.assign(MAX_ENTITIES, 0);
+    updates.assign(MAX_ENTITIES, 0);
+    revisions.assign(MAX_ENTITIES, 0);
+    states.assign(MAX_ENTITIES * stateCapacity, 0);
+    for (int16_t& slot : slotBySender) {
+        slot = -1;
+    }
+    freeSlots.clear();
+    for (size_t i = MAX_ENTITIES; i > 0; i--) {
+        freeSlots.push_back((uint16_t)(i - 1)); // Lowest slots are handed out first
+    }
+    entityCount = 0;
+}
+
+// Returns the sender's entity, creating it with an empty state if needed
+EntityHandle WorldMirror::create(uint8_t senderID) {
+    if (slotBySender[senderID] >= 0) return handleAt(slotBySender[senderID]);
+
+    // There are as many slots as sender IDs, so the free list never runs dry
+    uint16_t slot = freeSlots.back();
+    freeSlots.pop_back();
+    slotBySender[senderID] = (int16_t)slot;
+    alive[slot] = 1;
+    owners[slot] = senderID;
+    stateSizes[slot] = 0;
+    baselineValid[slot] = 0;
+    updates[slot] = 0;
+    revisions[slot]++;
+    entityCount++;
+    return handleAt(slot);
+}
+
+void WorldMirror::destroy(uint8_t senderID) {
+    int16_t slot = slotBySender[senderID];
+    if (slot < 0) return;
+
+    slotBySender[senderID] = -1;
+    alive[slot] = 0;
+    if (++generations[slot] == 0) generations[slot] = 1;
+    revisions[slot]++;
+    freeSlots.push_back((uint16_t)slot);
+    entityCount--;
+}
+
+EntityHandle WorldMirror::find(uint8_t senderID) const {
+    int16_t slot = slotBySender[senderID];
+    return slot < 0 ? INVALID_ENTITY : handleAt(slot);
+}
+
+// Copies a full snapshot into the sender's row, which becomes the baseline
+// for its next delta. Snapshots larger than the configured capacity are dropped.
+bool WorldMirror::applySnapshot(uint8_t senderID, const uint8_t* data, size_t size) {
+    size_t slot = create(senderID) & 0xFFFF;
+    if (size > stateCapacity) {
+        baselineValid[slot] = 0;
+        droppedSnapshots++;
+        return false;
+    }
+
+    if (size > 0) {
+        memcpy(rowFor(slot), data, size);
+    }
+    stateSizes[slot] = (uint32_t)size;
+    baselineSequences[slot] = 1;
+    baselineValid[slot] = 1;
+    updates[slot]++;
+    revisions[slot]++;
+    return true;
+}
+
+// Decodes the delta straight into the sender's row, which holds its baseline
+bool WorldMirror::applyDelta(uint8_t senderID, uint16_t sequence, const uint8_t* delta, size_t deltaSize, uint32_t rawSize) {
+    int16_t slot = slotBySender[senderID];
+    if (slot < 0 || !baselineValid[slot] || baselineSequences[slot] != sequence || rawSize > stateCapacity) return false;
+
+    uint8_t* row = rowFor(slot);
+    if (rawSize > stateSizes[slot]) {
+        memset(row + stateSizes[slot], 0, rawSize - stateSizes[slot]);
+    }
+    if (!decodeSnapshotDelta(delta, deltaSize, row, rawSize)) {
+        // The row may be half patched, so it can no longer serve as a baseline
+        baselineValid[slot] = 0;
+        revisions[slot]++;
+        return false;
+    }
+    stateSizes[slot] = rawSize;
+    baselineSequences[slot]++;
+    updates[slot]++;
+    revisions[slot]++;
+    return true;
+}
+
+// Rows keep their state for reading, but the next snapshot must be a full one
+void WorldMirror::invalidateBaselines() {
+    std::fill(baselineValid.begin(), baselineValid.end(), 0);
+}
+
+// Both copies must come from the same writer, so equal revisions mean equal rows
+void WorldMirror::copyChangedFrom(const WorldMirror& other) {
+    if (stateCapacity != other.stateCapacity) {
+        *this = other;
+        return;
+    }
+
+    for (size_t slot = 0; slot < other.revisions.size(); slot++) {
+        if (revisions[slot] != other.revisions[slot] && other.alive[slot] && other.stateSizes[slot] > 0) {
+            memcpy(rowFor(slot), other.getStateData(slot), other.stateSizes[slot]);
+        }
+    }
+    generations = other.generations;
+    alive = other.alive;
+    owners = other.owners;
+    stateSizes = other.stateSizes;
+    baselineSequences = other.baselineSequences;
+    baselineValid = other.baselineValid;
+    updates = other.updates;
+    revisions = other.revisions;
+    memcpy(slotBySender, other.slotBySender, sizeof(slotBySender));
+    freeSlots = other.freeSlots;
+    entityCount = other.entityCount;
+    droppedSnapshots = other.droppedSnapshots;
+}
+
+bool WorldMirror::getState(EntityHandle handle, const uint8_t*& data, size_t& size) const {
+    size_t slot = handle & 0xFFFF;
+    if (handle == INVALID_ENTITY || slot >= alive.size() || !alive[slot] || generations[slot] != handle >> 16) return false;
+
+    data = getStateData(slot);
+    size = stateSizes[slot];
+    return true;
+}
+
+// Transport
+
+int SocketTransport::send(const uint8_t* data, size_t size) {
+    int bytesSent = ::send(socket, (const char*)data, (int)size, 0);
+    if (bytesSent >= 0) return bytesSent;
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK ? WOULD_BLOCK : FAILED;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? WOULD_BLOCK : FAILED;
+#endif
+}
+
+int SocketTransport::receive(uint8_t* data, size_t size) {
+    int bytesReceived = ::recv(socket, (char*)data, (int)size, 0);
+    if (bytesReceived >= 0) return bytesReceived;
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK ? WOULD_BLOCK : FAILED;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? WOULD_BLOCK : FAILED;
+#endif
+}
+
+void SocketTransport::setBlocking(bool blocking) {
+#ifdef _WIN32
+    u_long mode = blocking ? 0 : 1;
+    ioctlsocket(socket, FIONBIO, &mode);
+#else
+    int flags = fcntl(socket, F_GETFL, 0);
+    fcntl(socket, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#endif
+}
+
+bool SocketTransport::isWritable() {
+    WSAPOLLFD entry{};
+    entry.fd = socket;
+    entry.events = POLLOUT;
+    return WSAPoll(&entry, 1, 0) > 0 && (entry.revents & POLLOUT);
+}
+
+bool SocketTransport::waitReadable(int timeoutMs) {
+    WSAPOLLFD entry{};
+    entry.fd = socket;
+    entry.events = POLLIN;
+    return WSAPoll(&entry, 1, timeoutMs) > 0;
+}
+
+// Memory Link
+
+int MemoryLink::write(const uint8_t* data, size_t size, bool blocking) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (blocking) changed.wait(lock, [this]() { return closed || used < ring.size(); });
+    if (closed) return Transport::FAILED;
+    if (used == ring.size()) return Transport::WOULD_BLOCK;
+
+    size = std::min(size, ring.size() - used);
+    size_t tail = (head + used) % ring.size();
+    size_t first = std::min(size, ring.size() - tail);
+    memcpy(ring.data() + tail, data, first);
+    memcpy(ring.data(), data + first, size - first);
+    used += size;
+    changed.notify_all();
+    return (int)size;
+}
+
+int MemoryLink::read(uint8_t* data, size_t size, bool blocking) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (blocking) changed.wait(lock, [this]() { return closed || used > 0; });
+    if (used == 0) return closed ? 0 : Transport::WOULD_BLOCK;
+
+    size = std::min(size, used);
+    size_t first = std::min(size, ring.size() - head);
+    memcpy(data, ring.data() + head, first);
+    memcpy(data + first, ring.data(), size - first);
+    head = (head + size) % ring.size();
+    used -= size;
+    changed.notify_all();
+    return (int)size;
+}
+
+bool MemoryLink::waitReadable(int timeoutMs) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return changed.wait_for(lock, std::chrono::milliseconds(std::max(timeoutMs, 0)), [this]() { return closed || used > 0; });
+}
+
+bool MemoryLink::hasRoom() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return !closed && used < ring.size();
+}
+
+void MemoryLink::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    changed.notify_all();
+}
+
+void MemoryTransport::createPair(size_t capacity, std::unique_ptr<Transport>& first, std::unique_ptr<Transport>& second) {
+    std::shared_ptr<MemoryLink> forward = std::make_shared<MemoryLink>(capacity);
+    std::shared_ptr<MemoryLink> backward = std::make_shared<MemoryLink>(capacity);
+    first.reset(new MemoryTransport(backward, forward));
+    second.reset(new MemoryTransport(forward, backward));
+}
+
+// Buffer Pool
+
+BufferRef& BufferRef::operator=(BufferRef&& other) noexcept {
+    if (this != &other) {
+        reset();
+        buffer = other.buffer;
+        other.buffer = nullptr;
+    }
+    return *this;
+}
+
+BufferRef BufferRef::share() const {
+    buffer->refs.fetch_add(1, std::memory_order_relaxed);
+    return BufferRef(buffer);
+}
+
+void BufferRef::reset() {
+    if (buffer && buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        buffer->pool->release(buffer);
+    }
+    buffer = nullptr;
+}
+
+BufferPool::~BufferPool() {
+    for (PooledBuffer* buffer : freeBuffers) {
+        delete buffer;
+    }
+}
+
+// Returns a buffer with at least the requested size
+BufferRef BufferPool::acquire(size_t capacity) {
+    PooledBuffer* buffer = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(poolMutex, std::defer_lock);
+        if (threadSafe) lock.lock();
+        if (!freeBuffers.empty()) {
+            buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+        }
+        peakInUse = std::max(peakInUse, ++inUse);
+    }
+    if (!buffer) {
+        buffer = new PooledBuffer();
+        buffer->pool = this;
+    }
+
+    buffer->refs.store(1, std::memory_order_relaxed);
+    if (buffer->data.size() < capacity) {
+        buffer->data.resize(capacity);
+    }
+    return BufferRef(buffer);
+}
+
+void BufferPool::release(PooledBuffer* buffer) {
+    {
+        std::unique_lock<std::mutex> lock(poolMutex, std::defer_lock);
+        if (threadSafe) lock.lock();
+        inUse--;
+        if (freeBuffers.size() < std::max(MAX_FREE_BUFFERS, peakInUse)) {
+            freeBuffers.push_back(buffer);
+            return;
+        }
+    }
+    delete buffer;
+}
+
+// Snapshot Delta Decoding
+// Deltas are alternating varint runs: unchanged byte count, then literal byte
+// count followed by that many bytes to XOR into the baseline.
+
+// data ^= delta
+void xorInPlace(uint8_t* data, const uint8_t* delta, size_t n) {
+    size_t i = 0;
+#ifdef SNAPSHOT_DELTA_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i vd = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i vx = _mm_loadu_si128((const __m128i*)(delta + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(vd, vx));
+    }
+#endif
+    for (; i < n; i++) {
+        data[i] ^= delta[i];
+    }
+}
+
+bool readVarint(const uint8_t*& in, const uint8_t* end, size_t& value) {
+    value = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        value |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Applies a delta to target, which holds the baseline zero-padded to size
+bool decodeSnapshotDelta(const uint8_t* delta, size_t deltaSize, uint8_t* target, size_t size) {
+    const uint8_t* in = delta;
+    const uint8_t* end = delta + deltaSize;
+    size_t pos = 0;
+
+    while (in < end) {
+        size_t unchanged, literal;
+        if (!readVarint(in, end, unchanged) || !readVarint(in, end, literal)) return false;
+        if (unchanged > size - pos) return false;
+        pos += unchanged;
+        if (literal > size - pos || literal > (size_t)(end - in)) return false;
+        xorInPlace(target + pos, in, literal);
+        in += literal;
+        pos += literal;
+    }
+    return true;
+}
+
+// Size of a length-prefixed frame carrying a payload of the given size
+size_t frameSize(size_t payloadSize) {
+    return sizeof(uint32_t) + 2 + sizeof(uint32_t) + payloadSize;
+}
+
+// Encodes a length-prefixed frame in place, without building a message object
+void appendFrame(std::vector<uint8_t>& buffer, uint8_t type, uint8_t sender, const uint8_t* data, size_t size) {
+    size_t offset = buffer.size();
+    buffer.resize(offset + frameSize(size));
+    uint8_t* out = buffer.data() + offset;
+
+    uint32_t msgSize = htonl((uint32_t)(2 + sizeof(uint32_t) + size));
+    uint32_t length = htonl((uint32_t)size);
+    memcpy(out, &msgSize, sizeof(msgSize));
+    out[4] = type;
+    out[5] = sender;
+    memcpy(out + 6, &length, sizeof(length));
+    if (size > 0) {
+        memcpy(out + 10, data, size);
+    }
+}
+
+// Parses a frame in place. All message types share the same layout:
+// type, sender, 4-byte payload length, payload.
+bool parseMessageView(const uint8_t* data, size_t size, MessageView& view) {
+    if (size < 2 + sizeof(uint32_t)) return false;
+
+    uint32_t length;
+    memcpy(&length, data + 2, sizeof(length));
+    length = ntohl(length);
+    if (size - 2 - sizeof(uint32_t) < length) return false;
+
+    view.messageType = data[0];
+    view.senderID = data[1];
+    view.payload = data + 2 + sizeof(uint32_t);
+    view.payloadSize = length;
+    return true;
+}
+
+// Payload: entered count, entered IDs, left count, left IDs
+bool parseVisibilityRecord(const MessageView& view, const uint8_t*& entered, size_t& enteredCount,
+    const uint8_t*& left, size_t& leftCount) {
+    const uint8_t* data = view.payload;
+    size_t size = view.payloadSize;
+    if (size < 1 || size < 2 + (size_t)data[0]) return false;
+
+    enteredCount = data[0];
+    entered = data + 1;
+    leftCount = data[1 + enteredCount];
+    left = data + 2 + enteredCount;
+    return size == 2 + enteredCount + leftCount;
+}
+
 // Deserialization Function
 BaseMessage* deserializeMessage(const std::vector<uint8_t>& buffer) {
     if (buffer.size() < 2) return nullptr;
@@ -303,7 +2217,8 @@ BaseMessage* deserializeMessage(const std::vector<uint8_t>& buffer) {
         std::string text(buffer.begin() + offset, buffer.begin() + offset + length);
         return new TextMessage(senderID, text);
     }
-    case EVENT_MESSAGE: {
+    case EVENT_MESSAGE:
+    case COSMETIC_EVENT_MESSAGE: {
         if (buffer.size() < offset + 4) return nullptr;
         uint32_t length;
         memcpy(&length, &buffer[offset], 4);
@@ -313,7 +2228,7 @@ BaseMessage* deserializeMessage(const std::vector<uint8_t>& buffer) {
         if (buffer.size() < offset + length) return nullptr;
 
         std::string data(buffer.begin() + offset, buffer.begin() + offset + length);
-        return new EventMessage(senderID, data);
+        return new EventMessage(senderID, data, messageType == COSMETIC_EVENT_MESSAGE);
     }
     case SNAPSHOT_MESSAGE: {
         if (buffer.size() < offset + 4) return nullptr;
@@ -332,13 +2247,148 @@ BaseMessage* deserializeMessage(const std::vector<uint8_t>& buffer) {
     }
 }
 
-int main() {
+#ifdef CLIENT_ALLOC_TEST
+// Allocation Counting
+// Every heap allocation in the process is counted, so the self-test can
+// check that receiving allocates nothing once the buffer pool is warm
+std::atomic<uint64_t> heapAllocations(0);
+
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* block = malloc(size ? size : 1)) return block;
+    throw std::bad_alloc();
+}
+
+// GCC flags free() once it inlines these into a new-expression's cleanup
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* block) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+    free(block);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// A sender on the other end of a memory link writes the snapshots in bursts
+// while the client receives them with its normal path and mode. Each payload starts with its index, so
+// the handler knows how far it got even when LATEST_PER_SENDER skips some,
+// and the sender stays at most two bursts ahead of it: the steady state of a
+// client that keeps up. The sender and the waiting thread do not allocate, so
+// whatever is counted is the receive path's.
+uint64_t Client::measureReceiveAllocations(bool singleThreadedMode, DispatchMode mode, size_t messages) {
+    std::unique_ptr<Transport> clientEnd;
+    std::unique_ptr<Transport> peer;
+    MemoryTransport::createPair(SELF_TEST_LINK_BYTES, clientEnd, peer);
+
+    std::vector<uint8_t> frames;
+    std::vector<uint8_t> payload(SELF_TEST_SNAPSHOT_SIZE);
+    for (size_t i = 0; i < messages; i++) {
+        uint32_t index = (uint32_t)i;
+        memcpy(payload.data(), &index, sizeof(index));
+        appendFrame(frames, SNAPSHOT_MESSAGE, (uint8_t)(1 + i % SELF_TEST_SENDERS), payload.data(), payload.size());
+    }
+
+    std::atomic<bool> done(false);
+    std::atomic<size_t> handledThrough(0); // One past the highest index a handler has seen
+    std::thread sender([&]() {
+        const size_t frameBytes = frameSize(SELF_TEST_SNAPSHOT_SIZE);
+        for (size_t next = 0; next < messages && !done; next += SELF_TEST_BURST) {
+            while (!done && handledThrough + SELF_TEST_BURST < next) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            size_t sent = next * frameBytes;
+            size_t burstEnd = std::min(messages, next + SELF_TEST_BURST) * frameBytes;
+            while (sent < burstEnd) {
+                int bytesSent = peer->send(frames.data() + sent, burstEnd - sent);
+                if (bytesSent <= 0) break;
+                sent += bytesSent;
+            }
+        }
+        while (!done) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        peer->close();
+    });
+
+    Client client;
+    std::atomic<bool> warm(false);
+    std::atomic<bool> finished(false);
+    std::atomic<uint64_t> before(0);
+    std::atomic<uint64_t> after(0);
+    size_t warmup = std::max<size_t>(1, messages / 4);
+    client.setMessageHandler(SNAPSHOT_MESSAGE, [&](ReceivedMessage& msg) {
+        uint32_t index;
+        memcpy(&index, msg.view.payload, sizeof(index));
+        handledThrough = std::max<size_t>(handledThrough, index + 1);
+        if (index >= warmup && !warm.exchange(true)) before = heapAllocations.load(std::memory_order_relaxed);
+        if (index == messages - 1) {
+            after = heapAllocations.load(std::memory_order_relaxed);
+            finished = true;
+        }
+    }, mode);
+
+    // Deferred handlers run from this thread in threaded mode, as processMessages() would
+    client.connectTransport(std::move(clientEnd), singleThreadedMode);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!finished && std::chrono::steady_clock::now() < deadline) {
+        if (singleThreadedMode) {
+            client.step(10);
+            continue;
+        }
+        if (mode != DISPATCH_IMMEDIATE) client.dispatchDeferred();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // The receive thread is detached, so let it see the sender hang up and
+    // finish before the client goes away
+    done = true;
+    sender.join();
+    if (singleThreadedMode) {
+        client.disconnect();
+    }
+    else {
+        while (client.isConnected && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return finished && warm ? after - before : UINT64_MAX;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+#ifdef CLIENT_ALLOC_TEST
+    if (argc > 1 && std::string(argv[1]) == "--alloc-test") {
+        // Received payloads must not be copied or allocated once the pool is warm
+        struct { const char* name; bool singleThreaded; DispatchMode mode; } cases[] = {
+            { "receive thread, immediate", false, DISPATCH_IMMEDIATE },
+            { "receive thread, deferred", false, DISPATCH_DEFERRED },
+            { "receive thread, latest per sender", false, DISPATCH_LATEST_PER_SENDER },
+            { "single-threaded, immediate", true, DISPATCH_IMMEDIATE },
+            { "single-threaded, deferred", true, DISPATCH_DEFERRED },
+        };
+        bool passed = true;
+        for (const auto& test : cases) {
+            uint64_t allocations = Client::measureReceiveAllocations(test.singleThreaded, test.mode, SELF_TEST_MESSAGES);
+            if (allocations == UINT64_MAX) std::cout << test.name << ": failed to run\n";
+            else std::cout << test.name << ": " << allocations << " allocations receiving the last " << SELF_TEST_MESSAGES * 3 / 4 << " snapshots\n";
+            passed = passed && allocations == 0;
+        }
+        return passed ? 0 : 1;
+    }
+#endif
+
     Client client;
     std::string serverIP;
 
     std::cout << "Enter server IP address: ";
     std::cin >> serverIP;
 
+    client.enableSnapshotDeltas();
     if (!client.connectToServer(serverIP)) {
         std::cerr << "Failed to connect to server.\n";
         return 1;
@@ -350,7 +2400,7 @@ int main() {
     std::thread processingThread(&Client::processMessages, &client);
 
     while (true) {
-        std::cout << "Enter message type (0: Text, 1: Event, 2: Snapshot, 9: Exit): ";
+        std::cout << "Enter message type (0: Text, 1: Event, 2: Snapshot, 3: Player state, 4: Cosmetic event, 5: Voice, 6: Identify, 8: Toggle snapshot coalescing, 9: Exit): ";
         int msgType;
         std::cin >> msgType;
         std::cin.ignore();
@@ -359,6 +2409,11 @@ int main() {
         if (msgType == 9) {
             break;
         }
+        if (msgType == 8) {
+            client.setSnapshotCoalescing(!client.isSnapshotCoalescing());
+            std::cout << "Snapshot coalescing " << (client.isSnapshotCoalescing() ? "enabled" : "disabled") << ".\n";
+            continue;
+        }
 
         std::cout << "Enter message content: ";
         std::string content;
@@ -378,12 +2433,42 @@ int main() {
             delete msg;
             break;
         case SNAPSHOT_MESSAGE:
-            for (int i = 0; i < 1999999; i++) {
-                msg = new SnapshotMessage(0, content);
-                client.sendMessage(msg);
-                delete msg;
+            client.sendSnapshotBatch(1999999, [&content](size_t) -> const std::string& { return content; });
+            break;
+        case 3: {
+            // "x y z team"
+            std::istringstream fields(content);
+            float x = 0, y = 0, z = 0;
+            int team = 0;
+            if (!(fields >> x >> y >> z)) {
+                std::cout << "Expected: x y z [team]\n";
+                continue;
+            }
+            fields >> team;
+            client.sendPlayerState(x, y, z, (uint8_t)team);
+            break;
+        }
+        case 4:
+            msg = new EventMessage(0, content, true);
+            client.sendMessage(msg);
+            delete msg;
+            break;
+        case 5:
+            // Stands in for a codec frame, at full level
+            if (!client.sendVoice((const uint8_t*)content.data(), content.size(), 255)) {
+                std::cout << "Voice channel not open.\n";
+            }
+            break;
+        case 6: {
+            uint64_t playerID = 0;
+            std::istringstream(content) >> playerID;
+            if (playerID == 0) {
+                std::cout << "Expected a non-zero player ID.\n";
+                continue;
             }
+            client.identify(playerID);
             break;
+        }
         default:
             std::cout << "Invalid message type.\n";
             continue;
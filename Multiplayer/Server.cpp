@@ -2,9 +2,34 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <map>
 #include <cstring>
 #include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <coroutine>
+#include <string>
+#include <queue>
+#include <deque>
+#include <random>
+#include <fstream>
+#include <filesystem>
+#include <sstream>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SNAPSHOT_DELTA_SSE2
+#endif
+
+// Optional LZ4 pass over snapshot deltas; define USE_LZ4 and link liblz4 to enable
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
 
 // Platform-specific includes
 #ifdef _WIN32
@@ -14,20 +39,170 @@
 typedef int socklen_t;
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
 #define SOCKET int
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
+#define closesocket close
+#define WSAPoll poll
+typedef pollfd WSAPOLLFD;
 #endif
 
 #define PORT 54000
 
+// Reactor Constants
+const unsigned MAX_REACTOR_THREADS = 4;
+const std::chrono::milliseconds TICK_INTERVAL(16);
+const size_t RECV_CHUNK_SIZE = 64 * 1024;
+const size_t SEND_HIGH_WATER = 256 * 1024;    // send() suspends the handler above this
+const size_t MAX_OUTBOUND_BYTES = 16 * 1024 * 1024; // Frames are dropped for clients this far behind
+const size_t BROADCAST_RING_SIZE = 1024;     // Entries per reactor, must be a power of two
+
+// Pipeline Constants
+const size_t PIPELINE_QUEUE_SIZE = 4096;     // Entries per stage queue, must be a power of two
+const size_t PIPELINE_BATCH_SIZE = 64;       // Most items a stage takes from one queue at a time
+const unsigned PIPELINE_SLEEP_ROUNDS = 4096;  // Idle rounds before a stage sleeps, whatever the wait strategy
+const unsigned PIPELINE_DEEP_SLEEP_ROUNDS = PIPELINE_SLEEP_ROUNDS + 1000; // Then its sleeps lengthen to a millisecond
+
+// Match Constants
+const unsigned DEFAULT_TICK_RATE = 60;
+const unsigned MAX_MATCH_WORKERS = 4;
+const unsigned MATCH_TICK_BUDGET_PERCENT = 25; // Share of its tick interval one match may spend ticking
+
+// Snapshot Rate Constants
+// Each match tick picks how often every member receives each other member's
+// snapshot, from how relevant the sender is and how well the link keeps up.
+const unsigned SNAPSHOT_RATE_NEAR = 60;        // Teammates and members within RELEVANCE_NEAR_DISTANCE
+const unsigned SNAPSHOT_RATE_MID = 30;
+const unsigned SNAPSHOT_RATE_FAR = 10;         // Beyond RELEVANCE_FAR_DISTANCE, or idle senders
+const unsigned SNAPSHOT_RATE_MIN = 2;
+const float RELEVANCE_NEAR_DISTANCE = 50.0f;
+const float RELEVANCE_FAR_DISTANCE = 200.0f;
+const unsigned IDLE_AFTER_SECONDS = 2;         // Senders that have not moved for this long count as idle
+const uint32_t LINK_SLOW_RTT_MICROS = 150000;  // Rates halve above this RTT, and halve again above twice it
+const unsigned LINK_CONGESTED_SECONDS = 2;     // Rates stay at a quarter this long after a dropped frame
+const uint64_t PING_INTERVAL_TICKS = 60;       // Reactor ticks between RTT probes
+const float RELEVANCE_VISIBLE_DISTANCE = 400.0f; // Members farther than this are out of view, unless teammates
+
+// Overload Governor Constants
+const std::chrono::milliseconds GOVERNOR_INTERVAL(500);
+const unsigned GOVERNOR_RAISE_AFTER = 2;       // Overloaded samples in a row before degrading one more level
+const unsigned GOVERNOR_LOWER_AFTER = 10;      // Calm samples in a row before recovering one level
+const double OVERLOAD_TICK_LATE = 0.05;        // Share of match ticks that were late or over budget
+const double OVERLOAD_CPU = 0.85;              // Process CPU time per core
+const double OVERLOAD_BACKLOGGED = 0.10;       // Share of clients with output above SEND_HIGH_WATER
+const double OVERLOAD_PIPELINE_FILL = 0.50;    // Fullest pipeline queue
+const double CALM_TICK_LATE = 0.01;            // Recovery needs every signal below these
+const double CALM_CPU = 0.60;
+const double CALM_BACKLOGGED = 0.02;
+const double CALM_PIPELINE_FILL = 0.10;
+
+// Degradation levels, each one including the ones before it
+enum DegradationLevel {
+    DEGRADE_NONE,
+    DEGRADE_SNAPSHOT_RATE,  // Snapshot rates halve
+    DEGRADE_INTEREST,       // Relevance distances halve, so fewer members count as near
+    DEGRADE_COSMETIC,       // Cosmetic events are dropped instead of relayed
+    DEGRADE_REJECT_JOINS,   // New connections are turned away
+    DEGRADE_LEVEL_COUNT
+};
+
+// Voice Constants
+// Voice travels as UDP datagrams on its own port: type, sender, token,
+// sequence, level, then the codec frame, which the server never looks at.
+const uint16_t VOICE_PORT = PORT + 1;
+const size_t VOICE_HEADER_SIZE = 1 + 1 + 4 + 2 + 1;
+const size_t VOICE_MAX_DATAGRAM = 1200;
+const float VOICE_HEARING_DISTANCE = 100.0f;   // Teammates are heard from anywhere
+const size_t VOICE_MAX_SPEAKERS = 4;           // Loudest speakers relayed to each listener at once
+const std::chrono::milliseconds VOICE_SPEAKER_TIMEOUT(250); // Silence after which a speaker frees its slot
+
+// Spectator Constants
+const uint16_t SPECTATOR_PORT = PORT + 2;
+const std::chrono::milliseconds SPECTATOR_INTERVAL(100);   // One stream frame per watched match this often
+const std::chrono::seconds SPECTATOR_DELAY(3);             // Spectators see the match this far behind
+const unsigned SPECTATOR_KEYFRAME_INTERVAL = 50;           // Stream frames between keyframes
+const size_t SPECTATOR_MAX_DIRECT = 16;                    // Connections per feed; more spectators go through relays
+const size_t SPECTATOR_MAX_QUEUED_BYTES = 4 * 1024 * 1024; // Spectators this far behind are dropped
+const std::chrono::seconds SPECTATOR_CONNECT_TIMEOUT(5);   // A relay gives up on a connect to its upstream after this
+
+// Demo Constants
+// A demo file is a header, then one record per tick in which some member's
+// snapshot changed, then an index of the keyframe records and a trailer
+// pointing at it. Records: body size, tick, kind, flags, raw size, body.
+// Flags and raw size sit where encodeSnapshotDelta expects a delta header's.
+const char DEMO_MAGIC[] = "MPDEMO01";
+const char DEMO_INDEX_MAGIC[] = "MPDEMOIX";
+const size_t DEMO_FILE_HEADER_SIZE = 8 + 4 + 4;          // Magic, match ID, tick rate
+const size_t DEMO_RECORD_HEADER_SIZE = 4 + 4 + 1 + 1 + 4;
+const size_t DEMO_INDEX_ENTRY_SIZE = 4 + 8;              // Tick, record offset
+const size_t DEMO_TRAILER_SIZE = 8 + 4 + 4 + 8;          // Index offset, entry count, last tick, magic
+const uint8_t DEMO_KEYFRAME = 1;                         // Body encodes the bundle against nothing
+const uint8_t DEMO_DELTA = 2;                            // Body encodes the bundle against the previous record's
+const uint8_t DEMO_FLAG_STORED = 0x2;                    // Body is the bundle itself
+const unsigned DEMO_KEYFRAME_SECONDS = 2;                // Most match time a seek decodes past its keyframe
+const size_t DEMO_MAX_QUEUED_TICKS = 4096;               // Ticks are dropped while the writer is this far behind
+
+// Checkpoint Constants
+const char CHECKPOINT_MAGIC[] = "MPCKPT01";
+const uint32_t CHECKPOINT_VERSION = 1;
+const size_t CHECKPOINT_ALIGNMENT = 8;                   // Every section starts on this boundary, so mapped files can be read in place
+const size_t CHECKPOINT_WRITE_BUFFER = 64 * 1024;
+const unsigned CHECKPOINT_SNAPSHOT_SECONDS = 60;         // Restored snapshots of players who have not come back are shown this long
+
+// Player Store Constants
+const std::chrono::milliseconds PLAYER_FLUSH_INTERVAL(1000); // Longest a change waits to be written, barring write errors
+const size_t PLAYER_RECORD_SIZE = 8 + 4 + 8 + 8 + 3 * 4 + 1 + 4; // ID, sessions, play time, last seen, position, team, CRC
+const uint64_t PLAYER_COMPACT_MIN_BYTES = 1024 * 1024;       // Smaller logs are never compacted
+const unsigned PLAYER_COMPACT_RATIO = 4;                     // Logs are compacted once this many times the size of the live records
+
+// Bot Constants
+const unsigned BOT_INPUT_TICKS = 2;          // Reactor ticks between a bot's inputs
+const size_t BOT_SNAPSHOT_SIZE = 64;         // Snapshot payload per input: sequence, send time, position, then filler
+const float BOT_ARENA_SIZE = 500.0f;         // Bots wander within this square around the origin
+const float BOT_SPEED = 4.0f;                // Distance per input
+
+// Simulation Constants
+const unsigned SIM_INPUT_RATE = 30;          // Inputs per second from each simulated client
+const size_t SIM_MATCH_SIZE = 64;            // Clients per simulated match unless --match-size says otherwise
+const uint64_t SIM_MIN_RTO_MICROS = 200000;  // Lost packets arrive at least this much later
+const size_t SIM_LATENCY_BUCKETS = 2000;     // 1 ms each, slower snapshots count in the last one
+const size_t SIM_SEND_BUFFER = 256 * 1024;   // Bytes a client's link takes in flight before the server's writes block, like a socket buffer
+
 // Message Type Constants
 const uint8_t TEXT_MESSAGE = 0;
 const uint8_t EVENT_MESSAGE = 1;
 const uint8_t SNAPSHOT_MESSAGE = 2;
+const uint8_t SNAPSHOT_DELTA_MESSAGE = 3;  // Server -> client, snapshot encoded against the previous one from the same sender
+const uint8_t SNAPSHOT_RESYNC_MESSAGE = 4; // Client -> server, enables deltas and asks for full snapshots next
+const uint8_t PING_MESSAGE = 5;            // Server -> client, carries a timestamp the client echoes back
+const uint8_t PONG_MESSAGE = 6;            // Client -> server, the echoed ping
+const uint8_t PLAYER_STATE_MESSAGE = 7;    // Client -> server, position and team used to rank relevance
+const uint8_t COSMETIC_EVENT_MESSAGE = 8;  // Event that can be dropped when the server is overloaded
+const uint8_t VISIBILITY_MESSAGE = 9;      // Server -> client, members that came into or went out of view
+const uint8_t VOICE_SETUP_MESSAGE = 10;    // Server -> client over TCP, voice port and the client's voice token
+const uint8_t VOICE_MESSAGE = 11;          // Voice datagram, in both directions over UDP
+const uint8_t SPECTATE_MESSAGE = 12;       // Spectator -> feed, the match ID to watch
+const uint8_t SPECTATOR_KEYFRAME_MESSAGE = 13; // Feed -> spectator, every member's snapshot frame back to back
+const uint8_t SPECTATOR_DELTA_MESSAGE = 14;    // Feed -> spectator, the next bundle as a delta on the previous one
+const uint8_t IDENTIFY_MESSAGE = 15;       // Client -> server, the player's persistent 64-bit ID
+
+// Snapshot Delta Constants
+const size_t DELTA_HEADER_SIZE = 2 + 1 + 4;  // Baseline sequence, flags, raw size
+const uint8_t DELTA_FLAG_LZ4 = 0x1;
+const size_t DELTA_MIN_ZERO_RUN = 4;         // Shorter unchanged runs are folded into literals
+const size_t DELTA_MAX_PERCENT = 75;         // Deltas larger than this share of the full snapshot are not sent
 
 // Message Base Class
 class BaseMessage {
@@ -54,8 +229,8 @@ class EventMessage : public BaseMessage {
 public:
     std::vector<uint8_t> eventData;
 
-    EventMessage(uint8_t sender, const std::string& data)
-        : BaseMessage(EVENT_MESSAGE, sender), eventData(data.begin(), data.end()) {}
+    EventMessage(uint8_t sender, const std::string& data, bool cosmetic = false)
+        : BaseMessage(cosmetic ? COSMETIC_EVENT_MESSAGE : EVENT_MESSAGE, sender), eventData(data.begin(), data.end()) {}
 };
 
 class SnapshotMessage : public BaseMessage {
@@ -66,34 +241,4993 @@ public:
         : BaseMessage(SNAPSHOT_MESSAGE, sender), snapshotData(data.begin(), data.end()) {}
 };
 
-// Client Handler Struct
-struct ClientHandler {
+// Coroutine Frame Pool
+// Recycles coroutine frames on the reactor thread that created them, so
+// starting a handler does not hit the global heap once the pool is warm.
+class FramePool {
+private:
+    struct Header {
+        FramePool* pool;
+        size_t sizeClass;
+    };
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    static const size_t SIZE_CLASS_BYTES = 64;
+    static const size_t HEADER_BYTES = (sizeof(Header) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+    std::vector<FreeBlock*> freeLists;
+
+public:
+    static thread_local FramePool* current;
+
+    ~FramePool();
+
+    static void* allocate(size_t size);
+    static void deallocate(void* ptr);
+};
+
+thread_local FramePool* FramePool::current = nullptr;
+
+FramePool::~FramePool() {
+    for (FreeBlock* block : freeLists) {
+        while (block) {
+            FreeBlock* next = block->next;
+            ::operator delete(block);
+            block = next;
+        }
+    }
+}
+
+void* FramePool::allocate(size_t size) {
+    size_t sizeClass = (size + HEADER_BYTES + SIZE_CLASS_BYTES - 1) / SIZE_CLASS_BYTES;
+    FramePool* pool = current;
+
+    void* block = nullptr;
+    if (pool && sizeClass < pool->freeLists.size() && pool->freeLists[sizeClass]) {
+        FreeBlock* free = pool->freeLists[sizeClass];
+        pool->freeLists[sizeClass] = free->next;
+        block = free;
+    }
+    else {
+        block = ::operator new(sizeClass * SIZE_CLASS_BYTES);
+    }
+
+    Header* header = static_cast<Header*>(block);
+    header->pool = pool;
+    header->sizeClass = sizeClass;
+    return static_cast<char*>(block) + HEADER_BYTES;
+}
+
+void FramePool::deallocate(void* ptr) {
+    void* block = static_cast<char*>(ptr) - HEADER_BYTES;
+    Header* header = static_cast<Header*>(block);
+    FramePool* pool = header->pool;
+    size_t sizeClass = header->sizeClass;
+
+    // Frames are always destroyed on the thread that owns their pool
+    if (!pool || pool != current) {
+        ::operator delete(block);
+        return;
+    }
+    if (sizeClass >= pool->freeLists.size()) {
+        pool->freeLists.resize(sizeClass + 1, nullptr);
+    }
+    FreeBlock* free = static_cast<FreeBlock*>(block);
+    free->next = pool->freeLists[sizeClass];
+    pool->freeLists[sizeClass] = free;
+}
+
+// Coroutine Task
+// Return type of message handlers. The handler starts suspended and is
+// resumed by its reactor; the owning Connection destroys it once done.
+struct Task {
+    struct promise_type {
+        Task get_return_object() { return Task{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::cerr << "Unhandled exception in message handler.\n"; }
+
+        static void* operator new(size_t size) { return FramePool::allocate(size); }
+        static void operator delete(void* ptr) { FramePool::deallocate(ptr); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+class Reactor;
+class Match;
+class DemoRecorder;
+
+// View of one received message; valid until the handler suspends again
+struct FrameView {
+    const uint8_t* data;
+    size_t size;
+
+    explicit operator bool() const { return data != nullptr; }
+};
+
+// Length-prefixed frame shared by every recipient it is sent to
+typedef std::shared_ptr<const std::vector<uint8_t>> SharedFrame;
+
+// Length prefix, type, sender and payload length in front of every payload
+const size_t FRAME_HEADER_SIZE = sizeof(uint32_t) + 2 + sizeof(uint32_t);
+
+// Last snapshot from one sender that was sent to one recipient
+struct SnapshotBaseline {
+    SharedFrame frame; // Null until the first full snapshot
+    uint16_t sequence;
+
+    SnapshotBaseline() : sequence(0) {}
+};
+
+// Snapshot Encode Cache
+// Recipients that were last sent the same snapshot from a sender get the
+// same delta for that sender's next snapshot, so each reactor encodes it once
+// per tick and copies the result to everyone else with that baseline. Entries
+// are keyed by the baseline and target frames and hold on to both, so a key
+// cannot be reused by another frame while it is cached.
+class SnapshotEncodeCache {
+public:
+    struct Entry {
+        SharedFrame baseline;
+        SharedFrame target;
+        bool isDelta;               // False if the full snapshot is cheaper
+        std::vector<uint8_t> frame; // Delta frame; the baseline sequence is filled in per recipient
+    };
+
+private:
+    static const size_t SLOT_COUNT = 512; // Must be a power of two
+    static const size_t MAX_PROBES = 8;
+
+    std::vector<Entry> slots;
+    std::vector<size_t> usedSlots;
+    std::vector<uint8_t> xorScratch;
+
+public:
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+
+    SnapshotEncodeCache() : slots(SLOT_COUNT), hits(0), misses(0) {}
+
+    const Entry& encode(const SharedFrame& baseline, const SharedFrame& target);
+    void clear();
+};
+
+// Transport
+// Moves a connection's bytes: a socket, or the server end of a link in the
+// network simulation. Both calls behave like send() and recv() on a
+// non-blocking socket and return a byte count, 0 from receive once the peer
+// has closed, or WOULD_BLOCK or FAILED.
+class Transport {
+public:
+    enum { WOULD_BLOCK = -1, FAILED = -2 };
+
+    virtual ~Transport() {}
+
+    virtual int send(const uint8_t* data, size_t size) = 0;
+    virtual int receive(uint8_t* data, size_t size) = 0;
+};
+
+class SocketTransport : public Transport {
+private:
     SOCKET socket;
+
+public:
+    explicit SocketTransport(SOCKET sock) : socket(sock) {}
+
+    int send(const uint8_t* data, size_t size) override;
+    int receive(uint8_t* data, size_t size) override;
+};
+
+// Client Connection
+// Owned by a single reactor thread and only used from that thread; other
+// threads hand frames over through Reactor::post().
+class Connection {
+private:
+    std::vector<uint8_t> inBuffer;
+    size_t inStart;
+    std::vector<uint8_t> outBuffer;
+    size_t outStart;
+    bool dropWarningShown;
+
+    // Snapshot delta state, indexed by sender
+    std::vector<SnapshotBaseline> baselines;
+    bool baselinesStale;
+
+    bool reserveOutput(size_t size);
+
+public:
+    enum WaitKind { WAIT_NONE, WAIT_RECV, WAIT_SEND, WAIT_TICK };
+
+    SOCKET socket;                        // Polled by the reactor; INVALID_SOCKET for bots and simulated clients
+    std::unique_ptr<Transport> transport; // Null for bots
     uint8_t clientID;
+    Reactor* reactor;
+    Match* match;      // Set before the reactor adopts the connection
+    std::coroutine_handle<Task::promise_type> task;
+    std::coroutine_handle<> waiting;
+    WaitKind waitKind;
+    bool closed;
+    bool deltaSnapshots;
+    uint32_t voiceToken; // Set before the reactor adopts the connection
+    uint64_t playerID;   // 0 until the client identifies itself
+    std::chrono::steady_clock::time_point sessionStart;
+
+    // Server-hosted bots have no socket; frames relayed to them are kept as they are
+    bool bot;
+    std::vector<SharedFrame> botInbox;
+
+    // Link estimates, written by the reactor and read by match ticks
+    std::atomic<uint32_t> rttMicros;     // Smoothed round-trip time, 0 until the first pong
+    std::atomic<uint32_t> queuedBytes;   // Output the socket has not taken yet
+    std::atomic<uint32_t> droppedFrames; // Frames dropped because the client fell behind
+
+    Connection(SOCKET sock, uint8_t id, Reactor* owner)
+        : inStart(0), outStart(0), dropWarningShown(false), baselinesStale(false), socket(sock),
+        transport(sock != INVALID_SOCKET ? new SocketTransport(sock) : nullptr), clientID(id),
+        reactor(owner), match(nullptr), waitKind(WAIT_NONE), closed(false), deltaSnapshots(false),
+        voiceToken(0), playerID(0), bot(false), rttMicros(0), queuedBytes(0), droppedFrames(0) {}
+
+    ~Connection() {
+        if (task) task.destroy();
+    }
+
+    bool isOpen() const { return !closed; }
+    bool hasFrame() const;
+    FrameView popFrame();
+    size_t pendingOutput() const { return outBuffer.size() - outStart; }
+
+    void readAvailable();
+    void queueFrame(const uint8_t* data, size_t size);
+    void queueRelayedFrame(const SharedFrame& frame);
+    void resyncSnapshots();
+    void queuePing();
+    void handlePong(const FrameView& frame);
+    void flush();
+
+    // Awaitables
+    struct RecvAwaitable {
+        Connection& conn;
+        bool await_ready() const { return conn.hasFrame() || conn.closed; }
+        void await_suspend(std::coroutine_handle<> h) { conn.waiting = h; conn.waitKind = WAIT_RECV; }
+        FrameView await_resume() { return conn.popFrame(); }
+    };
+
+    struct SendAwaitable {
+        Connection& conn;
+        bool await_ready() const { return conn.closed || conn.pendingOutput() < SEND_HIGH_WATER; }
+        void await_suspend(std::coroutine_handle<> h) { conn.waiting = h; conn.waitKind = WAIT_SEND; }
+        bool await_resume() const { return !conn.closed; }
+    };
+
+    struct TickAwaitable {
+        Connection& conn;
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        uint64_t await_resume() const;
+    };
+
+    RecvAwaitable recv() { return RecvAwaitable{ *this }; }
+    SendAwaitable send(const std::vector<uint8_t>& message);
+    TickAwaitable tick() { return TickAwaitable{ *this }; }
+};
+
+// How a ring writer waits for slow readers
+enum WaitStrategy {
+    WAIT_BUSY_SPIN, // Lowest latency, burns a core while waiting
+    WAIT_YIELD,     // Spins but gives up the time slice each round
+    WAIT_BLOCK      // Sleeps until a reader advances
+};
+
+// Broadcast Ring
+// Single-writer, multi-reader sequenced ring in the style of the LMAX
+// Disruptor. A reactor publishes each broadcast from its clients once, and
+// every other reactor follows with its own cursor. The slowest cursor gates
+// the writer, so unread entries are never overwritten.
+class BroadcastRing {
+public:
+    struct Entry {
+        SharedFrame frame;
+        uint8_t excludeID;
+        const Match* match; // Only members of this match receive the frame
+    };
+
+private:
+    struct alignas(64) Cursor {
+        std::atomic<uint64_t> next; // Next sequence this reader will consume
+    };
+    static const uint64_t DETACHED = ~0ull;
+
+    std::vector<Entry> entries;
+    std::unique_ptr<Cursor[]> cursors;
+    size_t readerCount;
+    alignas(64) std::atomic<uint64_t> published; // Sequences below this are readable
+    uint64_t cachedGate;                         // Writer-only copy of the slowest cursor
+    WaitStrategy waitStrategy;
+    std::mutex waitMutex;
+    std::condition_variable readerAdvanced;
+
+    uint64_t gate() const;
+
+public:
+    BroadcastRing(size_t readers, size_t ownerIndex, WaitStrategy strategy);
+
+    // Writer side
+    bool tryPublish(const BroadcastRing::Entry& broadcast);
+    void waitForReaders();
+
+    // Reader side
+    uint64_t getPublished() const { return published.load(std::memory_order_acquire); }
+    uint64_t getCursor(size_t reader) const { return cursors[reader].next.load(std::memory_order_relaxed); }
+    const Entry& at(uint64_t sequence) const { return entries[sequence & (BROADCAST_RING_SIZE - 1)]; }
+    void advance(size_t reader, uint64_t next);
+    void detach(size_t reader);
+};
+
+// SPSC Queue
+// Bounded single-producer, single-consumer ring connecting two pipeline
+// stages. Items move in batches, so each handoff publishes one index store,
+// and each side keeps a copy of the other's index to avoid touching its cache
+// line until the queue looks full or empty.
+template <typename T>
+class SpscQueue {
+private:
+    std::vector<T> slots;
+    alignas(64) std::atomic<uint64_t> head; // Next item to pop, written by the consumer
+    uint64_t cachedTail;
+    alignas(64) std::atomic<uint64_t> tail; // Next free slot, written by the producer
+    uint64_t cachedHead;
+
+public:
+    explicit SpscQueue(size_t capacity) : slots(capacity), head(0), cachedTail(0), tail(0), cachedHead(0) {}
+
+    size_t pushBatch(std::vector<T>& items);
+    size_t popBatch(std::vector<T>& out, size_t maxItems);
+    size_t size() const;
+};
+
+// One received message on its way through the pipeline stages
+struct PipelineJob {
+    std::vector<uint8_t> bytes; // Frame as received, length prefix included, set by the I/O stage
+    SharedFrame frame;          // The same bytes once the decode stage has checked them
+    uint8_t senderID;
+    Match* match;
+};
+
+class Server;
+class Pipeline;
+class OverloadGovernor;
+
+// Reactor
+// One I/O thread multiplexing many connections with poll(). Handlers run
+// as coroutines on this thread and are resumed when their awaitable is ready.
+class Reactor {
+public:
+    // Frame for one connection, handed over from another thread
+    struct Outbound {
+        std::shared_ptr<Connection> conn;
+        SharedFrame frame;
+    };
+
+private:
+    Server& server;
+    size_t index;
+    std::vector<Reactor*> peers; // Every reactor, including this one
+    BroadcastRing ring;          // Broadcasts from this reactor's clients
+    SnapshotEncodeCache encodeCache;
     std::thread thread;
+    SOCKET wakeSocket;
+    sockaddr_in wakeAddress;
+    std::atomic<bool> wakePending;
+    std::atomic<bool> isRunning;
+    FramePool framePool;
+    bool simulated;           // Stepped by the network simulation instead of running a thread
+    uint64_t simulatedMicros; // The simulation's clock as of the last step
+
+    std::vector<std::shared_ptr<Connection>> connections;
+    std::vector<std::shared_ptr<Connection>> bots;
+    uint64_t tickCount;
+
+    // Work handed over from other threads
+    std::mutex inboxMutex;
+    std::vector<std::shared_ptr<Connection>> pendingConnections;
+    std::vector<Outbound> pendingFrames;
+    std::vector<BroadcastRing::Entry> pendingBroadcasts;
+
+    // Pipeline handoff, only used when the server runs with stage threads
+    Pipeline* pipeline;
+    std::vector<PipelineJob> pipelineBacklog;
+    std::vector<BroadcastRing::Entry> pipelineOutput;
+
+    void run();
+    void service(Connection& conn, bool readable, bool writable);
+    void runTick();
+    void drainInbox();
+    void exchangePipeline();
+    void consumeRings();
+    void deliverBroadcast(const BroadcastRing::Entry& broadcast);
+    void resume(Connection& conn);
+    void closeFinished(std::vector<std::shared_ptr<Connection>>& finished);
+
+public:
+    static thread_local Reactor* current;
+
+    Reactor(Server& owner, size_t reactorIndex, size_t reactorCount, WaitStrategy waitStrategy)
+        : server(owner), index(reactorIndex), ring(reactorCount, reactorIndex, waitStrategy),
+        wakeSocket(INVALID_SOCKET), wakeAddress{}, wakePending(false), isRunning(false), simulated(false),
+        simulatedMicros(0), tickCount(0), pipeline(nullptr) {}
+
+    void setPeers(const std::vector<Reactor*>& reactors) { peers = reactors; }
+    void setPipeline(Pipeline* stages) { pipeline = stages; }
+    bool start();
+    void stop();
+    void wake();
+    // One pass of the loop for the network simulation, on the caller's thread
+    void simulateStep(uint64_t nowMicros, const std::vector<Connection*>& ready, bool tick);
+    // Steady clock microseconds, or the simulation's clock for a simulated reactor
+    uint64_t clockMicros() const;
+
+    void adopt(std::shared_ptr<Connection> conn);
+    void post(const std::shared_ptr<Connection>& conn, const SharedFrame& frame);
+    void postFrames(const Outbound* frames, size_t count);
+    void broadcast(const BroadcastRing::Entry& broadcast);
+    void postBroadcast(const BroadcastRing::Entry& broadcast);
+
+    // Queues a received message for the decode stage
+    void submit(const Connection& conn, const FrameView& frame);
+    bool isPipelineBacklogged() const { return pipelineBacklog.size() >= PIPELINE_QUEUE_SIZE; }
+
+    uint64_t getTickCount() const { return tickCount; }
+    size_t getIndex() const { return index; }
+    SnapshotEncodeCache& getEncodeCache() { return encodeCache; }
 };
 
-class Server {
+thread_local Reactor* Reactor::current = nullptr;
+
+// Visibility Bitsets
+// One bit per client ID. Each match member keeps the set of members it can
+// see across ticks, so entering and leaving view is a bitwise diff.
+struct alignas(16) ClientBitset {
+    uint64_t words[4];
+
+    void set(uint8_t clientID) { words[clientID >> 6] |= 1ull << (clientID & 63); }
+    void reset(uint8_t clientID) { words[clientID >> 6] &= ~(1ull << (clientID & 63)); }
+    bool test(uint8_t clientID) const { return (words[clientID >> 6] >> (clientID & 63)) & 1; }
+};
+
+bool diffVisibility(const ClientBitset& before, const ClientBitset& after, ClientBitset& entered, ClientBitset& left);
+size_t appendClientIDs(const ClientBitset& bits, std::vector<uint8_t>& out);
+
+// Checkpoint Records
+// A checkpoint is a header, then per match a CheckpointMatch, its members'
+// records, and their snapshot frames. Records are stored as laid out in
+// memory, for restarting on the same machine, and a mapped file is read in
+// place without copying.
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t matchCount;
+    int64_t savedAt;         // Seconds since the epoch
+};
+
+struct CheckpointMatch {
+    uint32_t id;
+    uint32_t tickRate;
+    uint64_t tickNumber;
+    uint32_t memberCount;
+    uint32_t snapshotBytes;  // Padded to CHECKPOINT_ALIGNMENT
+};
+
+struct CheckpointMember {
+    uint8_t clientID;
+    uint8_t team;
+    uint8_t hasState;
+    uint8_t reserved;
+    float position[3];
+    uint32_t snapshotOffset; // Into the match's snapshot frames
+    uint32_t snapshotSize;   // 0 if the member has not sent one
+};
+
+// File Writer
+// Buffered output to a file, synced to disk on close. On POSIX it uses the
+// file descriptor directly, since a forked checkpoint child should stay
+// clear of library state that other threads of the parent may have held at
+// the fork.
+class FileWriter {
 private:
-    SOCKET listeningSocket;
-    std::vector<ClientHandler*> clients;
-    uint8_t nextClientID;
-    std::mutex clientsMutex;
+#ifdef _WIN32
+    std::ofstream file;
+#else
+    int fd;
+#endif
+    uint8_t buffer[CHECKPOINT_WRITE_BUFFER];
+    size_t used;
+    uint64_t written;
+    bool failed;
+
+    void flush();
+
+public:
+#ifdef _WIN32
+    FileWriter() : used(0), written(0), failed(false) {}
+#else
+    FileWriter() : fd(-1), used(0), written(0), failed(false) {}
+#endif
+
+    // Starts a new file, or appends to an existing one
+    bool open(const std::string& path, bool append = false);
+    void put(const void* data, size_t size);
+    void pad();
+    // Flushes and syncs; returns false if anything failed along the way
+    bool close();
+    uint64_t getBytesWritten() const { return written + used; }
+};
+
+// Checkpoint File
+// A checkpoint mapped read-only into memory.
+class CheckpointFile {
+private:
+    const uint8_t* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+public:
+#ifdef _WIN32
+    CheckpointFile() : data(nullptr), size(0), file(INVALID_HANDLE_VALUE), mapping(NULL) {}
+#else
+    CheckpointFile() : data(nullptr), size(0) {}
+#endif
+    ~CheckpointFile() { close(); }
+
+    bool open(const std::string& path);
+    void close();
+
+    const CheckpointHeader* getHeader() const;
+    // Steps through the matches from offset 0; returns false at the end or on a damaged section
+    bool nextMatch(size_t& offset, const CheckpointMatch*& match, const CheckpointMember*& members,
+        const uint8_t*& snapshots) const;
+};
+
+// Match
+// One game instance with its own members and tick rate. Snapshots from
+// members are staged as they arrive, and each tick replicates the newest one
+// from every sender to the rest of the match, as often as the recipient's
+// snapshot rate for that sender allows. The newest snapshots are also what
+// joining members receive first. Ticks run on the scheduler's workers, never
+// two at once for the same match.
+class Match {
+private:
+    // A member and what it has been sent so far
+    struct Member {
+        std::shared_ptr<Connection> conn;
+        float position[3];
+        uint8_t team;                 // 0 for no team
+        bool hasState;                // Set once the client reports its position
+        uint64_t lastMovedTick;
+        uint64_t congestedUntilTick;
+        uint32_t seenDrops;
+        uint32_t sentVersion[256];    // Version of each sender's snapshot last sent to this member
+        uint64_t lastSentTick[256];
+        ClientBitset visible;         // Senders in view as of the last tick
+    };
+
+    uint32_t id;
+    unsigned tickRate;
+    std::chrono::nanoseconds tickInterval;
+    std::chrono::nanoseconds tickBudget;
+    size_t capacity; // 0 for no limit
+
+    mutable std::mutex matchMutex;
+    std::vector<std::unique_ptr<Member>> members; // Sorted by reactor, so ticks post frames in runs
+    SharedFrame latest[256];                      // Newest snapshot per sender
+    uint32_t latestVersion[256];                  // Bumped whenever latest[] changes
+    uint64_t tickNumber;
+    DemoRecorder* recorder;                       // Null unless the server records demos
+    bool latestChanged;                           // Since the last recorded tick
+    std::vector<CheckpointMember> restored;       // Players from a checkpoint who have not rejoined; latest[] holds their snapshots
+    uint64_t restoredUntilTick;                   // When those snapshots are dropped
+
+    // Tick scratch, only used by the worker running the tick
+    std::vector<Reactor::Outbound> outbound;
+    std::vector<uint8_t> visibilityRecord;
+    std::vector<SharedFrame> recorded;
+
+    static float distanceSquared(const Member& a, const Member& b);
+    bool isVisible(const Member& recipient, const Member& sender, float interestScale) const;
+    unsigned relevanceRate(const Member& recipient, const Member& sender, float interestScale) const;
+    SharedFrame updateVisibility(Member& recipient, float interestScale);
+    unsigned linkDivisor(Member& recipient);
+
+public:
+    // Scheduling state, guarded by the scheduler
+    std::chrono::steady_clock::time_point release;  // Earliest start of the next tick
+    std::chrono::steady_clock::time_point deadline; // When that tick should be done
+
+    // Metrics
+    std::atomic<uint64_t> ticks;
+    std::atomic<uint64_t> deadlineMisses; // Ticks finished late or skipped
+    std::atomic<uint64_t> budgetOverruns; // Ticks that took longer than the budget
+    std::atomic<uint64_t> busyNanos;
+    std::atomic<uint64_t> maxTickNanos;
+    std::atomic<uint64_t> snapshotsSent;
+    std::atomic<uint64_t> snapshotBytes;
+    std::atomic<uint64_t> snapshotsDeferred; // Newer snapshots held back a tick by the rate limit
+    std::atomic<uint64_t> membersEntered;    // Create and destroy records sent
+    std::atomic<uint64_t> membersLeft;
+
+    std::atomic<int> degradation; // Set by the overload governor
+
+    Match(uint32_t matchID, unsigned rate, size_t maxMembers);
+
+    bool addMember(const std::shared_ptr<Connection>& conn);
+    void removeMember(const Connection& conn);
+    size_t getMemberCount() const;
+    void updatePlayerState(uint8_t clientID, const float position[3], uint8_t team);
+    void stageSnapshot(uint8_t senderID, const SharedFrame& frame);
+    void collectSnapshots(std::vector<SharedFrame>& out, uint8_t excludeID) const;
+    void collectListeners(uint8_t speakerID, std::vector<uint8_t>& out) const;
+    // Only before the match is first scheduled
+    void setRecorder(DemoRecorder* demoRecorder) { recorder = demoRecorder; }
+    void restoreTick(uint64_t tick) { tickNumber = tick; }
+    void restoreMember(const CheckpointMember& record, const uint8_t* snapshot);
+
+    // Checkpoints lock every match at once, so the file holds one consistent moment
+    void lockState() const { matchMutex.lock(); }
+    void unlockState() const { matchMutex.unlock(); }
+    // The caller holds the state lock, or is a forked child with no other threads
+    void writeCheckpoint(FileWriter& out) const;
+
+    void tick();
+    void recordTick(std::chrono::nanoseconds duration);
+
+    uint32_t getID() const { return id; }
+    unsigned getTickRate() const { return tickRate; }
+    std::chrono::nanoseconds getTickInterval() const { return tickInterval; }
+    std::chrono::nanoseconds getTickBudget() const { return tickBudget; }
+};
+
+// Match Scheduler
+// Multiplexes every match onto a fixed pool of workers. A match's tick is
+// released once per interval and has to finish before the next release;
+// released ticks run earliest deadline first.
+class MatchScheduler {
+private:
+    struct ReleasedLater {
+        bool operator()(const Match* a, const Match* b) const { return a->release > b->release; }
+    };
+    struct DueLater {
+        bool operator()(const Match* a, const Match* b) const { return a->deadline > b->deadline; }
+    };
+
+    size_t matchSize;
+    std::vector<unsigned> tickRates; // New matches cycle through these
+    DegradationLevel degradation;
+    DemoRecorder* recorder;
+
+    std::mutex schedulerMutex;
+    std::condition_variable scheduleChanged;
+    std::vector<std::unique_ptr<Match>> matches;
+    std::priority_queue<Match*, std::vector<Match*>, ReleasedLater> waiting;
+    std::priority_queue<Match*, std::vector<Match*>, DueLater> ready;
+    std::vector<std::thread> workers;
     bool isRunning;
 
-public:
-    Server() : nextClientID(1), isRunning(true) {}
+    void work();
+    void writeCheckpoint(FileWriter& out) const;
+
+public:
+    MatchScheduler(size_t membersPerMatch, const std::vector<unsigned>& rates)
+        : matchSize(membersPerMatch), tickRates(rates), degradation(DEGRADE_NONE), recorder(nullptr), isRunning(false) {}
+
+    void start(unsigned workerCount);
+    void stop();
+
+    // Puts the connection into the first match with room, opening a new one if needed
+    Match* join(const std::shared_ptr<Connection>& conn);
+    Match* find(uint32_t matchID);
+
+    // Matches opened from now on hand their ticks to the recorder
+    void setRecorder(DemoRecorder* demoRecorder);
+    void setDegradation(DegradationLevel level);
+    void addTickLoad(uint64_t& ticks, uint64_t& late);
+
+    // Writes every match to path and reports how long matches were held up
+    bool checkpoint(const std::string& path, std::chrono::nanoseconds& pause);
+    // Reopens the matches of a checkpoint, before any client joins; returns how many
+    size_t restore(const CheckpointFile& checkpoint);
+
+    void printStats(std::ostream& out);
+};
+
+// Pipeline
+// Moves message processing off the reactors onto dedicated stage threads:
+// reactors hand received frames to the decode stage, which checks them and
+// stamps the sender; simulate applies the per-message game logic; fan-out
+// hands the frames that are still to be relayed back to every reactor. The
+// received bytes travel through unchanged, so nothing is decoded into
+// message objects or encoded again. Stages are connected by SPSC queues, so
+// there is one ingress and one egress queue per reactor.
+class Pipeline {
+public:
+    enum Stage { STAGE_RECEIVE, STAGE_DECODE, STAGE_SIMULATE, STAGE_FAN_OUT, STAGE_SEND, STAGE_COUNT };
+
+private:
+    struct alignas(64) StageStats {
+        std::atomic<uint64_t> items;   // Items the stage finished
+        std::atomic<uint64_t> batches; // Non-empty rounds, so items / batches is the batch size
+        std::atomic<uint64_t> stalls;  // Rounds spent waiting for room downstream
+    };
+
+    std::vector<Reactor*> reactors;
+    OverloadGovernor& governor;
+    WaitStrategy waitStrategy;
+    std::atomic<bool> isRunning;
+    std::vector<std::thread> threads;
+    StageStats stats[STAGE_COUNT];
+
+    std::vector<std::unique_ptr<SpscQueue<PipelineJob>>> ingress;
+    SpscQueue<PipelineJob> decoded;
+    SpscQueue<PipelineJob> simulated;
+    std::vector<std::unique_ptr<SpscQueue<BroadcastRing::Entry>>> egress;
+
+    void decodeStage();
+    void simulateStage();
+    void fanOutStage();
+    void waitForWork(unsigned& idleRounds);
+    template <typename T>
+    void forward(SpscQueue<T>& queue, std::vector<T>& items, Stage stage);
+    void countBatch(Stage stage, size_t items);
+
+public:
+    Pipeline(const std::vector<Reactor*>& owners, OverloadGovernor& loadGovernor, WaitStrategy strategy);
+
+    void start();
+    void stop();
+
+    // Called by reactor threads with their own index
+    void submit(size_t reactorIndex, std::vector<PipelineJob>& jobs);
+    void collect(size_t reactorIndex, std::vector<BroadcastRing::Entry>& out);
+
+    void printStats(std::ostream& out) const;
+    double getQueueFill() const;
+};
+
+// Overload Governor
+// Turns periodic load samples into a degradation level. The level rises one
+// step after a few overloaded samples in a row and falls one step only after
+// a longer calm stretch, with lower thresholds for calm than for overload,
+// so it does not flap around a threshold.
+struct LoadSample {
+    double tickLate;     // Share of match ticks that missed their deadline or budget
+    double cpu;          // Process CPU time per core over the sample
+    double backlogged;   // Share of clients whose output is piling up
+    double pipelineFill; // Fullest pipeline queue, 0 without a pipeline
+};
+
+class OverloadGovernor {
+private:
+    std::atomic<int> level;
+    unsigned overloadedSamples;
+    unsigned calmSamples;
+
+    mutable std::mutex sampleMutex;
+    LoadSample lastSample;
+
+public:
+    std::atomic<uint64_t> levelChanges;
+    std::atomic<uint64_t> cosmeticDropped;
+    std::atomic<uint64_t> joinsRejected;
+
+    OverloadGovernor() : level(DEGRADE_NONE), overloadedSamples(0), calmSamples(0), lastSample{},
+        levelChanges(0), cosmeticDropped(0), joinsRejected(0) {}
+
+    DegradationLevel getLevel() const { return (DegradationLevel)level.load(std::memory_order_relaxed); }
+    bool update(const LoadSample& sample);
+    void printStats(std::ostream& out) const;
+};
+
+// Voice Relay
+// Relays voice on its own UDP socket and thread, so it never waits for a
+// match tick or queues behind snapshots on the TCP stream. Each datagram
+// carries the token the client got over TCP, and the newest valid one tells
+// the relay where that client listens. Only the header is rewritten; codec
+// frames are forwarded as they came.
+class VoiceRelay {
+private:
+    struct Speaker {
+        uint8_t clientID;
+        uint8_t level;
+        std::chrono::steady_clock::time_point lastHeard;
+    };
+    struct Listener {
+        bool active;
+        uint32_t token;
+        Match* match;
+        bool hasAddress;
+        sockaddr_in address;
+        Speaker speakers[VOICE_MAX_SPEAKERS]; // Speakers this client currently hears
+        size_t speakerCount;
+    };
+
+    SOCKET voiceSocket;
+    std::thread thread;
+    std::atomic<bool> isRunning;
+
+    std::mutex relayMutex;
+    Listener listeners[256];
+    std::mt19937 tokenGenerator;
+
+    // Relay thread scratch
+    std::vector<uint8_t> hearing;
+
+    void run();
+    void relay(uint8_t* datagram, size_t size, const sockaddr_in& from);
+    bool admitSpeaker(Listener& listener, uint8_t speakerID, uint8_t level, std::chrono::steady_clock::time_point now);
+
+public:
+    std::atomic<uint64_t> datagramsIn;
+    std::atomic<uint64_t> datagramsRelayed;
+    std::atomic<uint64_t> datagramsCapped;   // Not relayed because louder speakers filled the listener's slots
+    std::atomic<uint64_t> datagramsRejected; // Malformed or with the wrong token
+
+    VoiceRelay() : voiceSocket(INVALID_SOCKET), isRunning(false), listeners{}, tokenGenerator(std::random_device()()),
+        datagramsIn(0), datagramsRelayed(0), datagramsCapped(0), datagramsRejected(0) {}
+
+    bool start();
+    void stop();
+
+    // Returns the token the client has to put in its datagrams
+    uint32_t addClient(uint8_t clientID, Match* match);
+    void removeClient(uint8_t clientID);
+
+    void printStats(std::ostream& out) const;
+};
+
+// Spectator Feed
+// Serves spectators from their own port and thread. Each watched match gets
+// one stream, encoded once: keyframes holding every member's newest snapshot,
+// with deltas between them, held back SPECTATOR_DELAY before anyone sees it.
+// All spectators of a match share the same frames. At most
+// SPECTATOR_MAX_DIRECT connect to a feed; relays (--relay) subscribe like
+// spectators and fan the stream out again unchanged, so any number can watch
+// at a fixed cost to the game server.
+class SpectatorFeed {
+private:
+    struct Subscriber {
+        SOCKET socket;
+        uint32_t matchID;              // 0 until the spectator says what to watch
+        std::vector<uint8_t> inBuffer;
+        std::deque<SharedFrame> output;
+        size_t outputOffset;           // Bytes of output.front() already sent
+        size_t queuedBytes;
+    };
+    struct Stream {
+        size_t subscriberCount;
+        std::vector<SharedFrame> backlog; // Published frames since the last keyframe, replayed to new subscribers
+
+        // Encoder state, only used on the game server
+        std::vector<uint8_t> previous;    // Last bundle, the baseline for the next delta
+        uint16_t sequence;
+        unsigned sinceKeyframe;
+        std::deque<std::pair<std::chrono::steady_clock::time_point, SharedFrame>> delayed;
+    };
+
+    MatchScheduler* matches; // Null for a relay
+    uint16_t port;
+    SOCKET listenSocket;
+    std::thread thread;
+    std::atomic<bool> isRunning;
+
+    // Relay state
+    std::string upstreamHost;
+    uint16_t upstreamPort;
+    uint32_t upstreamMatch;
+    SOCKET upstream;
+    bool upstreamConnecting;           // connect() still in progress on upstream
+    std::vector<uint8_t> upstreamBuffer;
+    std::chrono::steady_clock::time_point nextUpstreamAttempt;
+
+    // Only touched by the feed thread
+    std::vector<std::unique_ptr<Subscriber>> subscribers;
+    std::map<uint32_t, Stream> streams;
+    std::vector<WSAPOLLFD> pollSet;
+    std::vector<SharedFrame> snapshots;
+    std::vector<uint8_t> bundle;
+    std::vector<uint8_t> xorScratch;
+
+    void run();
+    void acceptSubscribers();
+    void readSubscriber(Subscriber& subscriber);
+    void subscribe(Subscriber& subscriber, uint32_t matchID);
+    void flushSubscriber(Subscriber& subscriber);
+    void enqueue(Subscriber& subscriber, const SharedFrame& frame);
+    void closeSubscriber(Subscriber& subscriber);
+    void encodeStream(uint32_t matchID, Stream& stream, std::chrono::steady_clock::time_point now);
+    void publish(uint32_t matchID, Stream& stream, const SharedFrame& frame, bool keyframe);
+    bool connectUpstream();
+    void finishUpstreamConnect();
+    void readUpstream();
+
+public:
+    std::atomic<uint64_t> framesPublished;
+    std::atomic<uint64_t> keyframesPublished;
+    std::atomic<uint64_t> bytesPublished;      // Once per frame, however many watch it
+    std::atomic<uint64_t> spectatorsRefused;   // Turned away because the feed was full
+    std::atomic<uint64_t> spectatorsDropped;   // Disconnected for falling too far behind
+    std::atomic<size_t> spectatorCount;
+
+    SpectatorFeed(MatchScheduler* source, uint16_t listenPort)
+        : matches(source), port(listenPort), listenSocket(INVALID_SOCKET), isRunning(false), upstreamPort(0),
+        upstreamMatch(0), upstream(INVALID_SOCKET), upstreamConnecting(false), framesPublished(0), keyframesPublished(0), bytesPublished(0),
+        spectatorsRefused(0), spectatorsDropped(0), spectatorCount(0) {}
+
+    // Makes this feed a relay of one match from another feed
+    void setUpstream(const std::string& host, uint16_t hostPort, uint32_t matchID);
+
+    bool start();
+    void stop();
+    void printStats(std::ostream& out) const;
+};
+
+// Keyframe record at a tick, for seeking
+struct DemoIndexEntry {
+    uint32_t tick;
+    uint64_t offset;
+};
+
+// Demo Recorder
+// Writes one demo file per match. Match ticks only hand over the newest
+// snapshot of every member; bundling, encoding and file I/O happen on the
+// recorder's own thread. Every DEMO_KEYFRAME_SECONDS of match time a record
+// is a keyframe, and the rest are deltas on the record before, so a player
+// never decodes more than that much to reach any tick.
+class DemoRecorder {
+private:
+    struct Job {
+        uint32_t matchID;
+        unsigned tickRate;
+        uint64_t tick;
+        std::vector<SharedFrame> snapshots;
+    };
+    struct Recording {
+        std::ofstream file;
+        bool failed;                   // Could not be opened; the match goes unrecorded
+        unsigned tickRate;
+        uint64_t offset;               // Where the next record starts
+        uint64_t lastKeyframeTick;
+        uint32_t lastTick;
+        std::vector<uint8_t> previous; // Last bundle, the baseline for the next delta
+        std::vector<DemoIndexEntry> index;
+    };
+
+    std::string directory;
+    std::thread thread;
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::vector<Job> queue;
+    std::vector<std::vector<SharedFrame>> spare; // Emptied snapshot lists, handed back to the matches
+    bool isRunning;
+
+    // Only touched by the recorder thread
+    std::map<uint32_t, Recording> recordings;
+    std::vector<uint8_t> bundle;
+    std::vector<uint8_t> record;
+    std::vector<uint8_t> xorScratch;
+
+    void run();
+    void write(Job& job);
+    void finish(Recording& recording);
+
+public:
+    std::atomic<uint64_t> recordsWritten;
+    std::atomic<uint64_t> keyframesWritten;
+    std::atomic<uint64_t> bytesWritten;
+    std::atomic<uint64_t> ticksDropped;  // Not recorded because the writer fell behind
+
+    DemoRecorder(const std::string& outputDirectory)
+        : directory(outputDirectory), isRunning(false), recordsWritten(0), keyframesWritten(0), bytesWritten(0),
+        ticksDropped(0) {}
+
+    void start();
+    // Writes every queued tick and finishes each file with its index
+    void stop();
+    // Called by a match tick; takes the snapshots and leaves an empty list in their place
+    void submit(uint32_t matchID, unsigned tickRate, uint64_t tick, std::vector<SharedFrame>& snapshots);
+    void printStats(std::ostream& out) const;
+};
+
+// Demo Player
+// Reads a demo file and reconstructs the bundle of every member's snapshot
+// at any recorded tick, by jumping to the keyframe at or before it and
+// applying the deltas from there. Files cut short without an index are
+// indexed by skipping from record header to record header.
+class DemoPlayer {
+private:
+    std::ifstream file;
+    uint32_t matchID;
+    unsigned tickRate;
+    uint64_t recordsEnd;
+    std::vector<DemoIndexEntry> index;
+    uint32_t lastTick;
+
+    uint32_t tick;                 // Tick of the bundle, valid after a successful seek
+    std::vector<uint8_t> bundle;
+    std::vector<uint8_t> record;
+    std::vector<uint8_t> runScratch;
+    size_t recordsApplied;         // By the last seek
+
+    bool readIndex(uint64_t fileSize);
+    bool scanRecords();
+    bool apply(const uint8_t* header, const uint8_t* body);
+
+public:
+    DemoPlayer() : matchID(0), tickRate(0), recordsEnd(0), lastTick(0), tick(0), recordsApplied(0) {}
+
+    bool open(const std::string& path);
+    // Reconstructs the newest recorded state at or before the tick
+    bool seek(uint32_t target);
+
+    uint32_t getMatchID() const { return matchID; }
+    unsigned getTickRate() const { return tickRate; }
+    uint32_t getFirstTick() const { return index.empty() ? 0 : index.front().tick; }
+    uint32_t getLastTick() const { return lastTick; }
+    size_t getKeyframeCount() const { return index.size(); }
+    uint32_t getTick() const { return tick; }
+    size_t getRecordsApplied() const { return recordsApplied; }
+    const std::vector<uint8_t>& getBundle() const { return bundle; }
+};
+
+// Checkpointer
+// Saves every match to a file from its own thread, every interval and
+// whenever asked. Each checkpoint is written under a temporary name and
+// renamed over the previous one once complete, so a crash mid-write leaves
+// the last good checkpoint in place.
+class Checkpointer {
+private:
+    MatchScheduler& matches;
+    std::string path;
+    std::chrono::seconds interval; // 0 for only when asked
+    std::thread thread;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    bool requested;
+    bool isRunning;
+
+    void run();
+    void save();
+
+public:
+    std::atomic<uint64_t> checkpointsWritten;
+    std::atomic<uint64_t> checkpointsFailed;
+    std::atomic<uint64_t> lastPauseMicros;  // How long matches were held up
+    std::atomic<uint64_t> maxPauseMicros;
+    std::atomic<uint64_t> lastWriteMillis;  // Until the file was complete
+    std::atomic<uint64_t> lastBytes;
+
+    Checkpointer(MatchScheduler& source, const std::string& checkpointPath, std::chrono::seconds every)
+        : matches(source), path(checkpointPath), interval(every), requested(false), isRunning(false),
+        checkpointsWritten(0), checkpointsFailed(0), lastPauseMicros(0), maxPauseMicros(0), lastWriteMillis(0), lastBytes(0) {}
+
+    void start();
+    void stop();
+    void request();
+    void printStats(std::ostream& out) const;
+};
+
+// Persistent state of one player, kept across sessions
+struct PlayerRecord {
+    uint64_t playerID;
+    uint32_t sessions;
+    uint64_t playSeconds;
+    int64_t lastSeen;        // Seconds since the epoch
+    float position[3];       // Last reported
+    uint8_t team;
+};
+
+// Player Store
+// Write-behind cache of player records. Game threads only change records in
+// memory and mark them dirty; a writer thread appends every dirty record to
+// a log once per PLAYER_FLUSH_INTERVAL, in one synced batch, and rewrites
+// the log with just the live records once it has grown too far past them.
+// Each log record carries a CRC, so startup replays the log up to the first
+// record a crash tore and cuts the rest off.
+class PlayerStore {
+private:
+    struct Entry {
+        PlayerRecord record;
+        bool dirty;
+    };
+
+    std::string path;
+    std::mutex storeMutex;
+    std::condition_variable flushWake;
+    std::map<uint64_t, Entry> records;
+    std::vector<uint64_t> dirtyIDs;
+    bool isRunning;
+    std::thread thread;
+
+    // Only touched by the writer thread, after start()
+    uint64_t logBytes;
+    bool rewriteLog;               // A failed append may have left a torn record behind
+    std::vector<PlayerRecord> batch;
+    std::vector<uint8_t> encoded;
+
+    Entry& touch(uint64_t playerID);
+    void recover();
+    void run();
+    void flush();
+    void compact();
+    static void encode(const PlayerRecord& record, uint8_t* out);
+    static bool decode(const uint8_t* in, PlayerRecord& record);
+
+public:
+    std::atomic<uint64_t> recordsWritten;
+    std::atomic<uint64_t> batchesWritten;
+    std::atomic<uint64_t> compactions;
+    std::atomic<uint64_t> writeFailures;
+    std::atomic<uint64_t> recordsRecovered;
+    std::atomic<uint64_t> tornBytes;     // Cut off the end of the log at startup
+
+    PlayerStore(const std::string& logPath)
+        : path(logPath), isRunning(false), logBytes(0), rewriteLog(false), recordsWritten(0), batchesWritten(0),
+        compactions(0), writeFailures(0), recordsRecovered(0), tornBytes(0) {}
+
+    // Replays the log, then starts the writer
+    void start();
+    // Writes whatever is still dirty
+    void stop();
+
+    PlayerRecord beginSession(uint64_t playerID);
+    void updatePosition(uint64_t playerID, const float position[3], uint8_t team);
+    void endSession(uint64_t playerID, uint64_t seconds);
+    void printStats(std::ostream& out) const;
+};
+
+// Bot Brain
+// How a bot moves and what it sends, shared by the bots a server hosts and
+// the clients a simulation runs. The same seed always takes the same path.
+class BotBrain {
+private:
+    std::minstd_rand random;
+    float heading;
+    uint32_t sequence;
+
+public:
+    float position[3];
+    uint8_t team;
+
+    BotBrain(uint8_t clientID, uint32_t seed);
+
+    void move();
+    SharedFrame makeSnapshot(uint8_t clientID, uint64_t sendMicros);
+};
+
+// Network Simulation
+// Runs matches against simulated clients over an in-memory network and a
+// virtual clock, so a long session with many clients takes as long as the
+// work does rather than as long as the session. Each match gets a reactor
+// stepped by the simulation and the server's real message handler, and each
+// client connection a Transport that is one end of a simulated link, so
+// framing, snapshot delta encoding and the link estimates all run as they
+// would with sockets. The link carries a stream in each direction the way
+// TCP would: packets wait for the bandwidth, take the latency plus jitter,
+// and a lost one arrives a retransmission timeout later. Delivery stays in
+// order, so a reordered or lost packet holds up the ones behind it. The
+// client end decodes what arrives as the client program does: it applies
+// deltas to its baselines, asks for a resync when one does not fit, and
+// answers pings.
+//
+// Clients never leave their match, so every match is a shard with its own
+// reactor, clients, events and generator seeded from the run's seed and its
+// index. Shards run on as many threads as there are workers, and events due
+// at the same time run in the order they were scheduled, so the same seed
+// gives the same run whatever the thread count.
+struct SimulationConfig {
+    size_t clients;
+    uint64_t seconds;       // Virtual time to run for
+    uint64_t seed;
+    size_t matchSize;       // 0 picks SIM_MATCH_SIZE
+    unsigned tickRate;
+    unsigned threads;       // 0 picks one per core
+    double latencyMs;       // One way
+    double jitterMs;        // Added uniformly between 0 and this
+    double lossPercent;
+    double reorderPercent;
+    uint64_t bandwidthKbps; // Per direction, 0 for no limit
+
+    SimulationConfig() : clients(0), seconds(60), seed(1), matchSize(0), tickRate(DEFAULT_TICK_RATE), threads(0),
+        latencyMs(30), jitterMs(5), lossPercent(0), reorderPercent(0), bandwidthKbps(0) {}
+};
+
+class Simulation {
+private:
+    enum EventKind : uint8_t { EVENT_TICK, EVENT_REACTOR_TICK, EVENT_INPUT, EVENT_UPLINK, EVENT_DOWNLINK };
+
+    struct Event {
+        uint64_t time;  // Virtual microseconds
+        uint64_t order; // Ties run in scheduling order
+        EventKind kind;
+        uint32_t index; // Client within the shard, unused for ticks
+    };
+
+    struct EventLater {
+        bool operator()(const Event& a, const Event& b) const {
+            return a.time != b.time ? a.time > b.time : a.order > b.order;
+        }
+    };
+
+    // Bytes from one write, in flight
+    struct Packet {
+        uint64_t deliverAt;
+        std::vector<uint8_t> bytes;
+    };
+
+    // One direction of one client's connection
+    struct Link {
+        std::deque<Packet> inFlight; // In delivery order
+        size_t inFlightBytes;
+        uint64_t busyUntil;          // When the bandwidth is free again
+        uint64_t lastDelivery;
+
+        Link() : inFlightBytes(0), busyUntil(0), lastDelivery(0) {}
+    };
+
+    struct Shard;
+
+    // The server end of a client's link. Writes go out on the downlink until
+    // SIM_SEND_BUFFER bytes are in flight, the way a socket's send buffer
+    // fills; reads take what the uplink has delivered.
+    class LinkTransport : public Transport {
+    private:
+        Simulation& simulation;
+        Shard& shard;
+        uint32_t clientIndex;
+
+    public:
+        std::vector<uint8_t> received;
+        size_t receivedStart;
+
+        LinkTransport(Simulation& owner, Shard& clientShard, uint32_t index)
+            : simulation(owner), shard(clientShard), clientIndex(index), receivedStart(0) {}
+
+        int send(const uint8_t* data, size_t size) override;
+        int receive(uint8_t* data, size_t size) override;
+    };
+
+    // What the client end knows of one sender's snapshots
+    struct Baseline {
+        std::vector<uint8_t> payload;
+        uint16_t sequence;
+        uint32_t lastSequence; // From the snapshot payload, to catch a delta applied to the wrong baseline
+        bool valid;
+
+        Baseline() : sequence(0), lastSequence(0), valid(false) {}
+    };
+
+    struct SimClient {
+        std::shared_ptr<Connection> conn; // Server side
+        LinkTransport* transport;         // Owned by conn
+        BotBrain brain;
+        Link uplink;
+        Link downlink;
+
+        // Client side
+        std::vector<uint8_t> inBuffer;
+        size_t inStart;
+        std::vector<Baseline> baselines; // By sender
+        bool resyncPending;
+        uint8_t resyncSender;            // 0 if any full snapshot ends the resync
+
+        SimClient(uint8_t clientID, uint32_t seed, size_t senders)
+            : transport(nullptr), brain(clientID, seed), inStart(0), baselines(senders + 1), resyncPending(false),
+            resyncSender(0) {}
+    };
+
+    struct Results {
+        uint64_t eventsRun;
+        uint64_t inputsSent;
+        uint64_t packetsSent;
+        uint64_t packetsLost;
+        uint64_t packetsReordered;
+        uint64_t framesDelivered;
+        uint64_t snapshotsDelivered;
+        uint64_t deltasApplied;
+        uint64_t resyncsRequested;
+        uint64_t snapshotsCorrupt; // Decoded to something the sender never sent
+        uint64_t pongsSent;
+        uint64_t bytesDelivered;
+        uint64_t latencySumMicros;
+        uint64_t checksum; // Of every delivery, to compare runs
+        std::vector<uint64_t> latencyHistogram;
+
+        Results();
+        void add(const Results& other);
+    };
+
+    // One match with its reactor and clients, only touched by the thread running it
+    struct Shard {
+        std::unique_ptr<Match> match;
+        std::unique_ptr<Reactor> reactor;
+        std::vector<SimClient> clients;
+        std::mt19937_64 random;
+        std::priority_queue<Event, std::vector<Event>, EventLater> events;
+        uint64_t now;
+        uint64_t nextOrder;
+        std::vector<std::vector<uint8_t>> spareBuffers;
+        std::vector<Connection*> ready;
+        std::vector<uint8_t> scratch;
+        std::vector<uint8_t> decodeScratch;
+        Results results;
+    };
+
+    SimulationConfig config;
+    std::unique_ptr<Server> server; // Never started; its handler serves every shard
+    uint64_t latencyMicros;
+    uint64_t jitterMicros;
+    uint64_t rtoMicros;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<size_t> nextShard;
+    Results totals;
+
+    static void schedule(Shard& shard, uint64_t time, EventKind kind, uint32_t index);
+    static std::vector<uint8_t> takeBuffer(Shard& shard);
+    static void appendFrame(std::vector<uint8_t>& out, uint8_t type, const uint8_t* payload, size_t size);
+    uint64_t transmit(Shard& shard, Link& link, size_t bytes);
+    void sendPacket(Shard& shard, uint32_t clientIndex, bool uplink, const uint8_t* data, size_t size);
+    void stepReactor(Shard& shard, Connection* ready, bool tick);
+    void runShard(Shard& shard);
+    void sendInput(Shard& shard, uint32_t clientIndex);
+    void deliverUplink(Shard& shard, uint32_t clientIndex);
+    void deliverDownlink(Shard& shard, uint32_t clientIndex);
+    void receiveFrame(Shard& shard, uint32_t clientIndex, const uint8_t* frame, size_t size);
+    bool applyDelta(Shard& shard, Baseline& baseline, const uint8_t* payload, size_t size);
+    void requestResync(Shard& shard, uint32_t clientIndex, uint8_t senderID);
+    void recordSnapshot(Shard& shard, Baseline& baseline);
+    uint64_t latencyPercentile(double fraction) const;
+
+public:
+    Simulation(const SimulationConfig& simulationConfig);
+
+    void run();
+    void printReport(std::ostream& out, double wallSeconds) const;
+};
+
+// Server Configuration
+struct ServerConfig {
+    unsigned reactorThreads;    // 0 picks one per core, up to MAX_REACTOR_THREADS
+    WaitStrategy broadcastWait;
+    bool pipeline;              // Decode, simulate and fan out on stage threads instead of the reactors
+    size_t matchSize;           // Members per match, 0 puts everyone into one match
+    std::vector<unsigned> tickRates;
+    unsigned matchWorkers;      // 0 picks one per core, up to MAX_MATCH_WORKERS
+    uint16_t port;              // Game connections
+    uint16_t spectatorPort;
+    std::string demoDirectory;  // Where match demos are written, empty to not record
+    std::string checkpointPath; // Where checkpoints are written, empty for none
+    unsigned checkpointSeconds; // Between checkpoints, 0 for only when asked
+    std::string restorePath;    // Checkpoint to reopen the matches of at startup
+    std::string playerLogPath;  // Where player records are kept, empty to not keep them
+    unsigned bots;              // Server-hosted bots to add at startup
+
+    ServerConfig() : reactorThreads(0), broadcastWait(WAIT_YIELD), pipeline(false), matchSize(0),
+        tickRates(1, DEFAULT_TICK_RATE), matchWorkers(0), port(PORT), spectatorPort(SPECTATOR_PORT), checkpointSeconds(0),
+        bots(0) {}
+};
+
+class Server {
+private:
+    ServerConfig config;
+    SOCKET listeningSocket;
+    std::vector<std::shared_ptr<Connection>> clients;
+    std::vector<std::unique_ptr<Reactor>> reactors;
+    std::atomic<size_t> nextReactor;
+    std::mutex clientsMutex;
+    std::deque<uint8_t> freeClientIDs; // Guarded by clientsMutex; released IDs go to the back, so reuse comes late
+    std::atomic<bool> isRunning;
+    MatchScheduler matches;
+    std::unique_ptr<Pipeline> pipeline;
+    OverloadGovernor governor;
+    std::thread governorThread;
+    VoiceRelay voice;
+    bool voiceRunning;                 // Set before any client is accepted
+    std::unique_ptr<SpectatorFeed> spectators;
+    std::unique_ptr<DemoRecorder> recorder;
+    std::unique_ptr<Checkpointer> checkpointer;
+    std::unique_ptr<PlayerStore> players;
+
+    // Bot metrics
+    std::atomic<uint64_t> botCount;
+    std::atomic<uint64_t> botInputs;
+    std::atomic<uint64_t> botFramesReceived;
+    std::atomic<uint64_t> botSnapshotsReceived;
+
+    void sendVoiceSetup(Connection& conn);
+    void identifyPlayer(Connection& conn, const FrameView& frame);
+    void sendCachedSnapshots(Connection& conn);
+    void updatePlayerState(Connection& conn, const FrameView& frame);
+    bool takeClientID(uint8_t& clientID);
+    void runGovernor();
+    LoadSample sampleLoad(uint64_t& ticks, uint64_t& late, uint64_t& cpuMicros,
+        std::chrono::steady_clock::time_point& sampledAt);
+
+public:
+    Server(const ServerConfig& serverConfig = ServerConfig())
+        : config(serverConfig), listeningSocket(INVALID_SOCKET), nextReactor(0), isRunning(true),
+        matches(serverConfig.matchSize, serverConfig.tickRates), voiceRunning(false), botCount(0), botInputs(0),
+        botFramesReceived(0), botSnapshotsReceived(0) {
+        // 0 is never a client; senders and visibility bits are indexed by ID
+        for (unsigned id = 1; id <= 255; id++) freeClientIDs.push_back((uint8_t)id);
+    }
+
+    void start();
+    void acceptClients();
+    Task handleClient(Connection& conn);
+    Task runBot(Connection& conn);
+    void broadcastMessage(BaseMessage* msg, uint8_t excludeID, Match* match);
+    void removeClient(Connection& conn);
+    void addBots(unsigned count);
+    void requestCheckpoint();
+    void printStats();
+    void stop();
+};
+
+// Serialization and Deserialization Functions
+void serializeMessage(BaseMessage* msg, std::vector<uint8_t>& buffer);
+SharedFrame serializeFrame(BaseMessage* msg);
+BaseMessage* deserializeMessage(const uint8_t* data, size_t size);
+bool prepareRelayedFrame(std::vector<uint8_t>& frame, uint8_t senderID);
+bool encodeSnapshotDelta(const uint8_t* baseline, size_t baselineSize, const uint8_t* snapshot, size_t size,
+    std::vector<uint8_t>& xorScratch, std::vector<uint8_t>& out);
+bool decodeSnapshotDelta(const uint8_t* delta, size_t deltaSize, uint8_t* target, size_t size);
+
+// Socket Helpers
+bool setNonBlocking(SOCKET sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// CPU time used by the whole process so far
+uint64_t processCpuMicros() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+    uint64_t kernelTime = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    uint64_t userTime = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (kernelTime + userTime) / 10; // 100 ns units
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+// Keeps a thread on one core; failures are harmless and ignored
+void pinThreadToCore(std::thread& thread, unsigned core) {
+#ifdef _WIN32
+    SetThreadAffinityMask((HANDLE)thread.native_handle(), (DWORD_PTR)1 << core);
+#else
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#endif
+}
+
+bool lastErrorWouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// A non-blocking connect() that has started and will finish later
+bool lastErrorInProgress() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+// Transport
+
+int SocketTransport::send(const uint8_t* data, size_t size) {
+    int bytesSent = ::send(socket, (const char*)data, (int)size, 0);
+    if (bytesSent >= 0) return bytesSent;
+    return lastErrorWouldBlock() ? WOULD_BLOCK : FAILED;
+}
+
+int SocketTransport::receive(uint8_t* data, size_t size) {
+    int bytesReceived = ::recv(socket, (char*)data, (int)size, 0);
+    if (bytesReceived >= 0) return bytesReceived;
+    return lastErrorWouldBlock() ? WOULD_BLOCK : FAILED;
+}
+
+// Connection
+
+bool Connection::hasFrame() const {
+    size_t available = inBuffer.size() - inStart;
+    if (available < sizeof(uint32_t)) return false;
+
+    uint32_t msgSize;
+    memcpy(&msgSize, inBuffer.data() + inStart, sizeof(msgSize));
+    return available - sizeof(uint32_t) >= ntohl(msgSize);
+}
+
+FrameView Connection::popFrame() {
+    if (!hasFrame()) return FrameView{ nullptr, 0 };
+
+    uint32_t msgSize;
+    memcpy(&msgSize, inBuffer.data() + inStart, sizeof(msgSize));
+    msgSize = ntohl(msgSize);
+
+    FrameView frame{ inBuffer.data() + inStart + sizeof(uint32_t), msgSize };
+    inStart += sizeof(uint32_t) + msgSize;
+    return frame;
+}
+
+void Connection::readAvailable() {
+    // Drop consumed bytes before reading more; views from popFrame() are
+    // only valid until the next read
+    if (inStart > 0) {
+        inBuffer.erase(inBuffer.begin(), inBuffer.begin() + inStart);
+        inStart = 0;
+    }
+
+    while (!closed) {
+        size_t offset = inBuffer.size();
+        inBuffer.resize(offset + RECV_CHUNK_SIZE);
+        int bytesReceived = transport->receive(inBuffer.data() + offset, RECV_CHUNK_SIZE);
+        if (bytesReceived > 0) {
+            inBuffer.resize(offset + bytesReceived);
+            if ((size_t)bytesReceived < RECV_CHUNK_SIZE) break;
+            continue;
+        }
+        inBuffer.resize(offset);
+        if (bytesReceived == Transport::WOULD_BLOCK) break;
+        closed = true;
+    }
+}
+
+// Checks whether a whole frame still fits into the outbound budget
+bool Connection::reserveOutput(size_t size) {
+    if (closed) return false;
+    if (pendingOutput() + size > MAX_OUTBOUND_BYTES) {
+        if (!dropWarningShown) {
+            std::cerr << "Client " << (int)clientID << " is falling behind, dropping messages.\n";
+            dropWarningShown = true;
+        }
+        // The client misses snapshots, so deltas against them would be wrong
+        baselinesStale = true;
+        droppedFrames.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void Connection::queueFrame(const uint8_t* data, size_t size) {
+    // Pings and setup frames mean nothing to a bot
+    if (bot) return;
+    if (!reserveOutput(size)) return;
+    outBuffer.insert(outBuffer.end(), data, data + size);
+}
+
+// Queues a frame relayed from another client. Snapshots are delta-encoded
+// against the last snapshot from the same sender when the client supports
+// it and the delta pays off; everything else is queued unchanged.
+void Connection::queueRelayedFrame(const SharedFrame& frame) {
+    if (bot) {
+        botInbox.push_back(frame);
+        return;
+    }
+    const uint8_t* data = frame->data();
+    size_t size = frame->size();
+    if (deltaSnapshots && !baselinesStale && size > FRAME_HEADER_SIZE && data[4] == VISIBILITY_MESSAGE) {
+        // Clients drop what they know of members leaving view, so their next snapshot goes out in full
+        size_t leftAt = FRAME_HEADER_SIZE + 1 + data[FRAME_HEADER_SIZE];
+        for (size_t i = leftAt + 1; i < size; i++) {
+            baselines[data[i]] = SnapshotBaseline();
+        }
+    }
+    if (!deltaSnapshots || size < FRAME_HEADER_SIZE || data[4] != SNAPSHOT_MESSAGE) {
+        queueFrame(data, size);
+        return;
+    }
+    if (baselinesStale) {
+        resyncSnapshots();
+    }
+
+    SnapshotBaseline& baseline = baselines[data[5]];
+    const SnapshotEncodeCache::Entry* encoded = nullptr;
+    if (baseline.frame) {
+        encoded = &reactor->getEncodeCache().encode(baseline.frame, frame);
+    }
+
+    if (encoded && encoded->isDelta) {
+        if (!reserveOutput(encoded->frame.size())) return;
+        size_t start = outBuffer.size();
+        outBuffer.insert(outBuffer.end(), encoded->frame.begin(), encoded->frame.end());
+        uint16_t sequence = htons(baseline.sequence);
+        memcpy(outBuffer.data() + start + FRAME_HEADER_SIZE, &sequence, sizeof(sequence));
+        baseline.sequence++;
+    }
+    else {
+        if (!reserveOutput(size)) return;
+        outBuffer.insert(outBuffer.end(), data, data + size);
+        baseline.sequence = 1;
+    }
+    baseline.frame = frame;
+}
+
+// Forgets every baseline, so the next snapshot from each sender is sent in full
+void Connection::resyncSnapshots() {
+    baselines.assign(256, SnapshotBaseline());
+    baselinesStale = false;
+}
+
+void Connection::flush() {
+    while (!closed && pendingOutput() > 0) {
+        int bytesSent = transport->send(outBuffer.data() + outStart, pendingOutput());
+        if (bytesSent > 0) {
+            outStart += bytesSent;
+            continue;
+        }
+        if (bytesSent == Transport::WOULD_BLOCK) break;
+        closed = true;
+    }
+
+    if (outStart == outBuffer.size()) {
+        outBuffer.clear();
+        outStart = 0;
+        dropWarningShown = false;
+    }
+    else if (outStart > outBuffer.size() / 2) {
+        outBuffer.erase(outBuffer.begin(), outBuffer.begin() + outStart);
+        outStart = 0;
+    }
+    queuedBytes.store((uint32_t)pendingOutput(), std::memory_order_relaxed);
+}
+
+uint64_t steadyMicros() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Sends the current time for the client to echo back in a pong
+void Connection::queuePing() {
+    uint8_t frame[sizeof(uint32_t) + 2 + sizeof(uint32_t) + sizeof(uint64_t)];
+    uint32_t msgSize = htonl(2 + sizeof(uint32_t) + sizeof(uint64_t));
+    uint32_t length = htonl(sizeof(uint64_t));
+    uint64_t sentAt = reactor->clockMicros();
+    memcpy(frame, &msgSize, sizeof(msgSize));
+    frame[4] = PING_MESSAGE;
+    frame[5] = 0;
+    memcpy(frame + 6, &length, sizeof(length));
+    memcpy(frame + 10, &sentAt, sizeof(sentAt)); // Only read back by this server, so host order
+    queueFrame(frame, sizeof(frame));
+}
+
+void Connection::handlePong(const FrameView& frame) {
+    if (frame.size < 2 + sizeof(uint32_t) + sizeof(uint64_t)) return;
+
+    uint64_t sentAt;
+    memcpy(&sentAt, frame.data + 6, sizeof(sentAt));
+    uint64_t now = reactor->clockMicros();
+    if (sentAt > now) return;
+
+    uint32_t sample = (uint32_t)std::min<uint64_t>(now - sentAt, UINT32_MAX);
+    uint32_t rtt = rttMicros.load(std::memory_order_relaxed);
+    rttMicros.store(rtt == 0 ? sample : (uint32_t)(((uint64_t)rtt * 7 + sample) / 8), std::memory_order_relaxed);
+}
+
+// Queues a length-prefixed copy of the message and suspends if the client is behind
+Connection::SendAwaitable Connection::send(const std::vector<uint8_t>& message) {
+    uint32_t msgSize = htonl((uint32_t)message.size());
+    if (reserveOutput(sizeof(msgSize) + message.size())) {
+        outBuffer.insert(outBuffer.end(), (uint8_t*)&msgSize, (uint8_t*)&msgSize + sizeof(msgSize));
+        outBuffer.insert(outBuffer.end(), message.begin(), message.end());
+    }
+    flush();
+    return SendAwaitable{ *this };
+}
+
+void Connection::TickAwaitable::await_suspend(std::coroutine_handle<> h) {
+    conn.waiting = h;
+    conn.waitKind = WAIT_TICK;
+}
+
+uint64_t Connection::TickAwaitable::await_resume() const {
+    return conn.reactor->getTickCount();
+}
+
+// Snapshot Encode Cache
+
+const SnapshotEncodeCache::Entry& SnapshotEncodeCache::encode(const SharedFrame& baseline, const SharedFrame& target) {
+    size_t hash = std::hash<const void*>()(baseline.get()) * 31 + std::hash<const void*>()(target.get());
+    size_t home = hash & (SLOT_COUNT - 1);
+    size_t slot = home;
+    for (size_t i = 0; i < MAX_PROBES; i++) {
+        size_t probe = (home + i) & (SLOT_COUNT - 1);
+        Entry& entry = slots[probe];
+        if (entry.baseline == baseline && entry.target == target) {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return entry;
+        }
+        if (!entry.target) {
+            slot = probe;
+            break;
+        }
+    }
+    misses.fetch_add(1, std::memory_order_relaxed);
+
+    // Miss: take the free slot, or evict the first one probed
+    Entry& entry = slots[slot];
+    if (!entry.target) {
+        usedSlots.push_back(slot);
+    }
+    entry.baseline = baseline;
+    entry.target = target;
+
+    const uint8_t* snapshot = target->data() + FRAME_HEADER_SIZE;
+    size_t snapshotSize = target->size() - FRAME_HEADER_SIZE;
+
+    // The delta is written straight behind its frame and delta headers
+    entry.frame.resize(FRAME_HEADER_SIZE + DELTA_HEADER_SIZE);
+    entry.isDelta = encodeSnapshotDelta(baseline->data() + FRAME_HEADER_SIZE, baseline->size() - FRAME_HEADER_SIZE,
+        snapshot, snapshotSize, xorScratch, entry.frame);
+    if (entry.isDelta) {
+        size_t deltaSize = entry.frame.size() - FRAME_HEADER_SIZE;
+        uint32_t msgSize = htonl((uint32_t)(2 + sizeof(uint32_t) + deltaSize));
+        uint32_t length = htonl((uint32_t)deltaSize);
+        uint32_t rawSize = htonl((uint32_t)snapshotSize);
+        uint8_t* out = entry.frame.data();
+        memcpy(out, &msgSize, sizeof(msgSize));
+        out[4] = SNAPSHOT_DELTA_MESSAGE;
+        out[5] = target->data()[5];
+        memcpy(out + 6, &length, sizeof(length));
+        // Sequence at FRAME_HEADER_SIZE is per recipient; the flags byte after it comes from the encoder
+        memcpy(out + FRAME_HEADER_SIZE + 3, &rawSize, sizeof(rawSize));
+    }
+    return entry;
+}
+
+// Releases the cached frames; encoded buffers keep their capacity
+void SnapshotEncodeCache::clear() {
+    for (size_t slot : usedSlots) {
+        slots[slot].baseline.reset();
+        slots[slot].target.reset();
+    }
+    usedSlots.clear();
+}
+
+// SPSC Queue
+
+// Moves as many items as fit from the front of items, erasing them there
+template <typename T>
+size_t SpscQueue<T>::pushBatch(std::vector<T>& items) {
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    size_t room = slots.size() - (size_t)(position - cachedHead);
+    if (room < items.size()) {
+        cachedHead = head.load(std::memory_order_acquire);
+        room = slots.size() - (size_t)(position - cachedHead);
+    }
+
+    size_t count = std::min(room, items.size());
+    for (size_t i = 0; i < count; i++) {
+        slots[(position + i) & (slots.size() - 1)] = std::move(items[i]);
+    }
+    tail.store(position + count, std::memory_order_release);
+    items.erase(items.begin(), items.begin() + count);
+    return count;
+}
+
+// Appends up to maxItems items to out
+template <typename T>
+size_t SpscQueue<T>::popBatch(std::vector<T>& out, size_t maxItems) {
+    uint64_t position = head.load(std::memory_order_relaxed);
+    if (cachedTail == position) {
+        cachedTail = tail.load(std::memory_order_acquire);
+        if (cachedTail == position) return 0;
+    }
+
+    size_t count = std::min((size_t)(cachedTail - position), maxItems);
+    for (size_t i = 0; i < count; i++) {
+        // Moving out also releases whatever the slot held
+        out.push_back(std::move(slots[(position + i) & (slots.size() - 1)]));
+    }
+    head.store(position + count, std::memory_order_release);
+    return count;
+}
+
+// Approximate when called from a third thread, which is enough for stats
+template <typename T>
+size_t SpscQueue<T>::size() const {
+    uint64_t first = head.load(std::memory_order_acquire);
+    return (size_t)(tail.load(std::memory_order_acquire) - first);
+}
+
+// Broadcast Ring
+
+BroadcastRing::BroadcastRing(size_t readers, size_t ownerIndex, WaitStrategy strategy)
+    : entries(BROADCAST_RING_SIZE), cursors(new Cursor[readers]), readerCount(readers),
+    published(0), cachedGate(0), waitStrategy(strategy) {
+    for (size_t i = 0; i < readers; i++) {
+        cursors[i].next.store(i == ownerIndex ? DETACHED : 0, std::memory_order_relaxed);
+    }
+}
+
+// Slowest attached reader; with none attached, everything counts as read
+uint64_t BroadcastRing::gate() const {
+    uint64_t slowest = published.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < readerCount; i++) {
+        uint64_t next = cursors[i].next.load(std::memory_order_acquire);
+        if (next != DETACHED && next < slowest) slowest = next;
+    }
+    return slowest;
+}
+
+// Returns false if the slowest reader is a full ring behind
+bool BroadcastRing::tryPublish(const BroadcastRing::Entry& broadcast) {
+    uint64_t sequence = published.load(std::memory_order_relaxed);
+    if (sequence >= cachedGate + BROADCAST_RING_SIZE) {
+        cachedGate = gate();
+        if (sequence >= cachedGate + BROADCAST_RING_SIZE) return false;
+    }
+
+    entries[sequence & (BROADCAST_RING_SIZE - 1)] = broadcast;
+    published.store(sequence + 1, std::memory_order_release);
+    return true;
+}
+
+void BroadcastRing::waitForReaders() {
+    switch (waitStrategy) {
+    case WAIT_BUSY_SPIN:
+#ifdef SNAPSHOT_DELTA_SSE2
+        _mm_pause();
+#endif
+        break;
+    case WAIT_YIELD:
+        std::this_thread::yield();
+        break;
+    case WAIT_BLOCK: {
+        // Timed, so a missed notification only costs a millisecond
+        std::unique_lock<std::mutex> lock(waitMutex);
+        readerAdvanced.wait_for(lock, std::chrono::milliseconds(1));
+        break;
+    }
+    }
+}
+
+void BroadcastRing::advance(size_t reader, uint64_t next) {
+    cursors[reader].next.store(next, std::memory_order_release);
+    if (waitStrategy == WAIT_BLOCK) {
+        readerAdvanced.notify_one();
+    }
+}
+
+// Stops a reader from gating the writer, e.g. when its reactor shuts down
+void BroadcastRing::detach(size_t reader) {
+    cursors[reader].next.store(DETACHED, std::memory_order_release);
+    if (waitStrategy == WAIT_BLOCK) {
+        readerAdvanced.notify_one();
+    }
+}
+
+// Reactor
+
+bool Reactor::start() {
+    // A loopback UDP socket lets other threads interrupt poll()
+    wakeSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (wakeSocket == INVALID_SOCKET) {
+        std::cerr << "Error creating reactor wake socket.\n";
+        return false;
+    }
+    wakeAddress.sin_family = AF_INET;
+    wakeAddress.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &wakeAddress.sin_addr);
+    socklen_t addressSize = sizeof(wakeAddress);
+    if (bind(wakeSocket, (sockaddr*)&wakeAddress, sizeof(wakeAddress)) == SOCKET_ERROR ||
+        getsockname(wakeSocket, (sockaddr*)&wakeAddress, &addressSize) == SOCKET_ERROR) {
+        std::cerr << "Error binding reactor wake socket.\n";
+        closesocket(wakeSocket);
+        return false;
+    }
+    setNonBlocking(wakeSocket);
+
+    isRunning = true;
+    thread = std::thread(&Reactor::run, this);
+    if (pipeline) {
+        // Stage threads are pinned to the cores after these
+        pinThreadToCore(thread, (unsigned)(index % std::max(1u, std::thread::hardware_concurrency())));
+    }
+    return true;
+}
+
+void Reactor::stop() {
+    if (!isRunning.exchange(false)) return;
+    wake();
+    if (thread.joinable()) {
+        thread.join();
+    }
+    closesocket(wakeSocket);
+}
+
+void Reactor::adopt(std::shared_ptr<Connection> conn) {
+    {
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        pendingConnections.push_back(std::move(conn));
+    }
+    wake();
+}
+
+void Reactor::post(const std::shared_ptr<Connection>& conn, const SharedFrame& frame) {
+    if (current == this) {
+        conn->queueRelayedFrame(frame);
+        conn->flush();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        pendingFrames.push_back(Outbound{ conn, frame });
+    }
+    wake();
+}
+
+void Reactor::postFrames(const Outbound* frames, size_t count) {
+    {
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        pendingFrames.insert(pendingFrames.end(), frames, frames + count);
+    }
+    wake();
+}
+
+// Delivers a broadcast from one of this reactor's clients: directly to the
+// local connections, and through the ring to every other reactor
+void Reactor::broadcast(const BroadcastRing::Entry& broadcast) {
+    deliverBroadcast(broadcast);
+    if (peers.size() <= 1) return;
+
+    while (!ring.tryPublish(broadcast)) {
+        // Other reactors may be waiting on this one's cursor, so keep reading
+        consumeRings();
+        if (!isRunning) return;
+        ring.waitForReaders();
+    }
+    for (Reactor* peer : peers) {
+        if (peer != this) peer->wake();
+    }
+}
+
+// Broadcast from a thread that is not a reactor
+void Reactor::postBroadcast(const BroadcastRing::Entry& broadcast) {
+    {
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        pendingBroadcasts.push_back(broadcast);
+    }
+    wake();
+}
+
+void Reactor::deliverBroadcast(const BroadcastRing::Entry& broadcast) {
+    for (std::shared_ptr<Connection>& conn : connections) {
+        if (conn->match == broadcast.match && conn->clientID != broadcast.excludeID) {
+            conn->queueRelayedFrame(broadcast.frame);
+        }
+    }
+}
+
+void Reactor::submit(const Connection& conn, const FrameView& frame) {
+    PipelineJob job;
+    uint32_t msgSize = htonl((uint32_t)frame.size);
+    job.bytes.reserve(sizeof(msgSize) + frame.size);
+    job.bytes.insert(job.bytes.end(), (const uint8_t*)&msgSize, (const uint8_t*)&msgSize + sizeof(msgSize));
+    job.bytes.insert(job.bytes.end(), frame.data, frame.data + frame.size);
+    job.senderID = conn.clientID;
+    job.match = conn.match;
+    pipelineBacklog.push_back(std::move(job));
+}
+
+// Hands this round's received messages to the decode stage in one batch and
+// delivers whatever the fan-out stage has finished for this reactor
+void Reactor::exchangePipeline() {
+    if (!pipelineBacklog.empty()) {
+        pipeline->submit(index, pipelineBacklog);
+    }
+
+    pipelineOutput.clear();
+    pipeline->collect(index, pipelineOutput);
+    for (BroadcastRing::Entry& entry : pipelineOutput) {
+        deliverBroadcast(entry);
+    }
+}
+
+// Catches up with every other reactor's ring
+void Reactor::consumeRings() {
+    for (Reactor* peer : peers) {
+        if (peer == this) continue;
+
+        BroadcastRing& peerRing = peer->ring;
+        uint64_t next = peerRing.getCursor(index);
+        uint64_t published = peerRing.getPublished();
+        if (next == published) continue;
+
+        for (; next < published; next++) {
+            const BroadcastRing::Entry& entry = peerRing.at(next);
+            deliverBroadcast(entry);
+        }
+        peerRing.advance(index, next);
+    }
+}
+
+void Reactor::wake() {
+    // A reactor the simulation steps was never started and has no wake socket
+    if (wakeSocket == INVALID_SOCKET || wakePending.exchange(true)) return;
+    char byte = 0;
+    sendto(wakeSocket, &byte, 1, 0, (sockaddr*)&wakeAddress, sizeof(wakeAddress));
+}
+
+void Reactor::drainInbox() {
+    std::vector<std::shared_ptr<Connection>> newConnections;
+    std::vector<Outbound> frames;
+    std::vector<BroadcastRing::Entry> broadcasts;
+    {
+        std::lock_guard<std::mutex> lock(inboxMutex);
+        newConnections.swap(pendingConnections);
+        frames.swap(pendingFrames);
+        broadcasts.swap(pendingBroadcasts);
+    }
+
+    for (std::shared_ptr<Connection>& conn : newConnections) {
+        if (conn->bot) {
+            conn->task = server.runBot(*conn).handle;
+            bots.push_back(conn);
+        }
+        else {
+            if (conn->socket != INVALID_SOCKET) setNonBlocking(conn->socket);
+            conn->task = server.handleClient(*conn).handle;
+            connections.push_back(conn);
+        }
+        conn->task.resume();
+    }
+
+    for (Outbound& outbound : frames) {
+        if (!outbound.conn->closed) {
+            outbound.conn->queueRelayedFrame(outbound.frame);
+        }
+    }
+    for (BroadcastRing::Entry& entry : broadcasts) {
+        deliverBroadcast(entry);
+    }
+    consumeRings();
+    if (pipeline) {
+        exchangePipeline();
+    }
+
+    for (std::shared_ptr<Connection>& conn : connections) {
+        conn->flush();
+        if (conn->waitKind == Connection::WAIT_SEND && (conn->closed || conn->pendingOutput() < SEND_HIGH_WATER)) {
+            resume(*conn);
+        }
+    }
+}
+
+void Reactor::resume(Connection& conn) {
+    std::coroutine_handle<> h = conn.waiting;
+    conn.waiting = nullptr;
+    conn.waitKind = Connection::WAIT_NONE;
+    if (h && !h.done()) {
+        h.resume();
+    }
+}
+
+void Reactor::closeFinished(std::vector<std::shared_ptr<Connection>>& finished) {
+    for (size_t i = 0; i < finished.size(); ) {
+        std::shared_ptr<Connection> conn = finished[i];
+        if (!conn->task.done()) {
+            i++;
+            continue;
+        }
+
+        conn->closed = true;
+        server.removeClient(*conn);
+        if (!conn->bot) {
+            closesocket(conn->socket);
+            std::cout << "Client " << (int)conn->clientID << " disconnected.\n";
+        }
+
+        finished[i] = finished.back();
+        finished.pop_back();
+    }
+}
+
+// Reads or writes what poll() found ready and resumes the handler if what
+// it waits for has come
+void Reactor::service(Connection& conn, bool readable, bool writable) {
+    if (readable) {
+        conn.readAvailable();
+    }
+    if (writable) {
+        conn.flush();
+    }
+
+    bool ready = false;
+    switch (conn.waitKind) {
+    case Connection::WAIT_RECV:
+        ready = conn.closed || conn.hasFrame();
+        break;
+    case Connection::WAIT_SEND:
+        ready = conn.closed || conn.pendingOutput() < SEND_HIGH_WATER;
+        break;
+    default:
+        break;
+    }
+    if (ready) {
+        resume(conn);
+    }
+}
+
+void Reactor::runTick() {
+    tickCount++;
+    encodeCache.clear();
+    bool ping = tickCount % PING_INTERVAL_TICKS == 0;
+    for (std::shared_ptr<Connection>& conn : connections) {
+        if (ping && !conn->closed) {
+            conn->queuePing();
+        }
+        if (conn->waitKind == Connection::WAIT_TICK) {
+            resume(*conn);
+        }
+    }
+    for (std::shared_ptr<Connection>& bot : bots) {
+        if (bot->waitKind == Connection::WAIT_TICK) {
+            resume(*bot);
+        }
+    }
+}
+
+// The simulation passes the connections its links made readable or
+// writable, as poll() would have, and says when a tick is due
+void Reactor::simulateStep(uint64_t nowMicros, const std::vector<Connection*>& ready, bool tick) {
+    current = this;
+    FramePool::current = &framePool;
+    simulated = true;
+    simulatedMicros = nowMicros;
+
+    for (Connection* conn : ready) {
+        service(*conn, true, true);
+    }
+    drainInbox();
+    if (tick) {
+        runTick();
+    }
+    closeFinished(connections);
+    closeFinished(bots);
+
+    FramePool::current = nullptr;
+    current = nullptr;
+}
+
+uint64_t Reactor::clockMicros() const {
+    return simulated ? simulatedMicros : steadyMicros();
+}
+
+void Reactor::run() {
+    current = this;
+    FramePool::current = &framePool;
+
+    std::vector<WSAPOLLFD> pollSet;
+    auto nextTick = std::chrono::steady_clock::now() + TICK_INTERVAL;
+
+    while (isRunning) {
+        pollSet.clear();
+        WSAPOLLFD wakeEntry{};
+        wakeEntry.fd = wakeSocket;
+        wakeEntry.events = POLLIN;
+        pollSet.push_back(wakeEntry);
+        // Messages still waiting for room in the pipeline are retried promptly
+        bool retryPipeline = pipeline && !pipelineBacklog.empty();
+        for (std::shared_ptr<Connection>& conn : connections) {
+            WSAPOLLFD entry{};
+            entry.fd = conn->socket;
+            entry.events = conn->closed ? 0 : POLLIN;
+            if (conn->pendingOutput() > 0) entry.events |= POLLOUT;
+            pollSet.push_back(entry);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        int timeout = retryPipeline ? 0 : (int)std::max<long long>(0,
+            std::chrono::duration_cast<std::chrono::milliseconds>(nextTick - now).count());
+        WSAPoll(pollSet.data(), (unsigned long)pollSet.size(), timeout);
+
+        if (pollSet[0].revents & POLLIN) {
+            char drain[64];
+            while (recvfrom(wakeSocket, drain, sizeof(drain), 0, nullptr, nullptr) > 0) {}
+        }
+        wakePending = false;
+
+        // Only the connections that were polled have a matching entry
+        size_t polled = pollSet.size() - 1;
+        for (size_t i = 0; i < polled; i++) {
+            short revents = pollSet[i + 1].revents;
+            service(*connections[i], (revents & (POLLIN | POLLERR | POLLHUP)) != 0, (revents & POLLOUT) != 0);
+        }
+
+        drainInbox();
+
+        if (std::chrono::steady_clock::now() >= nextTick) {
+            nextTick += TICK_INTERVAL;
+            runTick();
+        }
+
+        closeFinished(connections);
+        closeFinished(bots);
+    }
+
+    // Other reactors must not wait on this one any more
+    for (Reactor* peer : peers) {
+        if (peer != this) peer->ring.detach(index);
+    }
+
+    // Shut down remaining connections; their suspended handlers are destroyed with them
+    for (std::shared_ptr<Connection>& conn : connections) {
+        conn->closed = true;
+        closesocket(conn->socket);
+    }
+    connections.clear();
+    bots.clear();
+
+    FramePool::current = nullptr;
+    current = nullptr;
+}
+
+// Visibility Bitsets
+
+// Entered is what after has and before lacks, left the reverse. Returns
+// false if nothing changed.
+bool diffVisibility(const ClientBitset& before, const ClientBitset& after, ClientBitset& entered, ClientBitset& left) {
+#ifdef SNAPSHOT_DELTA_SSE2
+    __m128i changed = _mm_setzero_si128();
+    for (int i = 0; i < 4; i += 2) {
+        __m128i b = _mm_load_si128((const __m128i*)(before.words + i));
+        __m128i a = _mm_load_si128((const __m128i*)(after.words + i));
+        _mm_store_si128((__m128i*)(entered.words + i), _mm_andnot_si128(b, a));
+        _mm_store_si128((__m128i*)(left.words + i), _mm_andnot_si128(a, b));
+        changed = _mm_or_si128(changed, _mm_xor_si128(a, b));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(changed, _mm_setzero_si128())) != 0xFFFF;
+#else
+    uint64_t changed = 0;
+    for (int i = 0; i < 4; i++) {
+        entered.words[i] = after.words[i] & ~before.words[i];
+        left.words[i] = before.words[i] & ~after.words[i];
+        changed |= after.words[i] ^ before.words[i];
+    }
+    return changed != 0;
+#endif
+}
+
+// Appends the ID of every set bit in ascending order and returns how many
+size_t appendClientIDs(const ClientBitset& bits, std::vector<uint8_t>& out) {
+    size_t count = 0;
+    for (int i = 0; i < 4; i++) {
+        uint64_t word = bits.words[i];
+        while (word != 0) {
+            unsigned bit = 0;
+            while (!(word & (1ull << bit))) bit++;
+            out.push_back((uint8_t)(i * 64 + bit));
+            word &= word - 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Match
+
+Match::Match(uint32_t matchID, unsigned rate, size_t maxMembers)
+    : id(matchID), tickRate(std::max(1u, rate)), tickInterval(std::chrono::nanoseconds(1000000000) / tickRate),
+    tickBudget(tickInterval * MATCH_TICK_BUDGET_PERCENT / 100), capacity(maxMembers), latestVersion{}, tickNumber(0),
+    recorder(nullptr), latestChanged(false), restoredUntilTick(0), ticks(0), deadlineMisses(0), budgetOverruns(0), busyNanos(0), maxTickNanos(0),
+    snapshotsSent(0), snapshotBytes(0), snapshotsDeferred(0), membersEntered(0), membersLeft(0), degradation(DEGRADE_NONE) {}
+
+// Returns false if the match is full
+bool Match::addMember(const std::shared_ptr<Connection>& conn) {
+    std::lock_guard<std::mutex> lock(matchMutex);
+    if (capacity != 0 && members.size() >= capacity) return false;
+
+    std::unique_ptr<Member> member(new Member());
+    member->conn = conn;
+    member->lastMovedTick = tickNumber;
+    // A restored snapshot under this ID belongs to whoever had it before the restart
+    auto restoredRecord = std::find_if(restored.begin(), restored.end(),
+        [&conn](const CheckpointMember& record) { return record.clientID == conn->clientID; });
+    if (restoredRecord != restored.end()) {
+        restored.erase(restoredRecord);
+        latest[conn->clientID].reset();
+        latestVersion[conn->clientID]++;
+    }
+
+    // Snapshots staged so far reach the member as cached snapshots when it joins
+    memcpy(member->sentVersion, latestVersion, sizeof(latestVersion));
+
+    auto position = std::upper_bound(members.begin(), members.end(), conn->reactor,
+        [](Reactor* reactor, const std::unique_ptr<Member>& m) { return std::less<Reactor*>()(reactor, m->conn->reactor); });
+    members.insert(position, std::move(member));
+    return true;
+}
+
+void Match::removeMember(const Connection& conn) {
+    SharedFrame evicted;
+    std::lock_guard<std::mutex> lock(matchMutex);
+    members.erase(std::remove_if(members.begin(), members.end(),
+        [&conn](const std::unique_ptr<Member>& m) { return m->conn.get() == &conn; }), members.end());
+    evicted.swap(latest[conn.clientID]);
+    latestVersion[conn.clientID]++;
+    latestChanged = true;
+}
+
+size_t Match::getMemberCount() const {
+    std::lock_guard<std::mutex> lock(matchMutex);
+    return members.size();
+}
+
+void Match::updatePlayerState(uint8_t clientID, const float position[3], uint8_t team) {
+    std::lock_guard<std::mutex> lock(matchMutex);
+    for (std::unique_ptr<Member>& member : members) {
+        if (member->conn->clientID != clientID) continue;
+
+        if (!member->hasState || memcmp(member->position, position, sizeof(member->position)) != 0) {
+            member->lastMovedTick = tickNumber;
+        }
+        memcpy(member->position, position, sizeof(member->position));
+        member->team = team;
+        member->hasState = true;
+        return;
+    }
+}
+
+// Replaces any snapshot from the same sender that has not been replicated yet
+void Match::stageSnapshot(uint8_t senderID, const SharedFrame& frame) {
+    SharedFrame replaced = frame;
+    std::lock_guard<std::mutex> lock(matchMutex);
+    latest[senderID].swap(replaced);
+    latestVersion[senderID]++;
+    latestChanged = true;
+}
+
+// Members' snapshots, and those restored from a checkpoint for players who
+// have not rejoined yet
+void Match::collectSnapshots(std::vector<SharedFrame>& out, uint8_t excludeID) const {
+    std::lock_guard<std::mutex> lock(matchMutex);
+    for (const std::unique_ptr<Member>& member : members) {
+        uint8_t senderID = member->conn->clientID;
+        if (senderID != excludeID && latest[senderID]) {
+            out.push_back(latest[senderID]);
+        }
+    }
+    for (const CheckpointMember& record : restored) {
+        if (record.clientID != excludeID && latest[record.clientID]) {
+            out.push_back(latest[record.clientID]);
+        }
+    }
+}
+
+// Before the match is first scheduled. The snapshot is the frame the player
+// last sent, shown to everyone joining until the player is back or
+// CHECKPOINT_SNAPSHOT_SECONDS have passed.
+void Match::restoreMember(const CheckpointMember& record, const uint8_t* snapshot) {
+    std::lock_guard<std::mutex> lock(matchMutex);
+    restored.push_back(record);
+    if (snapshot) {
+        latest[record.clientID] = std::make_shared<const std::vector<uint8_t>>(snapshot, snapshot + record.snapshotSize);
+        latestVersion[record.clientID]++;
+    }
+    restoredUntilTick = tickNumber + (uint64_t)CHECKPOINT_SNAPSHOT_SECONDS * tickRate;
+}
+
+// Members within hearing range of the speaker, or on its team
+void Match::collectListeners(uint8_t speakerID, std::vector<uint8_t>& out) const {
+    std::lock_guard<std::mutex> lock(matchMutex);
+    const Member* speaker = nullptr;
+    for (const std::unique_ptr<Member>& member : members) {
+        if (member->conn->clientID == speakerID) speaker = member.get();
+    }
+    if (!speaker) return;
+
+    for (const std::unique_ptr<Member>& member : members) {
+        const Member& listener = *member;
+        if (&listener == speaker) continue;
+        if (!listener.hasState || !speaker->hasState || (listener.team != 0 && listener.team == speaker->team) ||
+            distanceSquared(listener, *speaker) <= VOICE_HEARING_DISTANCE * VOICE_HEARING_DISTANCE) {
+            out.push_back(listener.conn->clientID);
+        }
+    }
+}
+
+float Match::distanceSquared(const Member& a, const Member& b) {
+    float sum = 0.0f;
+    for (int i = 0; i < 3; i++) {
+        float d = a.position[i] - b.position[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+// Whether the recipient should be told about the sender at all. Members that
+// never reported a position see and are seen by everyone.
+bool Match::isVisible(const Member& recipient, const Member& sender, float interestScale) const {
+    if (!recipient.hasState || !sender.hasState) return true;
+    if (recipient.team != 0 && recipient.team == sender.team) return true;
+
+    float visibleDistance = RELEVANCE_VISIBLE_DISTANCE * interestScale;
+    return distanceSquared(recipient, sender) <= visibleDistance * visibleDistance;
+}
+
+// Recomputes who the recipient can see and returns a record of the members
+// that entered and left view since the last tick, or null if none did. The
+// record goes out ahead of this tick's snapshots, so a client learns of a
+// member before its first snapshot and stops expecting them after it leaves.
+// Record payload: entered count, entered IDs, left count, left IDs.
+SharedFrame Match::updateVisibility(Member& recipient, float interestScale) {
+    uint8_t recipientID = recipient.conn->clientID;
+    ClientBitset visible{};
+    for (std::unique_ptr<Member>& sender : members) {
+        uint8_t senderID = sender->conn->clientID;
+        if (senderID != recipientID && isVisible(recipient, *sender, interestScale)) {
+            visible.set(senderID);
+        }
+    }
+
+    ClientBitset entered, left;
+    bool changed = diffVisibility(recipient.visible, visible, entered, left);
+    recipient.visible = visible;
+    if (!changed) return nullptr;
+
+    std::vector<uint8_t>& record = visibilityRecord;
+    record.assign(sizeof(uint32_t) + 2 + sizeof(uint32_t) + 1, 0);
+    size_t enteredCount = appendClientIDs(entered, record);
+    record[FRAME_HEADER_SIZE] = (uint8_t)enteredCount;
+    size_t leftCountAt = record.size();
+    record.push_back(0);
+    size_t leftCount = appendClientIDs(left, record);
+    record[leftCountAt] = (uint8_t)leftCount;
+
+    for (size_t i = FRAME_HEADER_SIZE + 1; i < leftCountAt; i++) {
+        // Due at once, so the member's snapshot follows its create record
+        recipient.lastSentTick[record[i]] = 0;
+    }
+    for (size_t i = leftCountAt + 1; i < record.size(); i++) {
+        // Whatever was sent before no longer counts once the member leaves view
+        recipient.sentVersion[record[i]] = latestVersion[record[i]] - 1;
+    }
+    membersEntered.fetch_add(enteredCount, std::memory_order_relaxed);
+    membersLeft.fetch_add(leftCount, std::memory_order_relaxed);
+
+    uint32_t msgSize = htonl((uint32_t)(record.size() - sizeof(uint32_t)));
+    uint32_t length = htonl((uint32_t)(record.size() - FRAME_HEADER_SIZE));
+    memcpy(record.data(), &msgSize, sizeof(msgSize));
+    record[4] = VISIBILITY_MESSAGE;
+    record[5] = 0;
+    memcpy(record.data() + 6, &length, sizeof(length));
+    return std::make_shared<const std::vector<uint8_t>>(record);
+}
+
+// Snapshots per second the recipient should get from the sender. Members
+// that never reported a position get the full rate, as before.
+unsigned Match::relevanceRate(const Member& recipient, const Member& sender, float interestScale) const {
+    if (!recipient.hasState || !sender.hasState) return SNAPSHOT_RATE_NEAR;
+    if (tickNumber - sender.lastMovedTick > (uint64_t)IDLE_AFTER_SECONDS * tickRate) return SNAPSHOT_RATE_FAR;
+    if (recipient.team != 0 && recipient.team == sender.team) return SNAPSHOT_RATE_NEAR;
+
+    float distance = distanceSquared(recipient, sender);
+    float nearDistance = RELEVANCE_NEAR_DISTANCE * interestScale;
+    float farDistance = RELEVANCE_FAR_DISTANCE * interestScale;
+    if (distance <= nearDistance * nearDistance) return SNAPSHOT_RATE_NEAR;
+    if (distance <= farDistance * farDistance) return SNAPSHOT_RATE_MID;
+    return SNAPSHOT_RATE_FAR;
+}
+
+// How much to divide the recipient's rates by. Over TCP, loss shows up as
+// output piling up, or frames dropped once the client is far behind.
+unsigned Match::linkDivisor(Member& recipient) {
+    Connection& conn = *recipient.conn;
+    unsigned divisor = 1;
+
+    uint32_t rtt = conn.rttMicros.load(std::memory_order_relaxed);
+    if (rtt > 2 * LINK_SLOW_RTT_MICROS) divisor = 4;
+    else if (rtt > LINK_SLOW_RTT_MICROS) divisor = 2;
+
+    uint32_t drops = conn.droppedFrames.load(std::memory_order_relaxed);
+    if (drops != recipient.seenDrops) {
+        recipient.seenDrops = drops;
+        recipient.congestedUntilTick = tickNumber + (uint64_t)LINK_CONGESTED_SECONDS * tickRate;
+    }
+    if (tickNumber < recipient.congestedUntilTick || conn.queuedBytes.load(std::memory_order_relaxed) > SEND_HIGH_WATER) {
+        divisor *= 4;
+    }
+    return divisor;
+}
+
+// Replicate phase: each member gets the newest snapshot of every other member
+// in view that changed since it was last sent, once that sender is due again
+// at the member's rate. Frames are handed to the reactors one run at a time.
+void Match::tick() {
+    uint64_t sent = 0;
+    uint64_t bytes = 0;
+    uint64_t deferred = 0;
+
+    int level = degradation.load(std::memory_order_relaxed);
+    unsigned overloadDivisor = level >= DEGRADE_SNAPSHOT_RATE ? 2 : 1;
+    float interestScale = level >= DEGRADE_INTEREST ? 0.5f : 1.0f;
+    bool record = false;
+    {
+        std::lock_guard<std::mutex> lock(matchMutex);
+        tickNumber++;
+
+        if (!restored.empty() && tickNumber >= restoredUntilTick) {
+            for (const CheckpointMember& record : restored) {
+                latest[record.clientID].reset();
+                latestVersion[record.clientID]++;
+            }
+            restored.clear();
+        }
+
+        if (recorder && latestChanged) {
+            for (std::unique_ptr<Member>& member : members) {
+                if (latest[member->conn->clientID]) {
+                    recorded.push_back(latest[member->conn->clientID]);
+                }
+            }
+            latestChanged = false;
+            record = true;
+        }
+
+        for (std::unique_ptr<Member>& recipient : members) {
+            unsigned divisor = linkDivisor(*recipient) * overloadDivisor;
+            SharedFrame record = updateVisibility(*recipient, interestScale);
+            if (record) {
+                outbound.push_back(Reactor::Outbound{ recipient->conn, std::move(record) });
+            }
+
+            for (std::unique_ptr<Member>& sender : members) {
+                uint8_t senderID = sender->conn->clientID;
+                if (!recipient->visible.test(senderID) || !latest[senderID] ||
+                    recipient->sentVersion[senderID] == latestVersion[senderID]) {
+                    continue;
+                }
+
+                unsigned rate = std::max(SNAPSHOT_RATE_MIN, std::min(tickRate, relevanceRate(*recipient, *sender, interestScale)) / divisor);
+                uint64_t ticksBetween = (tickRate + rate - 1) / rate;
+                if (tickNumber - recipient->lastSentTick[senderID] < ticksBetween) {
+                    deferred++;
+                    continue;
+                }
+
+                recipient->sentVersion[senderID] = latestVersion[senderID];
+                recipient->lastSentTick[senderID] = tickNumber;
+                outbound.push_back(Reactor::Outbound{ recipient->conn, latest[senderID] });
+                sent++;
+                bytes += latest[senderID]->size();
+            }
+        }
+    }
+    snapshotsSent.fetch_add(sent, std::memory_order_relaxed);
+    snapshotBytes.fetch_add(bytes, std::memory_order_relaxed);
+    snapshotsDeferred.fetch_add(deferred, std::memory_order_relaxed);
+
+    // Encoding and writing happen on the recorder's thread
+    if (record) {
+        recorder->submit(id, tickRate, tickNumber, recorded);
+    }
+
+    size_t runStart = 0;
+    for (size_t i = 1; i <= outbound.size(); i++) {
+        if (i == outbound.size() || outbound[i].conn->reactor != outbound[runStart].conn->reactor) {
+            outbound[runStart].conn->reactor->postFrames(&outbound[runStart], i - runStart);
+            runStart = i;
+        }
+    }
+    outbound.clear();
+}
+
+void Match::recordTick(std::chrono::nanoseconds duration) {
+    uint64_t nanos = (uint64_t)duration.count();
+    ticks.fetch_add(1, std::memory_order_relaxed);
+    busyNanos.fetch_add(nanos, std::memory_order_relaxed);
+    if (nanos > maxTickNanos.load(std::memory_order_relaxed)) {
+        maxTickNanos.store(nanos, std::memory_order_relaxed);
+    }
+    if (duration > tickBudget) {
+        budgetOverruns.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Members' records, then their snapshot frames in the same order
+void Match::writeCheckpoint(FileWriter& out) const {
+    CheckpointMatch header{};
+    header.id = id;
+    header.tickRate = tickRate;
+    header.tickNumber = tickNumber;
+    header.memberCount = (uint32_t)(members.size() + restored.size());
+    for (const std::unique_ptr<Member>& member : members) {
+        const SharedFrame& snapshot = latest[member->conn->clientID];
+        if (snapshot) header.snapshotBytes += (uint32_t)snapshot->size();
+    }
+    for (const CheckpointMember& record : restored) {
+        const SharedFrame& snapshot = latest[record.clientID];
+        if (snapshot) header.snapshotBytes += (uint32_t)snapshot->size();
+    }
+    header.snapshotBytes = (uint32_t)((header.snapshotBytes + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT);
+    out.put(&header, sizeof(header));
+
+    uint32_t offset = 0;
+    for (const std::unique_ptr<Member>& member : members) {
+        const SharedFrame& snapshot = latest[member->conn->clientID];
+        CheckpointMember record{};
+        record.clientID = member->conn->clientID;
+        record.team = member->team;
+        record.hasState = member->hasState ? 1 : 0;
+        memcpy(record.position, member->position, sizeof(record.position));
+        record.snapshotOffset = offset;
+        record.snapshotSize = snapshot ? (uint32_t)snapshot->size() : 0;
+        offset += record.snapshotSize;
+        out.put(&record, sizeof(record));
+    }
+    // Players still expected back from an earlier restart keep their place
+    for (const CheckpointMember& saved : restored) {
+        const SharedFrame& snapshot = latest[saved.clientID];
+        CheckpointMember record = saved;
+        record.snapshotOffset = offset;
+        record.snapshotSize = snapshot ? (uint32_t)snapshot->size() : 0;
+        offset += record.snapshotSize;
+        out.put(&record, sizeof(record));
+    }
+    for (const std::unique_ptr<Member>& member : members) {
+        const SharedFrame& snapshot = latest[member->conn->clientID];
+        if (snapshot) out.put(snapshot->data(), snapshot->size());
+    }
+    for (const CheckpointMember& record : restored) {
+        const SharedFrame& snapshot = latest[record.clientID];
+        if (snapshot) out.put(snapshot->data(), snapshot->size());
+    }
+    out.pad();
+}
+
+// Match Scheduler
+
+void MatchScheduler::start(unsigned workerCount) {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    isRunning = true;
+    for (unsigned i = 0; i < workerCount; i++) {
+        workers.emplace_back(&MatchScheduler::work, this);
+    }
+}
+
+void MatchScheduler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        isRunning = false;
+    }
+    scheduleChanged.notify_all();
+    for (std::thread& worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    workers.clear();
+}
+
+Match* MatchScheduler::join(const std::shared_ptr<Connection>& conn) {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    for (std::unique_ptr<Match>& match : matches) {
+        if (match->addMember(conn)) {
+            return match.get();
+        }
+    }
+
+    unsigned tickRate = tickRates[matches.size() % tickRates.size()];
+    matches.emplace_back(new Match((uint32_t)matches.size() + 1, tickRate, matchSize));
+    Match* match = matches.back().get();
+    match->degradation = degradation;
+    match->setRecorder(recorder);
+    match->addMember(conn);
+
+    match->release = std::chrono::steady_clock::now() + match->getTickInterval();
+    match->deadline = match->release + match->getTickInterval();
+    waiting.push(match);
+    scheduleChanged.notify_one();
+    return match;
+}
+
+Match* MatchScheduler::find(uint32_t matchID) {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    // IDs are handed out in order, starting at 1
+    if (matchID == 0 || matchID > matches.size()) return nullptr;
+    return matches[matchID - 1].get();
+}
+
+void MatchScheduler::setRecorder(DemoRecorder* demoRecorder) {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    recorder = demoRecorder;
+}
+
+void MatchScheduler::setDegradation(DegradationLevel level) {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    degradation = level;
+    for (std::unique_ptr<Match>& match : matches) {
+        match->degradation = level;
+    }
+}
+
+// Adds up tick counts across matches, for the governor to take deltas of
+void MatchScheduler::addTickLoad(uint64_t& ticks, uint64_t& late) {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    for (std::unique_ptr<Match>& match : matches) {
+        ticks += match->ticks.load(std::memory_order_relaxed);
+        late += match->deadlineMisses.load(std::memory_order_relaxed) + match->budgetOverruns.load(std::memory_order_relaxed);
+    }
+}
+
+void MatchScheduler::work() {
+    std::unique_lock<std::mutex> lock(schedulerMutex);
+    while (isRunning) {
+        auto now = std::chrono::steady_clock::now();
+        while (!waiting.empty() && waiting.top()->release <= now) {
+            ready.push(waiting.top());
+            waiting.pop();
+        }
+        if (ready.empty()) {
+            if (waiting.empty()) {
+                scheduleChanged.wait(lock);
+            }
+            else {
+                scheduleChanged.wait_until(lock, waiting.top()->release);
+            }
+            continue;
+        }
+
+        // The match is in neither queue while it ticks, so no other worker can pick it up
+        Match* match = ready.top();
+        ready.pop();
+        lock.unlock();
+
+        auto started = std::chrono::steady_clock::now();
+        match->tick();
+        auto finished = std::chrono::steady_clock::now();
+        match->recordTick(finished - started);
+
+        lock.lock();
+        if (finished > match->deadline) {
+            match->deadlineMisses.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Ticks that are already a whole interval overdue are skipped rather than run back to back
+        std::chrono::nanoseconds interval = match->getTickInterval();
+        match->release += interval;
+        if (finished >= match->release + interval) {
+            uint64_t skipped = (uint64_t)((finished - match->release) / interval);
+            match->release += interval * skipped;
+            match->deadlineMisses.fetch_add(skipped, std::memory_order_relaxed);
+        }
+        match->deadline = match->release + interval;
+        waiting.push(match);
+
+        // Other workers may be sleeping until a later release
+        scheduleChanged.notify_one();
+    }
+}
+
+void MatchScheduler::printStats(std::ostream& out) {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    out << "Matches: " << matches.size() << " on " << workers.size() << " workers\n";
+    for (std::unique_ptr<Match>& match : matches) {
+        uint64_t ticks = match->ticks.load(std::memory_order_relaxed);
+        uint64_t busy = match->busyNanos.load(std::memory_order_relaxed);
+        out << "  match " << match->getID() << ": " << match->getMemberCount() << " members, "
+            << match->getTickRate() << " Hz, " << ticks << " ticks, "
+            << match->deadlineMisses.load(std::memory_order_relaxed) << " deadline misses, "
+            << match->budgetOverruns.load(std::memory_order_relaxed) << " over budget, "
+            << (ticks ? busy / ticks / 1000 : 0) << " us avg, "
+            << match->maxTickNanos.load(std::memory_order_relaxed) / 1000 << " us max, "
+            << match->snapshotsSent.load(std::memory_order_relaxed) << " snapshots sent ("
+            << match->snapshotBytes.load(std::memory_order_relaxed) / 1024 << " KB), "
+            << match->snapshotsDeferred.load(std::memory_order_relaxed) << " deferred, "
+            << match->membersEntered.load(std::memory_order_relaxed) << " entered / "
+            << match->membersLeft.load(std::memory_order_relaxed) << " left view\n";
+    }
+}
+
+// The caller holds the scheduler lock and every match's state lock
+void MatchScheduler::writeCheckpoint(FileWriter& out) const {
+    CheckpointHeader header{};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.matchCount = (uint32_t)matches.size();
+    header.savedAt = (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    out.put(&header, sizeof(header));
+    for (const std::unique_ptr<Match>& match : matches) {
+        match->writeCheckpoint(out);
+    }
+}
+
+// Locks every match between ticks, so no tick is halfway through changing
+// one, and writes them all. On POSIX the process forks while everything is
+// locked and the child writes the file from its copy-on-write view of
+// memory, so matches are held up only for the fork; without fork() they
+// stay locked until the file is written.
+bool MatchScheduler::checkpoint(const std::string& path, std::chrono::nanoseconds& pause) {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    auto started = std::chrono::steady_clock::now();
+    for (std::unique_ptr<Match>& match : matches) {
+        match->lockState();
+    }
+
+#ifdef _WIN32
+    FileWriter out;
+    bool written = out.open(path);
+    if (written) {
+        writeCheckpoint(out);
+        written = out.close();
+    }
+    for (std::unique_ptr<Match>& match : matches) {
+        match->unlockState();
+    }
+    pause = std::chrono::steady_clock::now() - started;
+    return written;
+#else
+    pid_t child = fork();
+    if (child == 0) {
+        // Only this thread exists in the child, and every lock it needs is already held
+        FileWriter out;
+        bool written = out.open(path);
+        if (written) {
+            writeCheckpoint(out);
+            written = out.close();
+        }
+        _exit(written ? 0 : 1);
+    }
+    for (std::unique_ptr<Match>& match : matches) {
+        match->unlockState();
+    }
+    pause = std::chrono::steady_clock::now() - started;
+    if (child < 0) return false;
+
+    int status = 0;
+    while (waitpid(child, &status, 0) < 0) {
+        if (errno != EINTR) return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+
+// Matches come back with their IDs, tick rates and tick numbers, and fill
+// up again as clients join. Members are connections and do not survive a
+// restart, but their last snapshots do, so players rejoining see the world
+// as it was straight away.
+size_t MatchScheduler::restore(const CheckpointFile& checkpoint) {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    size_t offset = 0;
+    const CheckpointMatch* saved;
+    const CheckpointMember* members;
+    const uint8_t* snapshots;
+    size_t restored = 0;
+    while (checkpoint.nextMatch(offset, saved, members, snapshots)) {
+        // IDs double as indices, so they have to continue in order
+        if (saved->id != matches.size() + 1) break;
+
+        matches.emplace_back(new Match(saved->id, saved->tickRate, matchSize));
+        Match* match = matches.back().get();
+        match->degradation = degradation;
+        match->setRecorder(recorder);
+        match->restoreTick(saved->tickNumber);
+        for (uint32_t i = 0; i < saved->memberCount; i++) {
+            const CheckpointMember& record = members[i];
+            const uint8_t* snapshot = snapshots + record.snapshotOffset;
+            bool validSnapshot = record.snapshotSize >= FRAME_HEADER_SIZE &&
+                record.snapshotOffset <= saved->snapshotBytes && record.snapshotSize <= saved->snapshotBytes - record.snapshotOffset &&
+                snapshot[4] == SNAPSHOT_MESSAGE && snapshot[5] == record.clientID;
+            match->restoreMember(record, validSnapshot ? snapshot : nullptr);
+        }
+        match->release = std::chrono::steady_clock::now() + match->getTickInterval();
+        match->deadline = match->release + match->getTickInterval();
+        waiting.push(match);
+        restored++;
+    }
+    scheduleChanged.notify_all();
+    return restored;
+}
+
+// Pipeline
+
+Pipeline::Pipeline(const std::vector<Reactor*>& owners, OverloadGovernor& loadGovernor, WaitStrategy strategy)
+    : reactors(owners), governor(loadGovernor), waitStrategy(strategy), isRunning(false), stats{},
+    decoded(PIPELINE_QUEUE_SIZE), simulated(PIPELINE_QUEUE_SIZE) {
+    for (size_t i = 0; i < reactors.size(); i++) {
+        ingress.emplace_back(new SpscQueue<PipelineJob>(PIPELINE_QUEUE_SIZE));
+        egress.emplace_back(new SpscQueue<BroadcastRing::Entry>(PIPELINE_QUEUE_SIZE));
+    }
+}
+
+// Starts one thread per stage, pinned to the cores after the reactors' own
+void Pipeline::start() {
+    isRunning = true;
+    threads.emplace_back(&Pipeline::decodeStage, this);
+    threads.emplace_back(&Pipeline::simulateStage, this);
+    threads.emplace_back(&Pipeline::fanOutStage, this);
+
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threads.size(); i++) {
+        pinThreadToCore(threads[i], (unsigned)(reactors.size() + i) % cores);
+    }
+}
+
+void Pipeline::stop() {
+    isRunning = false;
+    for (std::thread& thread : threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    threads.clear();
+}
+
+// Messages that do not fit stay in jobs for the reactor to retry
+void Pipeline::submit(size_t reactorIndex, std::vector<PipelineJob>& jobs) {
+    size_t count = ingress[reactorIndex]->pushBatch(jobs);
+    if (count > 0) {
+        countBatch(STAGE_RECEIVE, count);
+    }
+    if (!jobs.empty()) {
+        stats[STAGE_RECEIVE].stalls.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Pipeline::collect(size_t reactorIndex, std::vector<BroadcastRing::Entry>& out) {
+    size_t count = 0;
+    while (size_t popped = egress[reactorIndex]->popBatch(out, PIPELINE_QUEUE_SIZE)) {
+        count += popped;
+    }
+    if (count > 0) {
+        countBatch(STAGE_SEND, count);
+    }
+}
+
+void Pipeline::countBatch(Stage stage, size_t items) {
+    stats[stage].items.fetch_add(items, std::memory_order_relaxed);
+    stats[stage].batches.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Backs off the longer a stage has been idle. The strategy only decides how
+// long a stage spins or yields first; every stage ends up sleeping, so an
+// idle pipeline does not show up as CPU load to the governor.
+void Pipeline::waitForWork(unsigned& idleRounds) {
+    if (idleRounds < PIPELINE_DEEP_SLEEP_ROUNDS) idleRounds++;
+    unsigned yieldRounds = waitStrategy == WAIT_BLOCK ? 128 : PIPELINE_SLEEP_ROUNDS;
+    if (idleRounds < 64 || (waitStrategy == WAIT_BUSY_SPIN && idleRounds < PIPELINE_SLEEP_ROUNDS)) {
+#ifdef SNAPSHOT_DELTA_SSE2
+        _mm_pause();
+#endif
+    }
+    else if (idleRounds < yieldRounds) {
+        std::this_thread::yield();
+    }
+    else if (idleRounds < PIPELINE_DEEP_SLEEP_ROUNDS) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// Pushes every item downstream, waiting while the next stage is full
+template <typename T>
+void Pipeline::forward(SpscQueue<T>& queue, std::vector<T>& items, Stage stage) {
+    unsigned idleRounds = 0;
+    while (!items.empty() && isRunning) {
+        queue.pushBatch(items);
+        if (!items.empty()) {
+            stats[stage].stalls.fetch_add(1, std::memory_order_relaxed);
+            waitForWork(idleRounds);
+        }
+    }
+}
+
+void Pipeline::decodeStage() {
+    std::vector<PipelineJob> batch;
+    std::vector<PipelineJob> done;
+    unsigned idleRounds = 0;
+
+    while (isRunning) {
+        for (std::unique_ptr<SpscQueue<PipelineJob>>& queue : ingress) {
+            queue->popBatch(batch, PIPELINE_BATCH_SIZE);
+        }
+        if (batch.empty()) {
+            waitForWork(idleRounds);
+            continue;
+        }
+        idleRounds = 0;
+
+        for (PipelineJob& job : batch) {
+            if (prepareRelayedFrame(job.bytes, job.senderID)) {
+                job.frame = std::make_shared<const std::vector<uint8_t>>(std::move(job.bytes));
+                done.push_back(std::move(job));
+            }
+        }
+        countBatch(STAGE_DECODE, batch.size());
+        batch.clear();
+        forward(decoded, done, STAGE_DECODE);
+    }
+}
+
+// Per-message game logic: cosmetic events are shed while the governor asks
+// for it, and snapshots go to their match, which replicates them on its next
+// tick. Only what is left is relayed as it came.
+void Pipeline::simulateStage() {
+    std::vector<PipelineJob> batch;
+    std::vector<PipelineJob> relayed;
+    unsigned idleRounds = 0;
+
+    while (isRunning) {
+        if (decoded.popBatch(batch, PIPELINE_BATCH_SIZE) == 0) {
+            waitForWork(idleRounds);
+            continue;
+        }
+        idleRounds = 0;
+
+        bool shedCosmetic = governor.getLevel() >= DEGRADE_COSMETIC;
+        for (PipelineJob& job : batch) {
+            uint8_t messageType = (*job.frame)[4];
+            if (messageType == COSMETIC_EVENT_MESSAGE && shedCosmetic) {
+                governor.cosmeticDropped.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            if (messageType == SNAPSHOT_MESSAGE) {
+                job.match->stageSnapshot(job.senderID, job.frame);
+                continue;
+            }
+            relayed.push_back(std::move(job));
+        }
+        countBatch(STAGE_SIMULATE, batch.size());
+        batch.clear();
+        forward(simulated, relayed, STAGE_SIMULATE);
+    }
+}
+
+// Hands every relayed frame to each reactor, which delivers it to the
+// sender's match
+void Pipeline::fanOutStage() {
+    std::vector<PipelineJob> batch;
+    std::vector<std::vector<BroadcastRing::Entry>> outputs(reactors.size());
+    unsigned idleRounds = 0;
+
+    while (isRunning) {
+        if (simulated.popBatch(batch, PIPELINE_BATCH_SIZE) == 0) {
+            waitForWork(idleRounds);
+            continue;
+        }
+        idleRounds = 0;
+
+        for (PipelineJob& job : batch) {
+            for (std::vector<BroadcastRing::Entry>& output : outputs) {
+                output.push_back(BroadcastRing::Entry{ job.frame, job.senderID, job.match });
+            }
+        }
+        countBatch(STAGE_FAN_OUT, batch.size());
+        batch.clear();
+
+        for (size_t i = 0; i < reactors.size(); i++) {
+            if (outputs[i].empty()) continue;
+            forward(*egress[i], outputs[i], STAGE_FAN_OUT);
+            reactors[i]->wake();
+        }
+    }
+}
+
+void Pipeline::printStats(std::ostream& out) const {
+    static const char* names[STAGE_COUNT] = { "receive", "decode", "simulate", "fan-out", "send" };
+
+    // Depth of the queue each stage reads from
+    size_t depths[STAGE_COUNT] = { 0, 0, decoded.size(), simulated.size(), 0 };
+    for (size_t i = 0; i < reactors.size(); i++) {
+        depths[STAGE_DECODE] += ingress[i]->size();
+        depths[STAGE_SEND] += egress[i]->size();
+    }
+
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        uint64_t items = stats[i].items.load(std::memory_order_relaxed);
+        uint64_t batches = stats[i].batches.load(std::memory_order_relaxed);
+        out << "  " << names[i] << ": " << items << " items, "
+            << (batches ? (double)items / batches : 0.0) << " per batch, "
+            << stats[i].stalls.load(std::memory_order_relaxed) << " stalls, queue depth " << depths[i] << "\n";
+    }
+}
+
+// Fullest queue between stages, as a share of its capacity
+double Pipeline::getQueueFill() const {
+    size_t deepest = std::max(decoded.size(), simulated.size());
+    for (size_t i = 0; i < reactors.size(); i++) {
+        deepest = std::max(deepest, std::max(ingress[i]->size(), egress[i]->size()));
+    }
+    return (double)deepest / PIPELINE_QUEUE_SIZE;
+}
+
+// Overload Governor
+
+// Returns true if the level changed
+bool OverloadGovernor::update(const LoadSample& sample) {
+    {
+        std::lock_guard<std::mutex> lock(sampleMutex);
+        lastSample = sample;
+    }
+
+    bool overloaded = sample.tickLate > OVERLOAD_TICK_LATE || sample.cpu > OVERLOAD_CPU ||
+        sample.backlogged > OVERLOAD_BACKLOGGED || sample.pipelineFill > OVERLOAD_PIPELINE_FILL;
+    bool calm = !overloaded && sample.tickLate < CALM_TICK_LATE && sample.cpu < CALM_CPU &&
+        sample.backlogged < CALM_BACKLOGGED && sample.pipelineFill < CALM_PIPELINE_FILL;
+    overloadedSamples = overloaded ? overloadedSamples + 1 : 0;
+    calmSamples = calm ? calmSamples + 1 : 0;
+
+    int current = level.load(std::memory_order_relaxed);
+    int next = current;
+    if (overloadedSamples >= GOVERNOR_RAISE_AFTER && current + 1 < DEGRADE_LEVEL_COUNT) {
+        next = current + 1;
+        overloadedSamples = 0;
+    }
+    else if (calmSamples >= GOVERNOR_LOWER_AFTER && current > DEGRADE_NONE) {
+        next = current - 1;
+        calmSamples = 0;
+    }
+    if (next == current) return false;
+
+    level.store(next, std::memory_order_relaxed);
+    levelChanges.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void OverloadGovernor::printStats(std::ostream& out) const {
+    static const char* names[DEGRADE_LEVEL_COUNT] = { "normal", "reduced snapshot rate", "reduced interest radius",
+        "dropping cosmetic events", "rejecting joins" };
+
+    LoadSample sample;
+    {
+        std::lock_guard<std::mutex> lock(sampleMutex);
+        sample = lastSample;
+    }
+    out << "Governor: level " << (int)getLevel() << " (" << names[getLevel()] << "), "
+        << levelChanges.load(std::memory_order_relaxed) << " level changes, "
+        << cosmeticDropped.load(std::memory_order_relaxed) << " cosmetic events dropped, "
+        << joinsRejected.load(std::memory_order_relaxed) << " joins rejected\n"
+        << "  last sample: " << sample.tickLate * 100 << "% ticks late, " << sample.cpu * 100 << "% CPU, "
+        << sample.backlogged * 100 << "% clients backlogged, " << sample.pipelineFill * 100 << "% pipeline fill\n";
+}
+
+// Voice Relay
+
+bool VoiceRelay::start() {
+    voiceSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (voiceSocket == INVALID_SOCKET) {
+        std::cerr << "Error creating voice socket.\n";
+        return false;
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(VOICE_PORT);
+    address.sin_addr.s_addr = INADDR_ANY;
+    if (bind(voiceSocket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+        std::cerr << "Error binding voice socket.\n";
+        closesocket(voiceSocket);
+        return false;
+    }
+    setNonBlocking(voiceSocket);
+
+    isRunning = true;
+    thread = std::thread(&VoiceRelay::run, this);
+    return true;
+}
+
+void VoiceRelay::stop() {
+    if (!isRunning.exchange(false)) return;
+    if (thread.joinable()) {
+        thread.join();
+    }
+    closesocket(voiceSocket);
+}
+
+uint32_t VoiceRelay::addClient(uint8_t clientID, Match* match) {
+    std::lock_guard<std::mutex> lock(relayMutex);
+    Listener& listener = listeners[clientID];
+    listener = Listener();
+    listener.active = true;
+    listener.match = match;
+    do {
+        listener.token = tokenGenerator();
+    } while (listener.token == 0);
+    return listener.token;
+}
+
+void VoiceRelay::removeClient(uint8_t clientID) {
+    std::lock_guard<std::mutex> lock(relayMutex);
+    listeners[clientID].active = false;
+}
+
+void VoiceRelay::run() {
+    uint8_t datagram[VOICE_MAX_DATAGRAM + 1];
+    WSAPOLLFD entry{};
+    entry.fd = voiceSocket;
+    entry.events = POLLIN;
+
+    while (isRunning) {
+        // The timeout only bounds how long stop() waits
+        if (WSAPoll(&entry, 1, 100) <= 0) continue;
+
+        for (;;) {
+            sockaddr_in from{};
+            socklen_t fromSize = sizeof(from);
+            int received = recvfrom(voiceSocket, (char*)datagram, sizeof(datagram), 0, (sockaddr*)&from, &fromSize);
+            if (received < 0) break;
+            datagramsIn.fetch_add(1, std::memory_order_relaxed);
+            relay(datagram, (size_t)received, from);
+        }
+    }
+}
+
+// Forwards a speaker's datagram to every listener in range that has a free
+// speaker slot for it. A datagram without a codec frame only registers the
+// sender's address.
+void VoiceRelay::relay(uint8_t* datagram, size_t size, const sockaddr_in& from) {
+    if (size < VOICE_HEADER_SIZE || size > VOICE_MAX_DATAGRAM || datagram[0] != VOICE_MESSAGE) {
+        datagramsRejected.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    uint8_t speakerID = datagram[1];
+    uint32_t token;
+    memcpy(&token, datagram + 2, sizeof(token));
+    token = ntohl(token);
+    uint8_t level = datagram[8];
+
+    std::lock_guard<std::mutex> lock(relayMutex);
+    Listener& speaker = listeners[speakerID];
+    if (!speaker.active || speaker.token != token) {
+        datagramsRejected.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    speaker.address = from;
+    speaker.hasAddress = true;
+    if (size == VOICE_HEADER_SIZE) return;
+
+    // Listeners must not learn each other's tokens
+    memset(datagram + 2, 0, sizeof(token));
+
+    hearing.clear();
+    speaker.match->collectListeners(speakerID, hearing);
+    auto now = std::chrono::steady_clock::now();
+    uint64_t relayed = 0;
+    uint64_t capped = 0;
+    for (uint8_t listenerID : hearing) {
+        Listener& listener = listeners[listenerID];
+        if (!listener.active || !listener.hasAddress) continue;
+        if (!admitSpeaker(listener, speakerID, level, now)) {
+            capped++;
+            continue;
+        }
+        sendto(voiceSocket, (const char*)datagram, (int)size, 0, (const sockaddr*)&listener.address, sizeof(listener.address));
+        relayed++;
+    }
+    datagramsRelayed.fetch_add(relayed, std::memory_order_relaxed);
+    datagramsCapped.fetch_add(capped, std::memory_order_relaxed);
+}
+
+// A listener hears at most VOICE_MAX_SPEAKERS at once. A new speaker takes a
+// free or timed out slot, or else the slot of the quietest speaker if it is
+// louder than that one was last.
+bool VoiceRelay::admitSpeaker(Listener& listener, uint8_t speakerID, uint8_t level, std::chrono::steady_clock::time_point now) {
+    size_t quietest = 0;
+    for (size_t i = 0; i < listener.speakerCount; i++) {
+        Speaker& slot = listener.speakers[i];
+        if (slot.clientID == speakerID) {
+            slot.level = level;
+            slot.lastHeard = now;
+            return true;
+        }
+        if (slot.level < listener.speakers[quietest].level) quietest = i;
+    }
+
+    Speaker* taken = nullptr;
+    for (size_t i = 0; i < listener.speakerCount && !taken; i++) {
+        if (now - listener.speakers[i].lastHeard > VOICE_SPEAKER_TIMEOUT) taken = &listener.speakers[i];
+    }
+    if (!taken && listener.speakerCount < VOICE_MAX_SPEAKERS) taken = &listener.speakers[listener.speakerCount++];
+    if (!taken && level > listener.speakers[quietest].level) taken = &listener.speakers[quietest];
+    if (!taken) return false;
+
+    taken->clientID = speakerID;
+    taken->level = level;
+    taken->lastHeard = now;
+    return true;
+}
+
+void VoiceRelay::printStats(std::ostream& out) const {
+    out << "Voice: " << datagramsIn.load(std::memory_order_relaxed) << " datagrams in, "
+        << datagramsRelayed.load(std::memory_order_relaxed) << " relayed, "
+        << datagramsCapped.load(std::memory_order_relaxed) << " capped, "
+        << datagramsRejected.load(std::memory_order_relaxed) << " rejected\n";
+}
+
+// Spectator Feed
+
+void SpectatorFeed::setUpstream(const std::string& host, uint16_t hostPort, uint32_t matchID) {
+    upstreamHost = host;
+    upstreamPort = hostPort;
+    upstreamMatch = matchID;
+}
+
+bool SpectatorFeed::start() {
+    listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket == INVALID_SOCKET) {
+        std::cerr << "Error creating spectator socket.\n";
+        return false;
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = INADDR_ANY;
+    if (bind(listenSocket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+        std::cerr << "Error binding spectator socket.\n";
+        closesocket(listenSocket);
+        return false;
+    }
+    listen(listenSocket, SOMAXCONN);
+    setNonBlocking(listenSocket);
+
+    if (!upstreamHost.empty()) {
+        // A relay always carries its one stream, even before anyone watches
+        streams[upstreamMatch].subscriberCount = 0;
+    }
+    isRunning = true;
+    thread = std::thread(&SpectatorFeed::run, this);
+    return true;
+}
+
+void SpectatorFeed::stop() {
+    if (!isRunning.exchange(false)) return;
+    if (thread.joinable()) {
+        thread.join();
+    }
+    for (std::unique_ptr<Subscriber>& subscriber : subscribers) {
+        closeSubscriber(*subscriber);
+    }
+    subscribers.clear();
+    if (upstream != INVALID_SOCKET) {
+        closesocket(upstream);
+    }
+    closesocket(listenSocket);
+}
+
+void SpectatorFeed::run() {
+    auto nextEncode = std::chrono::steady_clock::now() + SPECTATOR_INTERVAL;
+    while (isRunning) {
+        pollSet.clear();
+        WSAPOLLFD entry{};
+        entry.fd = listenSocket;
+        entry.events = POLLIN;
+        pollSet.push_back(entry);
+        bool upstreamPolled = upstream != INVALID_SOCKET;
+        if (upstreamPolled) {
+            entry.fd = upstream;
+            entry.events = upstreamConnecting ? POLLOUT : POLLIN;
+            pollSet.push_back(entry);
+        }
+        size_t firstSubscriber = pollSet.size();
+        for (std::unique_ptr<Subscriber>& subscriber : subscribers) {
+            entry.fd = subscriber->socket;
+            entry.events = POLLIN;
+            if (!subscriber->output.empty()) entry.events |= POLLOUT;
+            pollSet.push_back(entry);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        int timeout = (int)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(nextEncode - now).count());
+        if (WSAPoll(pollSet.data(), (unsigned long)pollSet.size(), timeout) > 0) {
+            if (pollSet[0].revents & POLLIN) acceptSubscribers();
+            if (upstreamPolled && pollSet[1].revents) {
+                if (upstreamConnecting) finishUpstreamConnect();
+                else readUpstream();
+            }
+
+            // Subscribers accepted above have no poll entry yet
+            for (size_t i = firstSubscriber; i < pollSet.size(); i++) {
+                Subscriber& subscriber = *subscribers[i - firstSubscriber];
+                if (pollSet[i].revents & (POLLIN | POLLERR | POLLHUP)) readSubscriber(subscriber);
+                if (subscriber.socket != INVALID_SOCKET && (pollSet[i].revents & POLLOUT)) flushSubscriber(subscriber);
+            }
+        }
+
+        now = std::chrono::steady_clock::now();
+        if (now >= nextEncode) {
+            nextEncode += SPECTATOR_INTERVAL;
+            if (nextEncode < now) nextEncode = now + SPECTATOR_INTERVAL;
+            if (matches) {
+                for (auto& [matchID, stream] : streams) {
+                    encodeStream(matchID, stream, now);
+                }
+            }
+            else if (upstream == INVALID_SOCKET && now >= nextUpstreamAttempt) {
+                bool started = connectUpstream();
+                nextUpstreamAttempt = now + (started && upstreamConnecting ? SPECTATOR_CONNECT_TIMEOUT : std::chrono::seconds(1));
+            }
+            else if (upstreamConnecting && now >= nextUpstreamAttempt) {
+                closesocket(upstream);
+                upstream = INVALID_SOCKET;
+                upstreamConnecting = false;
+                nextUpstreamAttempt = now + std::chrono::seconds(1);
+            }
+        }
+
+        // Drop closed subscribers, and streams nobody watches any more
+        for (std::unique_ptr<Subscriber>& subscriber : subscribers) {
+            if (subscriber->socket == INVALID_SOCKET && subscriber->matchID != 0) {
+                auto stream = streams.find(subscriber->matchID);
+                if (stream != streams.end() && --stream->second.subscriberCount == 0 && matches) {
+                    streams.erase(stream);
+                }
+            }
+        }
+        subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+            [](const std::unique_ptr<Subscriber>& s) { return s->socket == INVALID_SOCKET; }), subscribers.end());
+        spectatorCount.store(subscribers.size(), std::memory_order_relaxed);
+    }
+}
+
+void SpectatorFeed::acceptSubscribers() {
+    for (;;) {
+        SOCKET socket = accept(listenSocket, nullptr, nullptr);
+        if (socket == INVALID_SOCKET) return;
+        if (subscribers.size() >= SPECTATOR_MAX_DIRECT) {
+            closesocket(socket);
+            spectatorsRefused.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        setNonBlocking(socket);
+        std::unique_ptr<Subscriber> subscriber(new Subscriber());
+        subscriber->socket = socket;
+        subscribers.push_back(std::move(subscriber));
+    }
+}
+
+// The only message a spectator sends is which match to watch. Anything
+// after it is read and thrown away, so inBuffer never holds more than that.
+void SpectatorFeed::readSubscriber(Subscriber& subscriber) {
+    const size_t spectateSize = FRAME_HEADER_SIZE + sizeof(uint32_t);
+    uint8_t chunk[256];
+    for (;;) {
+        int received = recv(subscriber.socket, (char*)chunk, sizeof(chunk), 0);
+        if (received <= 0) {
+            if (received < 0 && lastErrorWouldBlock()) return;
+            closeSubscriber(subscriber);
+            return;
+        }
+        if (subscriber.matchID != 0) continue;
+
+        size_t needed = std::min<size_t>(received, spectateSize - subscriber.inBuffer.size());
+        subscriber.inBuffer.insert(subscriber.inBuffer.end(), chunk, chunk + needed);
+        if (subscriber.inBuffer.size() < spectateSize) continue;
+
+        uint32_t matchID;
+        memcpy(&matchID, subscriber.inBuffer.data() + FRAME_HEADER_SIZE, sizeof(matchID));
+        matchID = ntohl(matchID);
+        if (subscriber.inBuffer[4] != SPECTATE_MESSAGE || matchID == 0) {
+            closeSubscriber(subscriber);
+            return;
+        }
+        subscriber.inBuffer.clear();
+        subscriber.inBuffer.shrink_to_fit();
+        subscribe(subscriber, matchID);
+        if (subscriber.socket == INVALID_SOCKET) return;
+    }
+}
+
+void SpectatorFeed::subscribe(Subscriber& subscriber, uint32_t matchID) {
+    bool known = matches ? matches->find(matchID) != nullptr : matchID == upstreamMatch;
+    if (!known) {
+        closeSubscriber(subscriber);
+        return;
+    }
+
+    subscriber.matchID = matchID;
+    Stream& stream = streams[matchID];
+    stream.subscriberCount++;
+    for (const SharedFrame& frame : stream.backlog) {
+        enqueue(subscriber, frame);
+    }
+    flushSubscriber(subscriber);
+}
+
+void SpectatorFeed::enqueue(Subscriber& subscriber, const SharedFrame& frame) {
+    if (subscriber.socket == INVALID_SOCKET) return;
+    if (subscriber.queuedBytes + frame->size() > SPECTATOR_MAX_QUEUED_BYTES) {
+        spectatorsDropped.fetch_add(1, std::memory_order_relaxed);
+        closeSubscriber(subscriber);
+        return;
+    }
+    subscriber.output.push_back(frame);
+    subscriber.queuedBytes += frame->size();
+}
+
+void SpectatorFeed::flushSubscriber(Subscriber& subscriber) {
+    while (subscriber.socket != INVALID_SOCKET && !subscriber.output.empty()) {
+        const SharedFrame& frame = subscriber.output.front();
+        int bytesSent = ::send(subscriber.socket, (const char*)frame->data() + subscriber.outputOffset,
+            (int)(frame->size() - subscriber.outputOffset), 0);
+        if (bytesSent <= 0) {
+            if (bytesSent < 0 && lastErrorWouldBlock()) return;
+            closeSubscriber(subscriber);
+            return;
+        }
+        subscriber.outputOffset += bytesSent;
+        subscriber.queuedBytes -= bytesSent;
+        if (subscriber.outputOffset == frame->size()) {
+            subscriber.output.pop_front();
+            subscriber.outputOffset = 0;
+        }
+    }
+}
+
+void SpectatorFeed::closeSubscriber(Subscriber& subscriber) {
+    if (subscriber.socket == INVALID_SOCKET) return;
+    closesocket(subscriber.socket);
+    subscriber.socket = INVALID_SOCKET;
+    subscriber.output.clear();
+    subscriber.queuedBytes = 0;
+}
+
+// Bundles the newest snapshot of every member and queues it, as a delta on
+// the previous bundle where that pays off, to be published once it is old
+// enough.
+void SpectatorFeed::encodeStream(uint32_t matchID, Stream& stream, std::chrono::steady_clock::time_point now) {
+    Match* match = matches->find(matchID);
+    snapshots.clear();
+    match->collectSnapshots(snapshots, 0);
+    bundle.clear();
+    for (const SharedFrame& snapshot : snapshots) {
+        bundle.insert(bundle.end(), snapshot->begin(), snapshot->end());
+    }
+
+    std::shared_ptr<std::vector<uint8_t>> frame = std::make_shared<std::vector<uint8_t>>();
+    bool keyframe = stream.previous.empty() || stream.sinceKeyframe >= SPECTATOR_KEYFRAME_INTERVAL;
+    if (!keyframe) {
+        frame->resize(FRAME_HEADER_SIZE + DELTA_HEADER_SIZE);
+        keyframe = !encodeSnapshotDelta(stream.previous.data(), stream.previous.size(), bundle.data(), bundle.size(),
+            xorScratch, *frame);
+    }
+    if (keyframe) {
+        frame->resize(FRAME_HEADER_SIZE);
+        frame->insert(frame->end(), bundle.begin(), bundle.end());
+        stream.sequence = 1;
+        stream.sinceKeyframe = 0;
+    }
+    else {
+        uint16_t sequence = htons(stream.sequence++);
+        uint32_t rawSize = htonl((uint32_t)bundle.size());
+        memcpy(frame->data() + FRAME_HEADER_SIZE, &sequence, sizeof(sequence));
+        memcpy(frame->data() + FRAME_HEADER_SIZE + 3, &rawSize, sizeof(rawSize));
+        stream.sinceKeyframe++;
+    }
+
+    uint32_t msgSize = htonl((uint32_t)(frame->size() - sizeof(uint32_t)));
+    uint32_t length = htonl((uint32_t)(frame->size() - FRAME_HEADER_SIZE));
+    memcpy(frame->data(), &msgSize, sizeof(msgSize));
+    (*frame)[4] = keyframe ? SPECTATOR_KEYFRAME_MESSAGE : SPECTATOR_DELTA_MESSAGE;
+    (*frame)[5] = 0;
+    memcpy(frame->data() + 6, &length, sizeof(length));
+    stream.previous.swap(bundle);
+    stream.delayed.emplace_back(now, std::move(frame));
+
+    while (!stream.delayed.empty() && now - stream.delayed.front().first >= SPECTATOR_DELAY) {
+        SharedFrame due = std::move(stream.delayed.front().second);
+        stream.delayed.pop_front();
+        publish(matchID, stream, due, due->data()[4] == SPECTATOR_KEYFRAME_MESSAGE);
+    }
+}
+
+void SpectatorFeed::publish(uint32_t matchID, Stream& stream, const SharedFrame& frame, bool keyframe) {
+    if (keyframe) {
+        stream.backlog.clear();
+        keyframesPublished.fetch_add(1, std::memory_order_relaxed);
+    }
+    stream.backlog.push_back(frame);
+    framesPublished.fetch_add(1, std::memory_order_relaxed);
+    bytesPublished.fetch_add(frame->size(), std::memory_order_relaxed);
+
+    for (std::unique_ptr<Subscriber>& subscriber : subscribers) {
+        if (subscriber->matchID == matchID && subscriber->socket != INVALID_SOCKET) {
+            enqueue(*subscriber, frame);
+            flushSubscriber(*subscriber);
+        }
+    }
+}
+
+// Starts a non-blocking connect; the feed thread finishes it from its poll
+// loop, so a slow or dead upstream never stalls the relay's spectators
+bool SpectatorFeed::connectUpstream() {
+    SOCKET socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (socket == INVALID_SOCKET) return false;
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(upstreamPort);
+    inet_pton(AF_INET, upstreamHost.c_str(), &address.sin_addr);
+    setNonBlocking(socket);
+    upstream = socket;
+    upstreamConnecting = true;
+    if (connect(socket, (sockaddr*)&address, sizeof(address)) == 0) {
+        finishUpstreamConnect();
+    }
+    else if (!lastErrorInProgress()) {
+        closesocket(socket);
+        upstream = INVALID_SOCKET;
+        upstreamConnecting = false;
+    }
+    return upstream != INVALID_SOCKET;
+}
+
+void SpectatorFeed::finishUpstreamConnect() {
+    int error = 0;
+    socklen_t errorSize = sizeof(error);
+    upstreamConnecting = false;
+    if (getsockopt(upstream, SOL_SOCKET, SO_ERROR, (char*)&error, &errorSize) == SOCKET_ERROR || error != 0) {
+        closesocket(upstream);
+        upstream = INVALID_SOCKET;
+        nextUpstreamAttempt = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        return;
+    }
+
+    // Fits in any fresh socket's send buffer
+    uint8_t frame[FRAME_HEADER_SIZE + sizeof(uint32_t)];
+    uint32_t msgSize = htonl(2 + sizeof(uint32_t) + sizeof(uint32_t));
+    uint32_t length = htonl(sizeof(uint32_t));
+    uint32_t matchID = htonl(upstreamMatch);
+    memcpy(frame, &msgSize, sizeof(msgSize));
+    frame[4] = SPECTATE_MESSAGE;
+    frame[5] = 0;
+    memcpy(frame + 6, &length, sizeof(length));
+    memcpy(frame + FRAME_HEADER_SIZE, &matchID, sizeof(matchID));
+    if (::send(upstream, (const char*)frame, sizeof(frame), 0) != (int)sizeof(frame)) {
+        closesocket(upstream);
+        upstream = INVALID_SOCKET;
+        return;
+    }
+    upstreamBuffer.clear();
+    std::cout << "Relaying match " << upstreamMatch << " from " << upstreamHost << ":" << upstreamPort << ".\n";
+}
+
+// Passes stream frames from upstream on unchanged. The upstream feed starts
+// every subscriber on a keyframe, so reconnecting needs no special handling.
+void SpectatorFeed::readUpstream() {
+    size_t used = upstreamBuffer.size();
+    for (;;) {
+        upstreamBuffer.resize(used + RECV_CHUNK_SIZE);
+        int received = recv(upstream, (char*)upstreamBuffer.data() + used, (int)RECV_CHUNK_SIZE, 0);
+        if (received > 0) {
+            used += received;
+            continue;
+        }
+        upstreamBuffer.resize(used);
+        if (received < 0 && lastErrorWouldBlock()) break;
+        closesocket(upstream);
+        upstream = INVALID_SOCKET;
+        std::cout << "Lost upstream spectator feed.\n";
+        break;
+    }
+
+    Stream& stream = streams[upstreamMatch];
+    size_t offset = 0;
+    while (upstreamBuffer.size() - offset >= sizeof(uint32_t)) {
+        uint32_t msgSize;
+        memcpy(&msgSize, upstreamBuffer.data() + offset, sizeof(msgSize));
+        size_t frameSize = sizeof(uint32_t) + ntohl(msgSize);
+        if (upstreamBuffer.size() - offset < frameSize) break;
+
+        SharedFrame frame = std::make_shared<const std::vector<uint8_t>>(
+            upstreamBuffer.begin() + offset, upstreamBuffer.begin() + offset + frameSize);
+        offset += frameSize;
+        if (frameSize > FRAME_HEADER_SIZE && (frame->data()[4] == SPECTATOR_KEYFRAME_MESSAGE || frame->data()[4] == SPECTATOR_DELTA_MESSAGE)) {
+            publish(upstreamMatch, stream, frame, frame->data()[4] == SPECTATOR_KEYFRAME_MESSAGE);
+        }
+    }
+    upstreamBuffer.erase(upstreamBuffer.begin(), upstreamBuffer.begin() + offset);
+}
+
+void SpectatorFeed::printStats(std::ostream& out) const {
+    out << "Spectators: " << spectatorCount.load(std::memory_order_relaxed) << " connected, "
+        << framesPublished.load(std::memory_order_relaxed) << " frames ("
+        << keyframesPublished.load(std::memory_order_relaxed) << " keyframes, "
+        << bytesPublished.load(std::memory_order_relaxed) / 1024 << " KB) published, "
+        << spectatorsRefused.load(std::memory_order_relaxed) << " refused, "
+        << spectatorsDropped.load(std::memory_order_relaxed) << " dropped\n";
+}
+
+// Demo Recorder
+
+// Demo files store integers big-endian, like the wire
+void storeBigEndian(uint8_t* out, uint64_t value, size_t bytes) {
+    for (size_t i = bytes; i-- > 0; ) {
+        out[i] = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+uint64_t loadBigEndian(const uint8_t* in, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+void DemoRecorder::start() {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    isRunning = true;
+    thread = std::thread(&DemoRecorder::run, this);
+}
+
+void DemoRecorder::stop() {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (!isRunning) return;
+        isRunning = false;
+    }
+    queueChanged.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void DemoRecorder::submit(uint32_t matchID, unsigned tickRate, uint64_t tick, std::vector<SharedFrame>& snapshots) {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (queue.size() >= DEMO_MAX_QUEUED_TICKS) {
+            ticksDropped.fetch_add(1, std::memory_order_relaxed);
+            snapshots.clear();
+            return;
+        }
+        queue.push_back(Job{ matchID, tickRate, tick, std::vector<SharedFrame>() });
+        queue.back().snapshots.swap(snapshots);
+        if (!spare.empty()) {
+            snapshots.swap(spare.back());
+            spare.pop_back();
+        }
+    }
+    queueChanged.notify_one();
+}
+
+void DemoRecorder::run() {
+    std::vector<Job> batch;
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while (true) {
+        queueChanged.wait(lock, [this] { return !queue.empty() || !isRunning; });
+        if (queue.empty()) break;
+
+        batch.swap(queue);
+        lock.unlock();
+        for (Job& job : batch) {
+            write(job);
+        }
+        lock.lock();
+        for (Job& job : batch) {
+            job.snapshots.clear();
+            spare.push_back(std::move(job.snapshots));
+        }
+        batch.clear();
+    }
+    lock.unlock();
+
+    for (auto& entry : recordings) {
+        finish(entry.second);
+    }
+    recordings.clear();
+}
+
+// Appends one tick to the match's demo, opening the file on its first tick
+void DemoRecorder::write(Job& job) {
+    bool known = recordings.count(job.matchID) != 0;
+    Recording& recording = recordings[job.matchID];
+    if (!known) {
+        std::string path = directory + "/match-" + std::to_string(job.matchID) + ".demo";
+        recording.tickRate = job.tickRate;
+        recording.offset = DEMO_FILE_HEADER_SIZE;
+        recording.lastKeyframeTick = 0;
+        recording.lastTick = 0;
+        recording.file.open(path, std::ios::binary | std::ios::trunc);
+        recording.failed = !recording.file;
+        if (recording.failed) {
+            std::cerr << "Error creating demo file " << path << ".\n";
+            return;
+        }
+
+        uint8_t header[DEMO_FILE_HEADER_SIZE];
+        memcpy(header, DEMO_MAGIC, 8);
+        storeBigEndian(header + 8, job.matchID, 4);
+        storeBigEndian(header + 12, job.tickRate, 4);
+        recording.file.write((const char*)header, sizeof(header));
+        bytesWritten.fetch_add(sizeof(header), std::memory_order_relaxed);
+    }
+    if (recording.failed) return;
+
+    bundle.clear();
+    for (const SharedFrame& snapshot : job.snapshots) {
+        bundle.insert(bundle.end(), snapshot->begin(), snapshot->end());
+    }
+
+    record.resize(DEMO_RECORD_HEADER_SIZE);
+    bool keyframe = recording.index.empty() ||
+        job.tick - recording.lastKeyframeTick >= (uint64_t)recording.tickRate * DEMO_KEYFRAME_SECONDS;
+    if (!keyframe) {
+        keyframe = !encodeSnapshotDelta(recording.previous.data(), recording.previous.size(), bundle.data(), bundle.size(),
+            xorScratch, record);
+    }
+    if (keyframe) {
+        // Against nothing, the run encoding only squeezes out zero runs; bundles it cannot shrink are stored
+        record.resize(DEMO_RECORD_HEADER_SIZE);
+        if (!encodeSnapshotDelta(nullptr, 0, bundle.data(), bundle.size(), xorScratch, record)) {
+            record.resize(DEMO_RECORD_HEADER_SIZE);
+            record.insert(record.end(), bundle.begin(), bundle.end());
+            record[9] = DEMO_FLAG_STORED;
+        }
+        recording.index.push_back(DemoIndexEntry{ (uint32_t)job.tick, recording.offset });
+        recording.lastKeyframeTick = job.tick;
+        keyframesWritten.fetch_add(1, std::memory_order_relaxed);
+    }
+    storeBigEndian(record.data(), record.size() - DEMO_RECORD_HEADER_SIZE, 4);
+    storeBigEndian(record.data() + 4, (uint32_t)job.tick, 4);
+    record[8] = keyframe ? DEMO_KEYFRAME : DEMO_DELTA;
+    storeBigEndian(record.data() + 10, bundle.size(), 4);
+
+    recording.file.write((const char*)record.data(), (std::streamsize)record.size());
+    recording.offset += record.size();
+    recording.lastTick = (uint32_t)job.tick;
+    recording.previous.swap(bundle);
+    recordsWritten.fetch_add(1, std::memory_order_relaxed);
+    bytesWritten.fetch_add(record.size(), std::memory_order_relaxed);
+}
+
+// Index: tick and offset of every keyframe. Trailer: index offset, entry
+// count, last recorded tick, magic.
+void DemoRecorder::finish(Recording& recording) {
+    if (recording.failed || !recording.file.is_open()) return;
+
+    std::vector<uint8_t> footer(recording.index.size() * DEMO_INDEX_ENTRY_SIZE + DEMO_TRAILER_SIZE);
+    uint8_t* out = footer.data();
+    for (const DemoIndexEntry& entry : recording.index) {
+        storeBigEndian(out, entry.tick, 4);
+        storeBigEndian(out + 4, entry.offset, 8);
+        out += DEMO_INDEX_ENTRY_SIZE;
+    }
+    storeBigEndian(out, recording.offset, 8);
+    storeBigEndian(out + 8, recording.index.size(), 4);
+    storeBigEndian(out + 12, recording.lastTick, 4);
+    memcpy(out + 16, DEMO_INDEX_MAGIC, 8);
+
+    recording.file.write((const char*)footer.data(), (std::streamsize)footer.size());
+    recording.file.close();
+    bytesWritten.fetch_add(footer.size(), std::memory_order_relaxed);
+}
+
+void DemoRecorder::printStats(std::ostream& out) const {
+    out << "Demos: " << recordsWritten.load(std::memory_order_relaxed) << " records ("
+        << keyframesWritten.load(std::memory_order_relaxed) << " keyframes), "
+        << bytesWritten.load(std::memory_order_relaxed) / 1024 << " KB written, "
+        << ticksDropped.load(std::memory_order_relaxed) << " ticks dropped\n";
+}
+
+// Demo Player
+
+bool DemoPlayer::open(const std::string& path) {
+    file.open(path, std::ios::binary);
+    uint8_t header[DEMO_FILE_HEADER_SIZE];
+    if (!file || !file.read((char*)header, sizeof(header)) || memcmp(header, DEMO_MAGIC, 8) != 0) {
+        return false;
+    }
+    matchID = (uint32_t)loadBigEndian(header + 8, 4);
+    tickRate = (unsigned)loadBigEndian(header + 12, 4);
+
+    file.seekg(0, std::ios::end);
+    uint64_t fileSize = (uint64_t)file.tellg();
+    if (!readIndex(fileSize)) {
+        file.clear();
+        recordsEnd = fileSize;
+        if (!scanRecords()) return false;
+    }
+    return !index.empty();
+}
+
+bool DemoPlayer::readIndex(uint64_t fileSize) {
+    if (fileSize < DEMO_FILE_HEADER_SIZE + DEMO_TRAILER_SIZE) return false;
+
+    uint8_t trailer[DEMO_TRAILER_SIZE];
+    file.seekg((std::streamoff)(fileSize - DEMO_TRAILER_SIZE));
+    if (!file.read((char*)trailer, sizeof(trailer)) || memcmp(trailer + 16, DEMO_INDEX_MAGIC, 8) != 0) {
+        return false;
+    }
+    uint64_t indexOffset = loadBigEndian(trailer, 8);
+    uint64_t count = loadBigEndian(trailer + 8, 4);
+    if (indexOffset < DEMO_FILE_HEADER_SIZE || indexOffset + count * DEMO_INDEX_ENTRY_SIZE + DEMO_TRAILER_SIZE != fileSize) {
+        return false;
+    }
+
+    std::vector<uint8_t> entries(count * DEMO_INDEX_ENTRY_SIZE);
+    file.seekg((std::streamoff)indexOffset);
+    if (count > 0 && !file.read((char*)entries.data(), (std::streamsize)entries.size())) return false;
+
+    index.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        index[i].tick = (uint32_t)loadBigEndian(&entries[i * DEMO_INDEX_ENTRY_SIZE], 4);
+        index[i].offset = loadBigEndian(&entries[i * DEMO_INDEX_ENTRY_SIZE + 4], 8);
+    }
+    recordsEnd = indexOffset;
+    lastTick = (uint32_t)loadBigEndian(trailer + 12, 4);
+    return true;
+}
+
+// Rebuilds the index of a file whose recording never finished; a record cut
+// off at the end is left out
+bool DemoPlayer::scanRecords() {
+    index.clear();
+    uint64_t offset = DEMO_FILE_HEADER_SIZE;
+    uint8_t header[DEMO_RECORD_HEADER_SIZE];
+    while (offset + DEMO_RECORD_HEADER_SIZE <= recordsEnd) {
+        file.seekg((std::streamoff)offset);
+        if (!file.read((char*)header, sizeof(header))) break;
+        uint64_t end = offset + DEMO_RECORD_HEADER_SIZE + loadBigEndian(header, 4);
+        if (end > recordsEnd) break;
+
+        uint32_t recordTick = (uint32_t)loadBigEndian(header + 4, 4);
+        if (header[8] == DEMO_KEYFRAME) {
+            index.push_back(DemoIndexEntry{ recordTick, offset });
+        }
+        lastTick = recordTick;
+        offset = end;
+    }
+    file.clear();
+    recordsEnd = offset;
+    return !index.empty();
+}
+
+bool DemoPlayer::seek(uint32_t target) {
+    recordsApplied = 0;
+    if (index.empty() || target < index.front().tick) return false;
+
+    auto keyframe = std::upper_bound(index.begin(), index.end(), target,
+        [](uint32_t t, const DemoIndexEntry& entry) { return t < entry.tick; }) - 1;
+    uint64_t offset = keyframe->offset;
+    file.clear();
+    file.seekg((std::streamoff)offset);
+
+    uint8_t header[DEMO_RECORD_HEADER_SIZE];
+    while (offset + DEMO_RECORD_HEADER_SIZE <= recordsEnd) {
+        if (!file.read((char*)header, sizeof(header))) return false;
+        uint32_t recordTick = (uint32_t)loadBigEndian(header + 4, 4);
+        if (recordTick > target) break;
+
+        uint32_t bodySize = (uint32_t)loadBigEndian(header, 4);
+        record.resize(bodySize);
+        if (bodySize > 0 && !file.read((char*)record.data(), bodySize)) return false;
+        if (!apply(header, record.data())) return false;
+        tick = recordTick;
+        recordsApplied++;
+        offset += DEMO_RECORD_HEADER_SIZE + bodySize;
+    }
+    return recordsApplied > 0;
+}
+
+// Keyframes decode onto zeros, deltas onto the bundle before, zero-padded or cut to the new size
+bool DemoPlayer::apply(const uint8_t* header, const uint8_t* body) {
+    size_t bodySize = (size_t)loadBigEndian(header, 4);
+    uint8_t kind = header[8];
+    uint8_t flags = header[9];
+    size_t rawSize = (size_t)loadBigEndian(header + 10, 4);
+
+    if (flags & DEMO_FLAG_STORED) {
+        if (kind != DEMO_KEYFRAME || bodySize != rawSize) return false;
+        bundle.assign(body, body + bodySize);
+        return true;
+    }
+
+    if (flags & DELTA_FLAG_LZ4) {
+#ifdef USE_LZ4
+        uint32_t rleSize;
+        if (bodySize < sizeof(rleSize)) return false;
+        memcpy(&rleSize, body, sizeof(rleSize));
+        rleSize = ntohl(rleSize);
+        runScratch.resize(rleSize);
+        int decoded = LZ4_decompress_safe((const char*)body + sizeof(rleSize), (char*)runScratch.data(),
+            (int)(bodySize - sizeof(rleSize)), (int)rleSize);
+        if (decoded != (int)rleSize) return false;
+        body = runScratch.data();
+        bodySize = rleSize;
+#else
+        return false;
+#endif
+    }
+
+    if (kind == DEMO_KEYFRAME) {
+        bundle.assign(rawSize, 0);
+    }
+    else if (kind == DEMO_DELTA) {
+        bundle.resize(rawSize, 0);
+    }
+    else {
+        return false;
+    }
+    return decodeSnapshotDelta(body, bodySize, bundle.data(), rawSize);
+}
+
+// File Writer
+
+bool FileWriter::open(const std::string& path, bool append) {
+#ifdef _WIN32
+    file.open(path, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+    failed = !file;
+#else
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+    failed = fd < 0;
+#endif
+    return !failed;
+}
+
+void FileWriter::put(const void* data, size_t size) {
+    const uint8_t* in = (const uint8_t*)data;
+    while (size > 0) {
+        if (used == sizeof(buffer)) flush();
+        size_t chunk = std::min(size, sizeof(buffer) - used);
+        memcpy(buffer + used, in, chunk);
+        used += chunk;
+        in += chunk;
+        size -= chunk;
+    }
+}
+
+// Zero-fills up to the next CHECKPOINT_ALIGNMENT boundary
+void FileWriter::pad() {
+    static const uint8_t zeros[CHECKPOINT_ALIGNMENT] = {};
+    size_t misaligned = (size_t)(getBytesWritten() % CHECKPOINT_ALIGNMENT);
+    if (misaligned != 0) {
+        put(zeros, CHECKPOINT_ALIGNMENT - misaligned);
+    }
+}
+
+void FileWriter::flush() {
+    if (!failed && used > 0) {
+#ifdef _WIN32
+        failed = !file.write((const char*)buffer, (std::streamsize)used);
+#else
+        for (size_t sent = 0; sent < used && !failed; ) {
+            ssize_t result = write(fd, buffer + sent, used - sent);
+            if (result > 0) sent += (size_t)result;
+            else failed = errno != EINTR;
+        }
+#endif
+    }
+    written += used;
+    used = 0;
+}
+
+bool FileWriter::close() {
+    flush();
+#ifdef _WIN32
+    file.close();
+    failed = failed || !file;
+#else
+    if (fd >= 0) {
+        failed = fsync(fd) != 0 || failed;
+        failed = ::close(fd) != 0 || failed;
+        fd = -1;
+    }
+#endif
+    return !failed;
+}
+
+// Checkpoint File
+
+bool CheckpointFile::open(const std::string& path) {
+    close();
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(CheckpointHeader)) {
+        close();
+        return false;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    data = mapping ? (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    size = (size_t)fileSize.QuadPart;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(CheckpointHeader)) {
+        ::close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    data = mapped == MAP_FAILED ? nullptr : (const uint8_t*)mapped;
+    size = (size_t)info.st_size;
+#endif
+    if (!data) {
+        close();
+        return false;
+    }
+
+    const CheckpointHeader* header = getHeader();
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 || header->version != CHECKPOINT_VERSION) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void CheckpointFile::close() {
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    mapping = NULL;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (data) munmap((void*)data, size);
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+const CheckpointHeader* CheckpointFile::getHeader() const {
+    return (const CheckpointHeader*)data;
+}
+
+bool CheckpointFile::nextMatch(size_t& offset, const CheckpointMatch*& match, const CheckpointMember*& members,
+    const uint8_t*& snapshots) const {
+    if (offset == 0) offset = sizeof(CheckpointHeader);
+    if (!data || size - offset < sizeof(CheckpointMatch)) return false;
+
+    match = (const CheckpointMatch*)(data + offset);
+    size_t membersSize = (size_t)match->memberCount * sizeof(CheckpointMember);
+    if (size - offset - sizeof(CheckpointMatch) < membersSize + match->snapshotBytes) return false;
+
+    members = (const CheckpointMember*)(data + offset + sizeof(CheckpointMatch));
+    snapshots = data + offset + sizeof(CheckpointMatch) + membersSize;
+    for (uint32_t i = 0; i < match->memberCount; i++) {
+        if (members[i].snapshotOffset > match->snapshotBytes ||
+            members[i].snapshotSize > match->snapshotBytes - members[i].snapshotOffset) {
+            return false;
+        }
+    }
+    offset += sizeof(CheckpointMatch) + membersSize + match->snapshotBytes;
+    return true;
+}
+
+// Checkpointer
+
+void Checkpointer::start() {
+    isRunning = true;
+    thread = std::thread(&Checkpointer::run, this);
+}
+
+void Checkpointer::stop() {
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        isRunning = false;
+    }
+    wake.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void Checkpointer::request() {
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        requested = true;
+    }
+    wake.notify_one();
+}
+
+void Checkpointer::run() {
+    std::unique_lock<std::mutex> lock(wakeMutex);
+    while (isRunning) {
+        if (interval.count() > 0) {
+            wake.wait_for(lock, interval, [this] { return requested || !isRunning; });
+        }
+        else {
+            wake.wait(lock, [this] { return requested || !isRunning; });
+        }
+        if (!isRunning) break;
+
+        requested = false;
+        lock.unlock();
+        save();
+        lock.lock();
+    }
+}
+
+void Checkpointer::save() {
+    std::string temporary = path + ".tmp";
+    std::chrono::nanoseconds pause(0);
+    auto started = std::chrono::steady_clock::now();
+    bool written = matches.checkpoint(temporary, pause);
+
+    std::error_code error;
+    if (written) {
+        std::filesystem::rename(temporary, path, error);
+        written = !error;
+    }
+    if (!written) {
+        std::filesystem::remove(temporary, error);
+        checkpointsFailed.fetch_add(1, std::memory_order_relaxed);
+        std::cerr << "Error writing checkpoint " << path << ".\n";
+        return;
+    }
+
+    uint64_t pauseMicros = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(pause).count();
+    lastPauseMicros.store(pauseMicros, std::memory_order_relaxed);
+    if (pauseMicros > maxPauseMicros.load(std::memory_order_relaxed)) {
+        maxPauseMicros.store(pauseMicros, std::memory_order_relaxed);
+    }
+    lastWriteMillis.store((uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started).count(), std::memory_order_relaxed);
+    lastBytes.store((uint64_t)std::filesystem::file_size(path, error), std::memory_order_relaxed);
+    checkpointsWritten.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Checkpointer::printStats(std::ostream& out) const {
+    out << "Checkpoints: " << checkpointsWritten.load(std::memory_order_relaxed) << " written, "
+        << checkpointsFailed.load(std::memory_order_relaxed) << " failed, last "
+        << lastBytes.load(std::memory_order_relaxed) / 1024 << " KB in "
+        << lastWriteMillis.load(std::memory_order_relaxed) << " ms, paused matches "
+        << lastPauseMicros.load(std::memory_order_relaxed) << " us ("
+        << maxPauseMicros.load(std::memory_order_relaxed) << " us max)\n";
+}
+
+// Player Store
+
+// CRC-32 (IEEE), to tell whole log records from torn ones
+uint32_t crc32(const uint8_t* data, size_t size) {
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+void PlayerStore::start() {
+    recover();
+    isRunning = true;
+    thread = std::thread(&PlayerStore::run, this);
+}
+
+void PlayerStore::stop() {
+    {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        if (!isRunning) return;
+        isRunning = false;
+    }
+    flushWake.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+// The caller holds the store lock
+PlayerStore::Entry& PlayerStore::touch(uint64_t playerID) {
+    auto found = records.find(playerID);
+    if (found == records.end()) {
+        Entry entry{};
+        entry.record.playerID = playerID;
+        found = records.emplace(playerID, entry).first;
+    }
+    if (!found->second.dirty) {
+        found->second.dirty = true;
+        dirtyIDs.push_back(playerID);
+    }
+    return found->second;
+}
+
+PlayerRecord PlayerStore::beginSession(uint64_t playerID) {
+    std::lock_guard<std::mutex> lock(storeMutex);
+    Entry& entry = touch(playerID);
+    entry.record.sessions++;
+    entry.record.lastSeen = (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    return entry.record;
+}
+
+void PlayerStore::updatePosition(uint64_t playerID, const float position[3], uint8_t team) {
+    std::lock_guard<std::mutex> lock(storeMutex);
+    Entry& entry = touch(playerID);
+    memcpy(entry.record.position, position, sizeof(entry.record.position));
+    entry.record.team = team;
+}
+
+void PlayerStore::endSession(uint64_t playerID, uint64_t seconds) {
+    std::lock_guard<std::mutex> lock(storeMutex);
+    Entry& entry = touch(playerID);
+    entry.record.playSeconds += seconds;
+    entry.record.lastSeen = (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Later records of a player replace earlier ones. Everything from the first
+// record that fails its CRC on is what a crash left half-written.
+void PlayerStore::recover() {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return;
+    std::vector<uint8_t> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+
+    size_t valid = 0;
+    PlayerRecord record;
+    while (valid + PLAYER_RECORD_SIZE <= contents.size() && decode(&contents[valid], record)) {
+        Entry& entry = records[record.playerID];
+        entry.record = record;
+        entry.dirty = false;
+        valid += PLAYER_RECORD_SIZE;
+        recordsRecovered.fetch_add(1, std::memory_order_relaxed);
+    }
+    logBytes = valid;
+    if (valid < contents.size()) {
+        std::error_code error;
+        std::filesystem::resize_file(path, valid, error);
+        tornBytes.store(contents.size() - valid, std::memory_order_relaxed);
+        rewriteLog = (bool)error;
+    }
+}
+
+void PlayerStore::run() {
+    std::unique_lock<std::mutex> lock(storeMutex);
+    while (isRunning) {
+        flushWake.wait_for(lock, PLAYER_FLUSH_INTERVAL, [this] { return !isRunning; });
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+}
+
+// Appends the newest version of every dirty record as one batch
+void PlayerStore::flush() {
+    size_t liveRecords;
+    {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        for (uint64_t playerID : dirtyIDs) {
+            Entry& entry = records[playerID];
+            entry.dirty = false;
+            batch.push_back(entry.record);
+        }
+        dirtyIDs.clear();
+        liveRecords = records.size();
+    }
+    if (rewriteLog || logBytes > std::max(PLAYER_COMPACT_MIN_BYTES, (uint64_t)liveRecords * PLAYER_RECORD_SIZE * PLAYER_COMPACT_RATIO)) {
+        // The rewrite holds every record, dirty or not
+        batch.clear();
+        compact();
+        return;
+    }
+    if (batch.empty()) return;
+
+    encoded.resize(batch.size() * PLAYER_RECORD_SIZE);
+    for (size_t i = 0; i < batch.size(); i++) {
+        encode(batch[i], &encoded[i * PLAYER_RECORD_SIZE]);
+    }
+    FileWriter out;
+    bool written = out.open(path, true);
+    if (written) {
+        out.put(encoded.data(), encoded.size());
+        written = out.close();
+    }
+
+    if (written) {
+        logBytes += encoded.size();
+        recordsWritten.fetch_add(batch.size(), std::memory_order_relaxed);
+        batchesWritten.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        // Keep the records dirty, and rewrite the log over whatever part of the batch got in
+        std::lock_guard<std::mutex> lock(storeMutex);
+        for (const PlayerRecord& record : batch) {
+            touch(record.playerID);
+        }
+        rewriteLog = true;
+        writeFailures.fetch_add(1, std::memory_order_relaxed);
+    }
+    batch.clear();
+}
+
+// Writes every live record to a new log and renames it over the old one
+void PlayerStore::compact() {
+    {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        for (auto& entry : records) {
+            batch.push_back(entry.second.record);
+        }
+    }
+    encoded.resize(batch.size() * PLAYER_RECORD_SIZE);
+    for (size_t i = 0; i < batch.size(); i++) {
+        encode(batch[i], &encoded[i * PLAYER_RECORD_SIZE]);
+    }
+    batch.clear();
+
+    std::string temporary = path + ".compact";
+    FileWriter out;
+    bool written = out.open(temporary);
+    if (written) {
+        out.put(encoded.data(), encoded.size());
+        written = out.close();
+    }
+    std::error_code error;
+    if (written) {
+        std::filesystem::rename(temporary, path, error);
+        written = !error;
+    }
+    if (!written) {
+        std::filesystem::remove(temporary, error);
+        writeFailures.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    logBytes = encoded.size();
+    rewriteLog = false;
+    recordsWritten.fetch_add(encoded.size() / PLAYER_RECORD_SIZE, std::memory_order_relaxed);
+    compactions.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PlayerStore::encode(const PlayerRecord& record, uint8_t* out) {
+    storeBigEndian(out, record.playerID, 8);
+    storeBigEndian(out + 8, record.sessions, 4);
+    storeBigEndian(out + 12, record.playSeconds, 8);
+    storeBigEndian(out + 20, (uint64_t)record.lastSeen, 8);
+    for (int i = 0; i < 3; i++) {
+        uint32_t bits;
+        memcpy(&bits, &record.position[i], sizeof(bits));
+        storeBigEndian(out + 28 + i * sizeof(bits), bits, 4);
+    }
+    out[40] = record.team;
+    storeBigEndian(out + 41, crc32(out, 41), 4);
+}
+
+bool PlayerStore::decode(const uint8_t* in, PlayerRecord& record) {
+    if (loadBigEndian(in + 41, 4) != crc32(in, 41)) return false;
+
+    record.playerID = loadBigEndian(in, 8);
+    record.sessions = (uint32_t)loadBigEndian(in + 8, 4);
+    record.playSeconds = loadBigEndian(in + 12, 8);
+    record.lastSeen = (int64_t)loadBigEndian(in + 20, 8);
+    for (int i = 0; i < 3; i++) {
+        uint32_t bits = (uint32_t)loadBigEndian(in + 28 + i * sizeof(bits), 4);
+        memcpy(&record.position[i], &bits, sizeof(bits));
+    }
+    record.team = in[40];
+    return true;
+}
+
+void PlayerStore::printStats(std::ostream& out) const {
+    out << "Player store: " << recordsWritten.load(std::memory_order_relaxed) << " records written in "
+        << batchesWritten.load(std::memory_order_relaxed) << " batches, "
+        << compactions.load(std::memory_order_relaxed) << " compactions, "
+        << writeFailures.load(std::memory_order_relaxed) << " failed writes, "
+        << recordsRecovered.load(std::memory_order_relaxed) << " records recovered, "
+        << tornBytes.load(std::memory_order_relaxed) << " torn bytes dropped\n";
+}
+
+// Bot Brain
+
+BotBrain::BotBrain(uint8_t clientID, uint32_t seed) : random(seed), sequence(0), team((uint8_t)(1 + clientID % 2)) {
+    std::uniform_real_distribution<float> coordinate(-BOT_ARENA_SIZE / 2, BOT_ARENA_SIZE / 2);
+    position[0] = coordinate(random);
+    position[1] = 0.0f;
+    position[2] = coordinate(random);
+    heading = coordinate(random);
+}
+
+void BotBrain::move() {
+    std::uniform_real_distribution<float> turn(-0.5f, 0.5f);
+    heading += turn(random);
+    for (int axis = 0; axis < 3; axis += 2) {
+        position[axis] += BOT_SPEED * (axis == 0 ? std::cos(heading) : std::sin(heading));
+        if (std::fabs(position[axis]) > BOT_ARENA_SIZE / 2) {
+            position[axis] = std::copysign(BOT_ARENA_SIZE / 2, position[axis]);
+            heading += 3.14159265f;
+        }
+    }
+}
+
+// Payload: sequence, send time in microseconds, then position as network-order floats
+SharedFrame BotBrain::makeSnapshot(uint8_t clientID, uint64_t sendMicros) {
+    std::shared_ptr<std::vector<uint8_t>> frame = std::make_shared<std::vector<uint8_t>>(FRAME_HEADER_SIZE + BOT_SNAPSHOT_SIZE);
+    uint8_t* out = frame->data();
+    uint32_t msgSize = htonl((uint32_t)(frame->size() - sizeof(uint32_t)));
+    uint32_t length = htonl((uint32_t)BOT_SNAPSHOT_SIZE);
+    memcpy(out, &msgSize, sizeof(msgSize));
+    out[4] = SNAPSHOT_MESSAGE;
+    out[5] = clientID;
+    memcpy(out + 6, &length, sizeof(length));
+    storeBigEndian(out + FRAME_HEADER_SIZE, sequence++, 4);
+    storeBigEndian(out + FRAME_HEADER_SIZE + 4, sendMicros, 8);
+    for (int i = 0; i < 3; i++) {
+        uint32_t bits;
+        memcpy(&bits, &position[i], sizeof(bits));
+        storeBigEndian(out + FRAME_HEADER_SIZE + 12 + sizeof(uint32_t) * i, bits, 4);
+    }
+    return frame;
+}
+
+// Network Simulation
+
+Simulation::Results::Results()
+    : eventsRun(0), inputsSent(0), packetsSent(0), packetsLost(0), packetsReordered(0), framesDelivered(0),
+    snapshotsDelivered(0), deltasApplied(0), resyncsRequested(0), snapshotsCorrupt(0), pongsSent(0), bytesDelivered(0),
+    latencySumMicros(0), checksum(0), latencyHistogram(SIM_LATENCY_BUCKETS) {}
+
+// Checksums combine in shard order, so totals do not depend on which thread finished first
+void Simulation::Results::add(const Results& other) {
+    eventsRun += other.eventsRun;
+    inputsSent += other.inputsSent;
+    packetsSent += other.packetsSent;
+    packetsLost += other.packetsLost;
+    packetsReordered += other.packetsReordered;
+    framesDelivered += other.framesDelivered;
+    snapshotsDelivered += other.snapshotsDelivered;
+    deltasApplied += other.deltasApplied;
+    resyncsRequested += other.resyncsRequested;
+    snapshotsCorrupt += other.snapshotsCorrupt;
+    pongsSent += other.pongsSent;
+    bytesDelivered += other.bytesDelivered;
+    latencySumMicros += other.latencySumMicros;
+    checksum = (checksum ^ other.checksum) * 1099511628211ULL;
+    for (size_t i = 0; i < latencyHistogram.size(); i++) latencyHistogram[i] += other.latencyHistogram[i];
+}
+
+int Simulation::LinkTransport::send(const uint8_t* data, size_t size) {
+    Link& downlink = shard.clients[clientIndex].downlink;
+    if (downlink.inFlightBytes >= SIM_SEND_BUFFER) return WOULD_BLOCK;
+    size = std::min(size, SIM_SEND_BUFFER - downlink.inFlightBytes);
+    simulation.sendPacket(shard, clientIndex, false, data, size);
+    return (int)size;
+}
+
+int Simulation::LinkTransport::receive(uint8_t* data, size_t size) {
+    size_t available = received.size() - receivedStart;
+    if (available == 0) {
+        received.clear();
+        receivedStart = 0;
+        return WOULD_BLOCK;
+    }
+    size = std::min(size, available);
+    memcpy(data, received.data() + receivedStart, size);
+    receivedStart += size;
+    return (int)size;
+}
+
+// Client IDs are 8 bits and only have to be unique within a match, so every
+// match numbers its clients from 1 again
+Simulation::Simulation(const SimulationConfig& simulationConfig) : config(simulationConfig), nextShard(0) {
+    config.matchSize = config.matchSize == 0 ? SIM_MATCH_SIZE : std::min<size_t>(config.matchSize, 255);
+    config.tickRate = std::max(1u, config.tickRate);
+    config.lossPercent = std::min(std::max(config.lossPercent, 0.0), 99.0);
+    if (config.threads == 0) config.threads = std::max(1u, std::thread::hardware_concurrency());
+    latencyMicros = (uint64_t)(std::max(config.latencyMs, 0.0) * 1000);
+    jitterMicros = (uint64_t)(std::max(config.jitterMs, 0.0) * 1000);
+    rtoMicros = std::max(SIM_MIN_RTO_MICROS, 2 * latencyMicros + 4 * jitterMicros);
+
+    ServerConfig serverConfig;
+    serverConfig.matchSize = config.matchSize;
+    serverConfig.tickRates.assign(1, config.tickRate);
+    server.reset(new Server(serverConfig));
+
+    for (size_t first = 0; first < config.clients; first += config.matchSize) {
+        std::unique_ptr<Shard> shard = std::make_unique<Shard>();
+        shard->match = std::make_unique<Match>((uint32_t)(shards.size() + 1), config.tickRate, config.matchSize);
+        shard->reactor.reset(new Reactor(*server, shards.size(), 1, WAIT_YIELD));
+        shard->reactor->setPeers(std::vector<Reactor*>(1, shard->reactor.get()));
+        shard->random.seed(config.seed * 1000003 + shards.size());
+        shard->now = 0;
+        shard->nextOrder = 0;
+
+        // Transports find their client by index, so the vector never reallocates
+        size_t count = std::min(config.matchSize, config.clients - first);
+        shard->clients.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            uint8_t clientID = (uint8_t)(1 + i);
+            shard->clients.emplace_back(clientID, (uint32_t)shard->random(), count);
+            SimClient& client = shard->clients.back();
+            client.transport = new LinkTransport(*this, *shard, (uint32_t)i);
+            client.conn = std::make_shared<Connection>(INVALID_SOCKET, clientID, shard->reactor.get());
+            client.conn->transport.reset(client.transport);
+            client.conn->match = shard->match.get();
+            shard->match->addMember(client.conn);
+            shard->reactor->adopt(client.conn);
+        }
+        shards.push_back(std::move(shard));
+    }
+}
+
+void Simulation::schedule(Shard& shard, uint64_t time, EventKind kind, uint32_t index) {
+    shard.events.push(Event{ time, shard.nextOrder++, kind, index });
+}
+
+std::vector<uint8_t> Simulation::takeBuffer(Shard& shard) {
+    std::vector<uint8_t> buffer;
+    if (!shard.spareBuffers.empty()) {
+        buffer.swap(shard.spareBuffers.back());
+        shard.spareBuffers.pop_back();
+    }
+    return buffer;
+}
+
+// Returns when the packet reaches the other end, and keeps deliveries in order
+uint64_t Simulation::transmit(Shard& shard, Link& link, size_t bytes) {
+    std::uniform_real_distribution<double> percent(0.0, 100.0);
+    uint64_t sent = std::max(shard.now, link.busyUntil);
+    if (config.bandwidthKbps > 0) sent += (uint64_t)bytes * 8000 / config.bandwidthKbps;
+    link.busyUntil = sent;
+
+    uint64_t arrival = sent + latencyMicros + (jitterMicros > 0 ? shard.random() % (jitterMicros + 1) : 0);
+    while (config.lossPercent > 0 && percent(shard.random) < config.lossPercent) {
+        arrival += rtoMicros;
+        shard.results.packetsLost++;
+    }
+    if (config.reorderPercent > 0 && percent(shard.random) < config.reorderPercent) {
+        arrival += shard.random() % (latencyMicros + jitterMicros + 1);
+        shard.results.packetsReordered++;
+    }
+    shard.results.packetsSent++;
+
+    uint64_t deliverAt = std::max(arrival, link.lastDelivery);
+    link.lastDelivery = deliverAt;
+    return deliverAt;
+}
+
+// One write by either end of a client's connection
+void Simulation::sendPacket(Shard& shard, uint32_t clientIndex, bool uplink, const uint8_t* data, size_t size) {
+    Link& link = uplink ? shard.clients[clientIndex].uplink : shard.clients[clientIndex].downlink;
+    Packet packet;
+    packet.bytes = takeBuffer(shard);
+    packet.bytes.assign(data, data + size);
+    packet.deliverAt = transmit(shard, link, size);
+    if (link.inFlight.empty()) schedule(shard, packet.deliverAt, uplink ? EVENT_UPLINK : EVENT_DOWNLINK, clientIndex);
+    link.inFlightBytes += size;
+    link.inFlight.push_back(std::move(packet));
+}
+
+void Simulation::stepReactor(Shard& shard, Connection* ready, bool tick) {
+    shard.ready.clear();
+    if (ready) shard.ready.push_back(ready);
+    shard.reactor->simulateStep(shard.now, shard.ready, tick);
+}
+
+void Simulation::appendFrame(std::vector<uint8_t>& out, uint8_t type, const uint8_t* payload, size_t size) {
+    size_t start = out.size();
+    out.resize(start + FRAME_HEADER_SIZE + size);
+    storeBigEndian(out.data() + start, 2 + sizeof(uint32_t) + size, 4);
+    out[start + 4] = type;
+    out[start + 5] = 0;
+    storeBigEndian(out.data() + start + 6, size, 4);
+    if (size > 0) memcpy(out.data() + start + FRAME_HEADER_SIZE, payload, size);
+}
+
+void Simulation::run() {
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < std::min<size_t>(config.threads, shards.size()); i++) {
+        threads.emplace_back([this]() {
+            for (size_t index = nextShard++; index < shards.size(); index = nextShard++) {
+                runShard(*shards[index]);
+            }
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    for (const std::unique_ptr<Shard>& shard : shards) totals.add(shard->results);
+}
+
+void Simulation::runShard(Shard& shard) {
+    uint64_t tickMicros = 1000000 / config.tickRate;
+    uint64_t reactorTickMicros = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(TICK_INTERVAL).count();
+    uint64_t inputMicros = 1000000 / SIM_INPUT_RATE;
+    uint64_t endMicros = config.seconds * 1000000;
+
+    // Everyone connects at the start, and says it understands deltas the way the client does
+    stepReactor(shard, nullptr, false);
+    for (uint32_t c = 0; c < shard.clients.size(); c++) {
+        shard.scratch.clear();
+        appendFrame(shard.scratch, SNAPSHOT_RESYNC_MESSAGE, nullptr, 0);
+        sendPacket(shard, c, true, shard.scratch.data(), shard.scratch.size());
+    }
+
+    // The match, the reactor and the clients start at random points of their first interval
+    schedule(shard, shard.random() % tickMicros, EVENT_TICK, 0);
+    schedule(shard, shard.random() % reactorTickMicros, EVENT_REACTOR_TICK, 0);
+    for (uint32_t c = 0; c < shard.clients.size(); c++) schedule(shard, shard.random() % inputMicros, EVENT_INPUT, c);
+
+    while (!shard.events.empty() && shard.events.top().time <= endMicros) {
+        Event event = shard.events.top();
+        shard.events.pop();
+        shard.now = event.time;
+        shard.results.eventsRun++;
+
+        switch (event.kind) {
+        case EVENT_TICK:
+            // The match posts its frames to the reactor, which takes them at once
+            shard.match->tick();
+            stepReactor(shard, nullptr, false);
+            schedule(shard, shard.now + tickMicros, EVENT_TICK, 0);
+            break;
+        case EVENT_REACTOR_TICK:
+            stepReactor(shard, nullptr, true);
+            schedule(shard, shard.now + reactorTickMicros, EVENT_REACTOR_TICK, 0);
+            break;
+        case EVENT_INPUT:
+            sendInput(shard, event.index);
+            schedule(shard, shard.now + inputMicros, EVENT_INPUT, event.index);
+            break;
+        case EVENT_UPLINK:
+            deliverUplink(shard, event.index);
+            break;
+        case EVENT_DOWNLINK:
+            deliverDownlink(shard, event.index);
+            break;
+        }
+    }
+}
+
+// Position and team, then the snapshot, in one write
+void Simulation::sendInput(Shard& shard, uint32_t clientIndex) {
+    SimClient& client = shard.clients[clientIndex];
+    client.brain.move();
+
+    uint8_t state[3 * sizeof(uint32_t) + 1];
+    for (int i = 0; i < 3; i++) {
+        uint32_t bits;
+        memcpy(&bits, &client.brain.position[i], sizeof(bits));
+        storeBigEndian(state + sizeof(uint32_t) * i, bits, 4);
+    }
+    state[3 * sizeof(uint32_t)] = client.brain.team;
+
+    SharedFrame snapshot = client.brain.makeSnapshot(0, shard.now);
+    shard.scratch.clear();
+    appendFrame(shard.scratch, PLAYER_STATE_MESSAGE, state, sizeof(state));
+    shard.scratch.insert(shard.scratch.end(), snapshot->begin(), snapshot->end());
+    sendPacket(shard, clientIndex, true, shard.scratch.data(), shard.scratch.size());
+    shard.results.inputsSent++;
+}
+
+// The server end: the bytes wait in the transport and the reactor reads them as if poll() said so
+void Simulation::deliverUplink(Shard& shard, uint32_t clientIndex) {
+    SimClient& client = shard.clients[clientIndex];
+    Link& uplink = client.uplink;
+    while (!uplink.inFlight.empty() && uplink.inFlight.front().deliverAt <= shard.now) {
+        Packet& packet = uplink.inFlight.front();
+        client.transport->received.insert(client.transport->received.end(), packet.bytes.begin(), packet.bytes.end());
+        uplink.inFlightBytes -= packet.bytes.size();
+        packet.bytes.clear();
+        shard.spareBuffers.push_back(std::move(packet.bytes));
+        uplink.inFlight.pop_front();
+    }
+    if (!uplink.inFlight.empty()) schedule(shard, uplink.inFlight.front().deliverAt, EVENT_UPLINK, clientIndex);
+
+    stepReactor(shard, client.conn.get(), false);
+}
+
+// The client end: whole frames are decoded, and the freed send buffer lets
+// the reactor write whatever it still holds
+void Simulation::deliverDownlink(Shard& shard, uint32_t clientIndex) {
+    SimClient& client = shard.clients[clientIndex];
+    Link& downlink = client.downlink;
+    while (!downlink.inFlight.empty() && downlink.inFlight.front().deliverAt <= shard.now) {
+        Packet& packet = downlink.inFlight.front();
+        client.inBuffer.insert(client.inBuffer.end(), packet.bytes.begin(), packet.bytes.end());
+        downlink.inFlightBytes -= packet.bytes.size();
+        shard.results.bytesDelivered += packet.bytes.size();
+        shard.results.checksum = (shard.results.checksum ^ shard.now ^ ((uint64_t)clientIndex << 40) ^ packet.bytes.size()) *
+            1099511628211ULL;
+        packet.bytes.clear();
+        shard.spareBuffers.push_back(std::move(packet.bytes));
+        downlink.inFlight.pop_front();
+    }
+    if (!downlink.inFlight.empty()) schedule(shard, downlink.inFlight.front().deliverAt, EVENT_DOWNLINK, clientIndex);
+
+    size_t offset = client.inStart;
+    while (client.inBuffer.size() - offset >= sizeof(uint32_t)) {
+        size_t frameSize = sizeof(uint32_t) + (size_t)loadBigEndian(client.inBuffer.data() + offset, 4);
+        if (client.inBuffer.size() - offset < frameSize) break;
+        receiveFrame(shard, clientIndex, client.inBuffer.data() + offset, frameSize);
+        offset += frameSize;
+    }
+    if (offset == client.inBuffer.size()) {
+        client.inBuffer.clear();
+        offset = 0;
+    }
+    else if (offset > client.inBuffer.size() / 2) {
+        client.inBuffer.erase(client.inBuffer.begin(), client.inBuffer.begin() + offset);
+        offset = 0;
+    }
+    client.inStart = offset;
+
+    if (client.conn->pendingOutput() > 0) stepReactor(shard, client.conn.get(), false);
+}
+
+// What the client program does with each frame type that matters here
+void Simulation::receiveFrame(Shard& shard, uint32_t clientIndex, const uint8_t* frame, size_t size) {
+    SimClient& client = shard.clients[clientIndex];
+    shard.results.framesDelivered++;
+    if (size < FRAME_HEADER_SIZE) return;
+
+    uint8_t messageType = frame[4];
+    uint8_t senderID = frame[5];
+    const uint8_t* payload = frame + FRAME_HEADER_SIZE;
+    size_t payloadSize = size - FRAME_HEADER_SIZE;
+
+    if (messageType == PING_MESSAGE) {
+        shard.scratch.clear();
+        appendFrame(shard.scratch, PONG_MESSAGE, payload, payloadSize);
+        sendPacket(shard, clientIndex, true, shard.scratch.data(), shard.scratch.size());
+        shard.results.pongsSent++;
+        return;
+    }
+    if (messageType == VISIBILITY_MESSAGE && payloadSize >= 1) {
+        // Members leaving view are forgotten; the server sends their next snapshot in full
+        size_t leftAt = 1 + (size_t)payload[0];
+        for (size_t i = leftAt + 1; i < payloadSize; i++) {
+            if (payload[i] < client.baselines.size()) client.baselines[payload[i]].valid = false;
+        }
+        return;
+    }
+    if ((messageType != SNAPSHOT_MESSAGE && messageType != SNAPSHOT_DELTA_MESSAGE) || senderID >= client.baselines.size()) {
+        return;
+    }
+
+    Baseline& baseline = client.baselines[senderID];
+    if (messageType == SNAPSHOT_MESSAGE) {
+        baseline.payload.assign(payload, payload + payloadSize);
+        baseline.sequence = 1;
+        baseline.valid = true;
+        if (client.resyncPending && (client.resyncSender == 0 || client.resyncSender == senderID)) {
+            client.resyncPending = false;
+        }
+        recordSnapshot(shard, baseline);
+        return;
+    }
+
+    // Deltas sent before the server saw the last resync request are expected to miss
+    if (!baseline.valid || payloadSize < DELTA_HEADER_SIZE || loadBigEndian(payload, 2) != baseline.sequence) {
+        if (!client.resyncPending) requestResync(shard, clientIndex, senderID);
+        return;
+    }
+    if (!applyDelta(shard, baseline, payload, payloadSize)) {
+        baseline.valid = false;
+        requestResync(shard, clientIndex, senderID);
+        return;
+    }
+    baseline.sequence++;
+    shard.results.deltasApplied++;
+    recordSnapshot(shard, baseline);
+}
+
+// Patches the baseline in place into the snapshot the delta describes
+bool Simulation::applyDelta(Shard& shard, Baseline& baseline, const uint8_t* payload, size_t size) {
+    uint8_t flags = payload[2];
+    uint32_t rawSize = (uint32_t)loadBigEndian(payload + 3, 4);
+    const uint8_t* body = payload + DELTA_HEADER_SIZE;
+    size_t bodySize = size - DELTA_HEADER_SIZE;
+
+    if (flags & DELTA_FLAG_LZ4) {
+#ifdef USE_LZ4
+        if (bodySize < sizeof(uint32_t)) return false;
+        uint32_t rleSize = (uint32_t)loadBigEndian(body, 4);
+        shard.decodeScratch.resize(rleSize);
+        int decoded = LZ4_decompress_safe((const char*)body + sizeof(uint32_t), (char*)shard.decodeScratch.data(),
+            (int)(bodySize - sizeof(uint32_t)), (int)rleSize);
+        if (decoded != (int)rleSize) return false;
+        body = shard.decodeScratch.data();
+        bodySize = rleSize;
+#else
+        return false;
+#endif
+    }
+
+    baseline.payload.resize(rawSize, 0);
+    return decodeSnapshotDelta(body, bodySize, baseline.payload.data(), rawSize);
+}
+
+// Like the client, drops every baseline until the full snapshots come back
+void Simulation::requestResync(Shard& shard, uint32_t clientIndex, uint8_t senderID) {
+    SimClient& client = shard.clients[clientIndex];
+    for (Baseline& baseline : client.baselines) baseline.valid = false;
+    client.resyncPending = true;
+    client.resyncSender = senderID;
+    shard.scratch.clear();
+    appendFrame(shard.scratch, SNAPSHOT_RESYNC_MESSAGE, nullptr, 0);
+    sendPacket(shard, clientIndex, true, shard.scratch.data(), shard.scratch.size());
+    shard.results.resyncsRequested++;
+}
+
+// Snapshots carry their sequence and send time, so their age on arrival is
+// the whole trip through both links, the match and the reactor, and a delta
+// applied to the wrong baseline shows up as time or sequence going backwards
+void Simulation::recordSnapshot(Shard& shard, Baseline& baseline) {
+    Results& results = shard.results;
+    if (baseline.payload.size() < 12) {
+        results.snapshotsCorrupt++;
+        return;
+    }
+    uint32_t sequence = (uint32_t)loadBigEndian(baseline.payload.data(), 4);
+    uint64_t sentAt = loadBigEndian(baseline.payload.data() + 4, 8);
+    if (sentAt > shard.now || sequence < baseline.lastSequence) {
+        results.snapshotsCorrupt++;
+        return;
+    }
+    baseline.lastSequence = sequence;
+
+    uint64_t latency = shard.now - sentAt;
+    results.snapshotsDelivered++;
+    results.latencySumMicros += latency;
+    results.latencyHistogram[std::min<uint64_t>(latency / 1000, SIM_LATENCY_BUCKETS - 1)]++;
+}
+
+// In milliseconds, to the histogram's resolution
+uint64_t Simulation::latencyPercentile(double fraction) const {
+    uint64_t target = (uint64_t)std::ceil(totals.snapshotsDelivered * fraction);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < totals.latencyHistogram.size(); i++) {
+        seen += totals.latencyHistogram[i];
+        if (seen >= target && seen > 0) return i;
+    }
+    return 0;
+}
 
-    void start();
-    void acceptClients();
-    void handleClient(ClientHandler* clientHandler);
-    void broadcastMessage(BaseMessage* msg, uint8_t excludeID = 0);
-    void stop();
-};
+void Simulation::printReport(std::ostream& out, double wallSeconds) const {
+    uint64_t deferred = 0;
+    uint64_t dropped = 0;
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    for (const std::unique_ptr<Shard>& shard : shards) {
+        deferred += shard->match->snapshotsDeferred.load(std::memory_order_relaxed);
+        cacheHits += shard->reactor->getEncodeCache().hits.load(std::memory_order_relaxed);
+        cacheMisses += shard->reactor->getEncodeCache().misses.load(std::memory_order_relaxed);
+        for (const SimClient& client : shard->clients) dropped += client.conn->droppedFrames.load(std::memory_order_relaxed);
+    }
 
-// Serialization and Deserialization Functions
-void serializeMessage(BaseMessage* msg, std::vector<uint8_t>& buffer);
-BaseMessage* deserializeMessage(const std::vector<uint8_t>& buffer);
+    out << "Simulated " << config.clients << " clients in " << shards.size() << " matches at " << config.tickRate
+        << " Hz for " << config.seconds << " s in " << wallSeconds << " s on " << std::min<size_t>(config.threads, shards.size())
+        << " threads (" << (wallSeconds > 0 ? config.seconds / wallSeconds : 0.0) << "x real time), seed " << config.seed << "\n";
+    out << "  Links: " << config.latencyMs << " ms + " << config.jitterMs << " ms jitter, " << config.lossPercent
+        << "% loss, " << config.reorderPercent << "% reordered, ";
+    if (config.bandwidthKbps > 0) out << config.bandwidthKbps << " kbit/s\n";
+    else out << "unlimited bandwidth\n";
+    out << "  Events: " << totals.eventsRun << ", inputs " << totals.inputsSent << ", packets " << totals.packetsSent << " ("
+        << totals.packetsLost << " retransmits, " << totals.packetsReordered << " reordered), pongs " << totals.pongsSent << "\n";
+    out << "  Delivered: " << totals.framesDelivered << " frames, " << totals.snapshotsDelivered << " snapshots ("
+        << totals.deltasApplied << " from deltas), " << totals.bytesDelivered / 1024 << " KB; " << dropped
+        << " frames dropped, " << deferred << " snapshots deferred\n";
+    out << "  Deltas: encode cache " << cacheHits << " hits, " << cacheMisses << " misses; " << totals.resyncsRequested
+        << " resyncs requested, " << totals.snapshotsCorrupt << " snapshots decoded wrong\n";
+    out << "  Snapshot age: mean " << (totals.snapshotsDelivered ? totals.latencySumMicros / totals.snapshotsDelivered / 1000.0 : 0.0)
+        << " ms, p50 " << latencyPercentile(0.5) << " ms, p99 " << latencyPercentile(0.99) << " ms\n";
+    out << "  Checksum: " << std::hex << totals.checksum << std::dec << "\n";
+}
+
+// Server
 
 void Server::start() {
     // Initialize platform-specific networking
@@ -112,7 +5246,7 @@ void Server::start() {
     // Bind socket to IP and port
     sockaddr_in serverHint{};
     serverHint.sin_family = AF_INET;
-    serverHint.sin_port = htons(PORT);
+    serverHint.sin_port = htons(config.port);
     serverHint.sin_addr.s_addr = INADDR_ANY;
 
     if (bind(listeningSocket, (sockaddr*)&serverHint, sizeof(serverHint)) == SOCKET_ERROR) {
@@ -120,13 +5254,79 @@ void Server::start() {
         return;
     }
 
+    // Start reactor threads; all of them must exist before any starts reading the others' rings
+    unsigned reactorCount = config.reactorThreads;
+    if (reactorCount == 0) {
+        reactorCount = std::max(1u, std::min(MAX_REACTOR_THREADS, std::thread::hardware_concurrency()));
+    }
+    std::vector<Reactor*> peers;
+    for (unsigned i = 0; i < reactorCount; i++) {
+        reactors.emplace_back(new Reactor(*this, i, reactorCount, config.broadcastWait));
+        peers.push_back(reactors.back().get());
+    }
+    if (config.pipeline) {
+        pipeline.reset(new Pipeline(peers, governor, config.broadcastWait));
+    }
+    for (std::unique_ptr<Reactor>& reactor : reactors) {
+        reactor->setPeers(peers);
+        reactor->setPipeline(pipeline.get());
+        if (!reactor->start()) {
+            return;
+        }
+    }
+    if (pipeline) {
+        pipeline->start();
+    }
+
+    unsigned workerCount = config.matchWorkers;
+    if (workerCount == 0) {
+        workerCount = std::max(1u, std::min(MAX_MATCH_WORKERS, std::thread::hardware_concurrency()));
+    }
+    if (!config.demoDirectory.empty()) {
+        recorder.reset(new DemoRecorder(config.demoDirectory));
+        recorder->start();
+        matches.setRecorder(recorder.get());
+    }
+    if (!config.restorePath.empty()) {
+        CheckpointFile checkpoint;
+        if (checkpoint.open(config.restorePath)) {
+            std::cout << "Restored " << matches.restore(checkpoint) << " matches from " << config.restorePath << ".\n";
+        }
+        else {
+            std::cerr << "Error reading checkpoint " << config.restorePath << ".\n";
+        }
+    }
+    matches.start(workerCount);
+    if (!config.playerLogPath.empty()) {
+        players.reset(new PlayerStore(config.playerLogPath));
+        players->start();
+    }
+    if (!config.checkpointPath.empty()) {
+        checkpointer.reset(new Checkpointer(matches, config.checkpointPath, std::chrono::seconds(config.checkpointSeconds)));
+        checkpointer->start();
+    }
+
+    governorThread = std::thread(&Server::runGovernor, this);
+
+    // The game runs without voice or spectators if their ports are taken
+    voiceRunning = voice.start();
+    if (!voiceRunning) {
+        std::cerr << "Voice relay failed to start; clients will get no voice setup.\n";
+    }
+    spectators.reset(new SpectatorFeed(&matches, config.spectatorPort));
+    spectators->start();
+
     // Start listening
     listen(listeningSocket, SOMAXCONN);
 
-    std::cout << "Server is listening on port " << PORT << "...\n";
+    std::cout << "Server is listening on port " << config.port << " with " << reactorCount << " reactor threads...\n";
 
     // Accept clients in a separate thread
     std::thread(&Server::acceptClients, this).detach();
+
+    if (config.bots > 0) {
+        addBots(config.bots);
+    }
 }
 
 void Server::acceptClients() {
@@ -135,98 +5335,409 @@ void Server::acceptClients() {
         socklen_t clientSize = sizeof(clientHint);
 
         SOCKET clientSocket = accept(listeningSocket, (sockaddr*)&clientHint, &clientSize);
+        if (clientSocket != INVALID_SOCKET && governor.getLevel() >= DEGRADE_REJECT_JOINS) {
+            closesocket(clientSocket);
+            governor.joinsRejected.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
         if (clientSocket != INVALID_SOCKET) {
             // Assign a unique ID to the new client
-            uint8_t clientID = nextClientID++;
+            uint8_t clientID;
+            if (!takeClientID(clientID)) {
+                closesocket(clientSocket);
+                std::cerr << "Refused a client: all 255 client IDs are in use.\n";
+                continue;
+            }
 
-            // Create a new client handler
-            ClientHandler* clientHandler = new ClientHandler{ clientSocket, clientID };
+            // Hand the connection to the next reactor
+            Reactor* reactor = reactors[nextReactor++ % reactors.size()].get();
+            std::shared_ptr<Connection> conn = std::make_shared<Connection>(clientSocket, clientID, reactor);
             {
                 std::lock_guard<std::mutex> lock(clientsMutex);
-                clients.push_back(clientHandler);
+                clients.push_back(conn);
             }
+            conn->match = matches.join(conn);
+            conn->voiceToken = voice.addClient(clientID, conn->match);
 
             // Notify existing clients about the new client
             // ...
 
-            // Start client thread
-            clientHandler->thread = std::thread(&Server::handleClient, this, clientHandler);
-            clientHandler->thread.detach();
+            reactor->adopt(conn);
 
-            std::cout << "Client " << (int)clientID << " connected.\n";
+            std::cout << "Client " << (int)clientID << " connected to match " << conn->match->getID() << ".\n";
         }
     }
 }
 
-void Server::handleClient(ClientHandler* clientHandler) {
-    SOCKET clientSocket = clientHandler->socket;
-    uint8_t clientID = clientHandler->clientID;
+// Message handler for one client, running on its reactor thread
+Task Server::handleClient(Connection& conn) {
+    if (voiceRunning) sendVoiceSetup(conn);
+    sendCachedSnapshots(conn);
 
-    while (isRunning) {
-        // Receive message size
-        uint32_t msgSize;
-        int bytesReceived = recv(clientSocket, (char*)&msgSize, sizeof(msgSize), 0);
-        if (bytesReceived <= 0) {
-            break;
+    while (FrameView frame = co_await conn.recv()) {
+        if (frame.size >= 1 && frame.data[0] == SNAPSHOT_RESYNC_MESSAGE) {
+            // Client understands deltas and wants full snapshots from here on
+            conn.deltaSnapshots = true;
+            conn.resyncSnapshots();
+            continue;
+        }
+        if (frame.size >= 1 && frame.data[0] == PONG_MESSAGE) {
+            conn.handlePong(frame);
+            continue;
+        }
+        if (frame.size >= 1 && frame.data[0] == PLAYER_STATE_MESSAGE) {
+            updatePlayerState(conn, frame);
+            continue;
+        }
+        if (frame.size >= 1 && frame.data[0] == IDENTIFY_MESSAGE) {
+            identifyPlayer(conn, frame);
+            continue;
         }
-        msgSize = ntohl(msgSize);
 
-        // Receive message data
-        std::vector<uint8_t> buffer(msgSize);
-        size_t totalReceived = 0;
-        while (totalReceived < msgSize) {
-            bytesReceived = recv(clientSocket, (char*)buffer.data() + totalReceived, msgSize - totalReceived, 0);
-            if (bytesReceived <= 0) {
-                break;
+        // Stage threads take it from here
+        if (pipeline) {
+            conn.reactor->submit(conn, frame);
+            while (conn.reactor->isPipelineBacklogged() && conn.isOpen()) {
+                co_await conn.tick();
             }
-            totalReceived += bytesReceived;
+            continue;
         }
-        if (bytesReceived <= 0) {
-            break;
+
+        if (frame.size >= 1 && frame.data[0] == COSMETIC_EVENT_MESSAGE && governor.getLevel() >= DEGRADE_COSMETIC) {
+            governor.cosmeticDropped.fetch_add(1, std::memory_order_relaxed);
+            continue;
         }
 
         // Deserialize message
-        BaseMessage* msg = deserializeMessage(buffer);
+        BaseMessage* msg = deserializeMessage(frame.data, frame.size);
         if (msg) {
-            msg->senderID = clientID;
+            msg->senderID = conn.clientID;
             // Broadcast the message to other clients
-            broadcastMessage(msg, clientID);
+            broadcastMessage(msg, conn.clientID, conn.match);
             delete msg;
         }
     }
 
-    // Remove client from list
+    // Notify other clients about client disconnect
+    // ...
+}
+
+// Bots join like clients but skip the socket: the reactor they land on
+// drives them from its tick instead of from poll()
+void Server::addBots(unsigned count) {
+    if (governor.getLevel() >= DEGRADE_REJECT_JOINS) {
+        governor.joinsRejected.fetch_add(count, std::memory_order_relaxed);
+        std::cout << "Not adding bots: the server is overloaded and rejecting joins.\n";
+        return;
+    }
+
+    unsigned added = 0;
+    for (; added < count; added++) {
+        uint8_t clientID;
+        if (!takeClientID(clientID)) break;
+        Reactor* reactor = reactors[nextReactor++ % reactors.size()].get();
+        std::shared_ptr<Connection> conn = std::make_shared<Connection>(INVALID_SOCKET, clientID, reactor);
+        conn->bot = true;
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex);
+            clients.push_back(conn);
+        }
+        conn->match = matches.join(conn);
+        reactor->adopt(conn);
+    }
+    botCount.fetch_add(added, std::memory_order_relaxed);
+    if (added < count) {
+        std::cout << "Added " << added << " of " << count << " bots: all 255 client IDs are in use.\n";
+    }
+    else {
+        std::cout << "Added " << count << " bots.\n";
+    }
+}
+
+// Handler for one bot, running on its reactor thread like handleClient. A
+// bot wanders the arena and sends its position and a snapshot through the
+// same match calls a client's messages end up in, with the snapshot frame
+// built in place rather than serialized from a message. Frames relayed to it
+// are read straight from the shared buffers.
+Task Server::runBot(Connection& conn) {
+    BotBrain brain(conn.clientID, conn.clientID);
+
+    while (conn.isOpen() && isRunning) {
+        uint64_t tick = co_await conn.tick();
+
+        uint64_t snapshots = 0;
+        for (const SharedFrame& frame : conn.botInbox) {
+            if (frame->size() > 4 && (*frame)[4] == SNAPSHOT_MESSAGE) snapshots++;
+        }
+        botFramesReceived.fetch_add(conn.botInbox.size(), std::memory_order_relaxed);
+        botSnapshotsReceived.fetch_add(snapshots, std::memory_order_relaxed);
+        conn.botInbox.clear();
+
+        // Bots on the same reactor take turns, so inputs spread over the ticks
+        if ((tick + conn.clientID) % BOT_INPUT_TICKS != 0) continue;
+
+        brain.move();
+        conn.match->updatePlayerState(conn.clientID, brain.position, brain.team);
+        uint64_t sendMicros = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        conn.match->stageSnapshot(conn.clientID, brain.makeSnapshot(conn.clientID, sendMicros));
+        botInputs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Tells the client where to send voice and which token to put in it. The
+// sender field carries the client's own ID, which voice datagrams also need.
+void Server::sendVoiceSetup(Connection& conn) {
+    uint8_t frame[sizeof(uint32_t) + 2 + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint32_t)];
+    uint32_t msgSize = htonl(2 + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint32_t));
+    uint32_t length = htonl(sizeof(uint16_t) + sizeof(uint32_t));
+    uint16_t port = htons(VOICE_PORT);
+    uint32_t token = htonl(conn.voiceToken);
+    memcpy(frame, &msgSize, sizeof(msgSize));
+    frame[4] = VOICE_SETUP_MESSAGE;
+    frame[5] = conn.clientID;
+    memcpy(frame + 6, &length, sizeof(length));
+    memcpy(frame + 10, &port, sizeof(port));
+    memcpy(frame + 12, &token, sizeof(token));
+    conn.queueFrame(frame, sizeof(frame));
+}
+
+// Pushes the latest snapshot of every other match member in one write
+void Server::sendCachedSnapshots(Connection& conn) {
+    std::vector<SharedFrame> frames;
+    conn.match->collectSnapshots(frames, conn.clientID);
+    for (const SharedFrame& frame : frames) {
+        conn.queueRelayedFrame(frame);
+    }
+    conn.flush();
+}
+
+// Payload: x, y and z as network-order floats, then the team
+void Server::updatePlayerState(Connection& conn, const FrameView& frame) {
+    const size_t payloadOffset = 2 + sizeof(uint32_t);
+    if (frame.size < payloadOffset + 3 * sizeof(uint32_t) + 1) return;
+
+    float position[3];
+    for (int i = 0; i < 3; i++) {
+        uint32_t bits;
+        memcpy(&bits, frame.data + payloadOffset + i * sizeof(bits), sizeof(bits));
+        bits = ntohl(bits);
+        memcpy(&position[i], &bits, sizeof(bits));
+    }
+    uint8_t team = frame.data[payloadOffset + 3 * sizeof(uint32_t)];
+    conn.match->updatePlayerState(conn.clientID, position, team);
+    if (players && conn.playerID != 0) {
+        players->updatePosition(conn.playerID, position, team);
+    }
+}
+
+// Payload: the player ID, network order. A connection identifies once; its
+// session counts from then until it disconnects.
+void Server::identifyPlayer(Connection& conn, const FrameView& frame) {
+    const size_t payloadOffset = 2 + sizeof(uint32_t);
+    if (!players || conn.playerID != 0 || frame.size < payloadOffset + sizeof(uint64_t)) return;
+
+    uint64_t playerID = loadBigEndian(frame.data + payloadOffset, sizeof(uint64_t));
+    if (playerID == 0) return;
+    conn.playerID = playerID;
+    conn.sessionStart = std::chrono::steady_clock::now();
+    PlayerRecord record = players->beginSession(playerID);
+    std::cout << "Client " << (int)conn.clientID << " is player " << playerID << ", session " << record.sessions << ".\n";
+}
+
+// Samples load every GOVERNOR_INTERVAL and applies the governor's level
+void Server::runGovernor() {
+    uint64_t ticks = 0;
+    uint64_t late = 0;
+    uint64_t cpuMicros = processCpuMicros();
+    std::chrono::steady_clock::time_point sampledAt = std::chrono::steady_clock::now();
+
+    while (isRunning) {
+        std::this_thread::sleep_for(GOVERNOR_INTERVAL);
+        if (!isRunning) break;
+
+        LoadSample sample = sampleLoad(ticks, late, cpuMicros, sampledAt);
+        if (governor.update(sample)) {
+            DegradationLevel level = governor.getLevel();
+            matches.setDegradation(level);
+            std::cout << "Overload governor: degradation level " << (int)level << ".\n";
+        }
+    }
+}
+
+// Takes the previous totals and replaces them with the current ones
+LoadSample Server::sampleLoad(uint64_t& ticks, uint64_t& late, uint64_t& cpuMicros,
+    std::chrono::steady_clock::time_point& sampledAt) {
+    LoadSample sample{};
+
+    uint64_t totalTicks = 0;
+    uint64_t totalLate = 0;
+    matches.addTickLoad(totalTicks, totalLate);
+    if (totalTicks > ticks) {
+        sample.tickLate = (double)(totalLate - late) / (double)(totalTicks - ticks);
+    }
+    ticks = totalTicks;
+    late = totalLate;
+
+    uint64_t cpu = processCpuMicros();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double wallMicros = (double)std::chrono::duration_cast<std::chrono::microseconds>(now - sampledAt).count();
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    if (wallMicros > 0) {
+        sample.cpu = (double)(cpu - cpuMicros) / (wallMicros * cores);
+    }
+    cpuMicros = cpu;
+    sampledAt = now;
+
     {
         std::lock_guard<std::mutex> lock(clientsMutex);
-        clients.erase(std::remove_if(clients.begin(), clients.end(),
-            [clientID](ClientHandler* ch) { return ch->clientID == clientID; }), clients.end());
+        size_t backlogged = 0;
+        for (const std::shared_ptr<Connection>& conn : clients) {
+            if (conn->queuedBytes.load(std::memory_order_relaxed) > SEND_HIGH_WATER) backlogged++;
+        }
+        if (!clients.empty()) {
+            sample.backlogged = (double)backlogged / clients.size();
+        }
     }
 
-    // Notify other clients about client disconnect
-    // ...
-
-    closesocket(clientSocket);
-    std::cout << "Client " << (int)clientID << " disconnected.\n";
+    if (pipeline) {
+        sample.pipelineFill = pipeline->getQueueFill();
+    }
+    return sample;
 }
 
-void Server::broadcastMessage(BaseMessage* msg, uint8_t excludeID) {
-    std::vector<uint8_t> buffer;
-    serializeMessage(msg, buffer);
+// Returns false if every ID is taken
+bool Server::takeClientID(uint8_t& clientID) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    if (freeClientIDs.empty()) return false;
+    clientID = freeClientIDs.front();
+    freeClientIDs.pop_front();
+    return true;
+}
 
-    uint32_t msgSize = htonl(buffer.size());
+void Server::removeClient(Connection& conn) {
+    if (players && conn.playerID != 0) {
+        players->endSession(conn.playerID, (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - conn.sessionStart).count());
+    }
+    conn.match->removeMember(conn);
+    voice.removeClient(conn.clientID);
 
     std::lock_guard<std::mutex> lock(clientsMutex);
-    for (ClientHandler* clientHandler : clients) {
-        if (clientHandler->clientID != excludeID) {
-            send(clientHandler->socket, (char*)&msgSize, sizeof(msgSize), 0);
-            send(clientHandler->socket, (char*)buffer.data(), buffer.size(), 0);
-        }
+    clients.erase(std::remove_if(clients.begin(), clients.end(),
+        [&conn](const std::shared_ptr<Connection>& c) { return c.get() == &conn; }), clients.end());
+    freeClientIDs.push_back(conn.clientID);
+}
+
+// Sends a message to the rest of a match. Snapshots wait for the match's
+// next tick; everything else goes out right away.
+void Server::broadcastMessage(BaseMessage* msg, uint8_t excludeID, Match* match) {
+    // Serialize once; every recipient's reactor copies from the same frame
+    SharedFrame frame = serializeFrame(msg);
+
+    if (msg->messageType == SNAPSHOT_MESSAGE) {
+        match->stageSnapshot(msg->senderID, frame);
+        return;
+    }
+
+    // Reactor threads publish through their broadcast ring
+    BroadcastRing::Entry broadcast{ frame, excludeID, match };
+    if (Reactor::current) {
+        Reactor::current->broadcast(broadcast);
+        return;
+    }
+    for (std::unique_ptr<Reactor>& reactor : reactors) {
+        reactor->postBroadcast(broadcast);
+    }
+}
+
+void Server::requestCheckpoint() {
+    if (!checkpointer) {
+        std::cout << "Checkpoints are off; start the server with --checkpoint <file>.\n";
+        return;
+    }
+    checkpointer->request();
+}
+
+void Server::printStats() {
+    governor.printStats(std::cout);
+    matches.printStats(std::cout);
+    voice.printStats(std::cout);
+    if (spectators) {
+        spectators->printStats(std::cout);
+    }
+    if (recorder) {
+        recorder->printStats(std::cout);
+    }
+    if (checkpointer) {
+        checkpointer->printStats(std::cout);
+    }
+    if (players) {
+        players->printStats(std::cout);
     }
+    if (botCount.load(std::memory_order_relaxed) > 0) {
+        std::cout << "Bots: " << botCount.load(std::memory_order_relaxed) << ", "
+            << botInputs.load(std::memory_order_relaxed) << " inputs, "
+            << botFramesReceived.load(std::memory_order_relaxed) << " frames received ("
+            << botSnapshotsReceived.load(std::memory_order_relaxed) << " snapshots)\n";
+    }
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    for (std::unique_ptr<Reactor>& reactor : reactors) {
+        hits += reactor->getEncodeCache().hits.load(std::memory_order_relaxed);
+        misses += reactor->getEncodeCache().misses.load(std::memory_order_relaxed);
+    }
+    std::cout << "Snapshot encodes: " << misses << " computed, " << hits << " reused\n";
+    if (!pipeline) {
+        std::cout << "Pipeline: off\n";
+        return;
+    }
+    std::cout << "Pipeline:\n";
+    pipeline->printStats(std::cout);
 }
 
 void Server::stop() {
     isRunning = false;
     closesocket(listeningSocket);
+    if (governorThread.joinable()) {
+        governorThread.join();
+    }
+    if (checkpointer) {
+        checkpointer->stop();
+    }
+    voice.stop();
+    if (spectators) {
+        spectators->stop();
+    }
+    matches.stop();
+    // After the matches, so their last ticks make it into the demos
+    if (recorder) {
+        recorder->stop();
+    }
+    if (pipeline) {
+        pipeline->stop();
+    }
+    for (std::unique_ptr<Reactor>& reactor : reactors) {
+        reactor->stop();
+    }
+    reactors.clear();
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        // Sessions still open end with the server
+        if (players) {
+            auto now = std::chrono::steady_clock::now();
+            for (std::shared_ptr<Connection>& conn : clients) {
+                if (conn->playerID == 0) continue;
+                players->endSession(conn->playerID,
+                    (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(now - conn->sessionStart).count());
+            }
+        }
+        clients.clear();
+    }
+    if (players) {
+        players->stop();
+    }
 #ifdef _WIN32
     WSACleanup();
 #endif
@@ -245,7 +5756,8 @@ void serializeMessage(BaseMessage* msg, std::vector<uint8_t>& buffer) {
         buffer.insert(buffer.end(), tm->text.begin(), tm->text.end());
         break;
     }
-    case EVENT_MESSAGE: {
+    case EVENT_MESSAGE:
+    case COSMETIC_EVENT_MESSAGE: {
         EventMessage* em = static_cast<EventMessage*>(msg);
         uint32_t length = htonl(em->eventData.size());
         buffer.insert(buffer.end(), (uint8_t*)&length, (uint8_t*)&length + sizeof(length));
@@ -262,9 +5774,237 @@ void serializeMessage(BaseMessage* msg, std::vector<uint8_t>& buffer) {
     }
 }
 
+// Length-prefixed frame ready to be shared between recipients
+SharedFrame serializeFrame(BaseMessage* msg) {
+    std::vector<uint8_t> buffer;
+    serializeMessage(msg, buffer);
+
+    uint32_t msgSize = htonl((uint32_t)buffer.size());
+    std::shared_ptr<std::vector<uint8_t>> frame = std::make_shared<std::vector<uint8_t>>();
+    frame->reserve(sizeof(msgSize) + buffer.size());
+    frame->insert(frame->end(), (uint8_t*)&msgSize, (uint8_t*)&msgSize + sizeof(msgSize));
+    frame->insert(frame->end(), buffer.begin(), buffer.end());
+    return frame;
+}
+
+// Checks a received frame (length prefix included) the way deserializeMessage
+// would and makes it the frame relayed to others: bytes past the payload are
+// cut and the sender is stamped, as clients cannot be trusted to fill it in.
+bool prepareRelayedFrame(std::vector<uint8_t>& frame, uint8_t senderID) {
+    if (frame.size() < FRAME_HEADER_SIZE) return false;
+    uint8_t messageType = frame[4];
+    if (messageType != TEXT_MESSAGE && messageType != EVENT_MESSAGE && messageType != COSMETIC_EVENT_MESSAGE &&
+        messageType != SNAPSHOT_MESSAGE) {
+        return false;
+    }
+
+    uint32_t length;
+    memcpy(&length, frame.data() + 6, sizeof(length));
+    length = ntohl(length);
+    if (frame.size() - FRAME_HEADER_SIZE < length) return false;
+
+    uint32_t msgSize = htonl((uint32_t)(FRAME_HEADER_SIZE - sizeof(uint32_t) + length));
+    frame.resize(FRAME_HEADER_SIZE + length);
+    memcpy(frame.data(), &msgSize, sizeof(msgSize));
+    frame[5] = senderID;
+    return true;
+}
+
+// Snapshot Delta Encoding
+// A delta is the new snapshot XORed against the baseline (zero-padded to the
+// new size), stored as alternating varint runs: unchanged byte count, then
+// literal byte count followed by that many XORed bytes.
+
+// Index of the first non-zero byte, or n
+size_t findFirstNonZero(const uint8_t* data, size_t n) {
+    size_t i = 0;
+#ifdef SNAPSHOT_DELTA_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        int zeroMask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        if (zeroMask != 0xFFFF) {
+            unsigned nonZero = (unsigned)~zeroMask & 0xFFFF;
+            size_t bit = 0;
+            while (!(nonZero & (1u << bit))) bit++;
+            return i + bit;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (data[i] != 0) return i;
+    }
+    return n;
+}
+
+// Index of the first zero-run of at least minRun bytes, or n
+size_t findFirstZeroRun(const uint8_t* data, size_t n, size_t minRun) {
+    size_t run = 0;
+    size_t i = 0;
+#ifdef SNAPSHOT_DELTA_SSE2
+    // Blocks with no zero byte and all-zero blocks too short to finish the
+    // run skip the byte loop; only mixed blocks walk their zero mask
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        unsigned zeroMask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        if (zeroMask == 0) {
+            run = 0;
+            continue;
+        }
+        if (zeroMask == 0xFFFF && run + 16 < minRun) {
+            run += 16;
+            continue;
+        }
+        for (unsigned bit = 0; bit < 16; bit++) {
+            if (zeroMask & (1u << bit)) {
+                if (++run == minRun) return i + bit + 1 - minRun;
+            }
+            else {
+                run = 0;
+            }
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (data[i] == 0) {
+            if (++run == minRun) return i + 1 - minRun;
+        }
+        else {
+            run = 0;
+        }
+    }
+    return n;
+}
+
+// out = a ^ b
+void xorBytes(uint8_t* out, const uint8_t* a, const uint8_t* b, size_t n) {
+    size_t i = 0;
+#ifdef SNAPSHOT_DELTA_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(va, vb));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = a[i] ^ b[i];
+    }
+}
+
+void appendVarint(std::vector<uint8_t>& out, size_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+// Appends the delta body to out (after the header reserved by the caller) and
+// fills in the flags byte. Returns false if a full snapshot would be cheaper.
+// xorScratch is the caller's to keep between calls, so encoding allocates
+// nothing once it has grown.
+bool encodeSnapshotDelta(const uint8_t* baseline, size_t baselineSize, const uint8_t* snapshot, size_t size,
+    std::vector<uint8_t>& xorScratch, std::vector<uint8_t>& out) {
+    const size_t headerEnd = out.size();
+    const size_t flagsOffset = headerEnd - DELTA_HEADER_SIZE + 2;
+    const size_t budget = size * DELTA_MAX_PERCENT / 100;
+    const size_t common = std::min(baselineSize, size);
+
+    // XOR against the baseline; the grown tail XORs against zero padding
+    xorScratch.resize(size);
+    xorBytes(xorScratch.data(), baseline, snapshot, common);
+    if (size > common) {
+        memcpy(xorScratch.data() + common, snapshot + common, size - common);
+    }
+
+    const uint8_t* delta = xorScratch.data();
+    size_t pos = 0;
+    while (pos < size) {
+        size_t zeroRun = findFirstNonZero(delta + pos, size - pos);
+        pos += zeroRun;
+        size_t literal = pos < size ? findFirstZeroRun(delta + pos, size - pos, DELTA_MIN_ZERO_RUN) : 0;
+
+        appendVarint(out, zeroRun);
+        appendVarint(out, literal);
+        out.insert(out.end(), delta + pos, delta + pos + literal);
+        pos += literal;
+
+        if (out.size() - headerEnd > budget) return false;
+    }
+
+    out[flagsOffset] = 0;
+
+#ifdef USE_LZ4
+    // Compress the run stream if that makes it smaller; the raw stream size leads the block.
+    // The XOR is spent by now, so its scratch holds the compressed block.
+    size_t rleSize = out.size() - headerEnd;
+    std::vector<uint8_t>& compressed = xorScratch;
+    compressed.resize(sizeof(uint32_t) + LZ4_compressBound((int)rleSize));
+    int compressedSize = LZ4_compress_default((const char*)out.data() + headerEnd,
+        (char*)compressed.data() + sizeof(uint32_t), (int)rleSize, (int)(compressed.size() - sizeof(uint32_t)));
+    if (compressedSize > 0 && sizeof(uint32_t) + (size_t)compressedSize < rleSize) {
+        uint32_t rawLength = htonl((uint32_t)rleSize);
+        memcpy(compressed.data(), &rawLength, sizeof(rawLength));
+        out.resize(headerEnd);
+        out.insert(out.end(), compressed.begin(), compressed.begin() + sizeof(uint32_t) + compressedSize);
+        out[flagsOffset] = DELTA_FLAG_LZ4;
+    }
+#endif
+
+    return out.size() - headerEnd <= budget;
+}
+
+// Snapshot Delta Decoding
+// The inverse of the encoding above, for reading demos back
+
+// data ^= delta
+void xorInPlace(uint8_t* data, const uint8_t* delta, size_t n) {
+    size_t i = 0;
+#ifdef SNAPSHOT_DELTA_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i vd = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i vx = _mm_loadu_si128((const __m128i*)(delta + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(vd, vx));
+    }
+#endif
+    for (; i < n; i++) {
+        data[i] ^= delta[i];
+    }
+}
+
+bool readVarint(const uint8_t*& in, const uint8_t* end, size_t& value) {
+    value = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        value |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Applies a delta to target, which holds the baseline zero-padded to size
+bool decodeSnapshotDelta(const uint8_t* delta, size_t deltaSize, uint8_t* target, size_t size) {
+    const uint8_t* in = delta;
+    const uint8_t* end = delta + deltaSize;
+    size_t pos = 0;
+
+    while (in < end) {
+        size_t unchanged, literal;
+        if (!readVarint(in, end, unchanged) || !readVarint(in, end, literal)) return false;
+        if (unchanged > size - pos) return false;
+        pos += unchanged;
+        if (literal > size - pos || literal > (size_t)(end - in)) return false;
+        xorInPlace(target + pos, in, literal);
+        in += literal;
+        pos += literal;
+    }
+    return true;
+}
+
 // Deserialization Function
-BaseMessage* deserializeMessage(const std::vector<uint8_t>& buffer) {
-    if (buffer.size() < 2) return nullptr;
+BaseMessage* deserializeMessage(const uint8_t* buffer, size_t size) {
+    if (size < 2) return nullptr;
 
     uint8_t messageType = buffer[0];
     uint8_t senderID = buffer[1];
@@ -272,39 +6012,40 @@ BaseMessage* deserializeMessage(const std::vector<uint8_t>& buffer) {
 
     switch (messageType) {
     case TEXT_MESSAGE: {
-        if (buffer.size() < offset + 4) return nullptr;
+        if (size < offset + 4) return nullptr;
         uint32_t length;
         memcpy(&length, &buffer[offset], 4);
         length = ntohl(length);
         offset += 4;
 
-        if (buffer.size() < offset + length) return nullptr;
+        if (size < offset + length) return nullptr;
 
-        std::string text(buffer.begin() + offset, buffer.begin() + offset + length);
+        std::string text(buffer + offset, buffer + offset + length);
         return new TextMessage(senderID, text);
     }
-    case EVENT_MESSAGE: {
-        if (buffer.size() < offset + 4) return nullptr;
+    case EVENT_MESSAGE:
+    case COSMETIC_EVENT_MESSAGE: {
+        if (size < offset + 4) return nullptr;
         uint32_t length;
         memcpy(&length, &buffer[offset], 4);
         length = ntohl(length);
         offset += 4;
 
-        if (buffer.size() < offset + length) return nullptr;
+        if (size < offset + length) return nullptr;
 
-        std::string data(buffer.begin() + offset, buffer.begin() + offset + length);
-        return new EventMessage(senderID, data);
+        std::string data(buffer + offset, buffer + offset + length);
+        return new EventMessage(senderID, data, messageType == COSMETIC_EVENT_MESSAGE);
     }
     case SNAPSHOT_MESSAGE: {
-        if (buffer.size() < offset + 4) return nullptr;
+        if (size < offset + 4) return nullptr;
         uint32_t length;
         memcpy(&length, &buffer[offset], 4);
         length = ntohl(length);
         offset += 4;
 
-        if (buffer.size() < offset + length) return nullptr;
+        if (size < offset + length) return nullptr;
 
-        std::string data(buffer.begin() + offset, buffer.begin() + offset + length);
+        std::string data(buffer + offset, buffer + offset + length);
         return new SnapshotMessage(senderID, data);
     }
     default:
@@ -312,12 +6053,219 @@ BaseMessage* deserializeMessage(const std::vector<uint8_t>& buffer) {
     }
 }
 
-int main() {
-    Server server;
+// Reads a whole flag value the way --play reads ticks: digits only (and a
+// decimal point for fractional settings), so a typo or an out-of-range number
+// is refused instead of throwing out of std::stoul
+template <typename T>
+bool parseFlagValue(const std::string& text, T& value) {
+    const char* allowed = std::is_floating_point<T>::value ? "0123456789." : "0123456789";
+    std::istringstream in(text);
+    return !text.empty() && text.find_first_not_of(allowed) == std::string::npos && (in >> value) &&
+        in.peek() == std::char_traits<char>::eof();
+}
+
+int main(int argc, char* argv[]) {
+    ServerConfig config;
+    std::string relayUpstream;
+    uint32_t relayMatch = 0;
+    std::string demoPath;
+    SimulationConfig simulation;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool valid = true;
+        if (arg == "--reactors" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], config.reactorThreads);
+        }
+        else if (arg == "--wait" && i + 1 < argc) {
+            std::string strategy = argv[++i];
+            config.broadcastWait = strategy == "spin" ? WAIT_BUSY_SPIN : strategy == "block" ? WAIT_BLOCK : WAIT_YIELD;
+        }
+        else if (arg == "--pipeline") {
+            config.pipeline = true;
+        }
+        else if (arg == "--match-size" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], config.matchSize);
+        }
+        else if (arg == "--tick-rates" && i + 1 < argc) {
+            // Comma-separated, e.g. 60,30,20; new matches take them in turn
+            config.tickRates.clear();
+            std::string rates = argv[++i];
+            for (size_t start = 0; valid && start <= rates.size(); ) {
+                size_t end = std::min(rates.find(',', start), rates.size());
+                unsigned rate = 0;
+                valid = parseFlagValue(rates.substr(start, end - start), rate);
+                config.tickRates.push_back(std::max(1u, rate));
+                start = end + 1;
+            }
+            if (config.tickRates.empty()) config.tickRates.push_back(DEFAULT_TICK_RATE);
+        }
+        else if (arg == "--match-workers" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], config.matchWorkers);
+        }
+        else if (arg == "--port" && i + 1 < argc) {
+            // Lets an impairment proxy take PORT in front of the server
+            valid = parseFlagValue(argv[++i], config.port);
+        }
+        else if (arg == "--spectator-port" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], config.spectatorPort);
+        }
+        else if (arg == "--relay" && i + 2 < argc) {
+            // host[:port] and match ID; runs only a spectator feed fed by that host
+            relayUpstream = argv[++i];
+            valid = parseFlagValue(argv[++i], relayMatch);
+        }
+        else if (arg == "--record" && i + 1 < argc) {
+            config.demoDirectory = argv[++i];
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc) {
+            config.checkpointPath = argv[++i];
+        }
+        else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], config.checkpointSeconds);
+        }
+        else if (arg == "--bots" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], config.bots);
+        }
+        else if (arg == "--players" && i + 1 < argc) {
+            config.playerLogPath = argv[++i];
+        }
+        else if (arg == "--restore" && i + 1 < argc) {
+            config.restorePath = argv[++i];
+        }
+        else if (arg == "--play" && i + 1 < argc) {
+            // Opens a demo and seeks to the ticks typed in, instead of running a server
+            demoPath = argv[++i];
+        }
+        else if (arg == "--simulate" && i + 2 < argc) {
+            // Clients and virtual seconds; runs a simulation instead of a server
+            valid = parseFlagValue(argv[i + 1], simulation.clients) && parseFlagValue(argv[i + 2], simulation.seconds);
+            i += 2;
+        }
+        else if (arg == "--sim-threads" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], simulation.threads);
+        }
+        else if (arg == "--sim-seed" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], simulation.seed);
+        }
+        else if (arg == "--sim-latency" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], simulation.latencyMs);
+        }
+        else if (arg == "--sim-jitter" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], simulation.jitterMs);
+        }
+        else if (arg == "--sim-loss" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], simulation.lossPercent);
+        }
+        else if (arg == "--sim-reorder" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], simulation.reorderPercent);
+        }
+        else if (arg == "--sim-bandwidth" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], simulation.bandwidthKbps);
+        }
+
+        if (!valid) {
+            std::cerr << "Bad value for " << arg << ": " << argv[i] << "\n";
+            return 1;
+        }
+    }
+
+    if (simulation.clients > 0) {
+        simulation.matchSize = config.matchSize;
+        simulation.tickRate = config.tickRates[0];
+        Simulation sim(simulation);
+        auto started = std::chrono::steady_clock::now();
+        sim.run();
+        sim.printReport(std::cout, std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+        return 0;
+    }
+
+    if (!demoPath.empty()) {
+        DemoPlayer player;
+        if (!player.open(demoPath)) {
+            std::cerr << "Error reading demo " << demoPath << ".\n";
+            return 1;
+        }
+        std::cout << "Match " << player.getMatchID() << " at " << player.getTickRate() << " Hz, ticks "
+            << player.getFirstTick() << " to " << player.getLastTick() << ", " << player.getKeyframeCount() << " keyframes\n";
+        std::cout << "Type a tick to seek to, or press Enter to quit...\n";
+
+        std::string command;
+        while (std::getline(std::cin, command) && !command.empty()) {
+            // Parsed like 'bots N', so a tick too large for 32 bits is refused instead of throwing
+            uint32_t tick = 0;
+            if (command.find_first_not_of("0123456789") != std::string::npos || !(std::istringstream(command) >> tick)) {
+                std::cout << "Not a tick: " << command << "\n";
+                continue;
+            }
+
+            auto started = std::chrono::steady_clock::now();
+            bool found = player.seek(tick);
+            double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+            if (!found) {
+                std::cout << "Nothing recorded at or before tick " << command << "\n";
+                continue;
+            }
+
+            // The bundle is every member's snapshot frame back to back
+            const std::vector<uint8_t>& bundle = player.getBundle();
+            std::cout << "Tick " << player.getTick() << " from " << player.getRecordsApplied() << " records in "
+                << millis << " ms:\n";
+            for (size_t offset = 0; offset + FRAME_HEADER_SIZE <= bundle.size(); ) {
+                uint32_t msgSize;
+                memcpy(&msgSize, &bundle[offset], sizeof(msgSize));
+                msgSize = ntohl(msgSize);
+                std::cout << "  client " << (int)bundle[offset + 5] << ": " << msgSize - 2 - sizeof(uint32_t) << " byte snapshot\n";
+                offset += sizeof(msgSize) + msgSize;
+            }
+        }
+        return 0;
+    }
+
+    if (!relayUpstream.empty()) {
+        size_t colon = relayUpstream.find(':');
+        uint16_t upstreamPort = SPECTATOR_PORT;
+        if (colon != std::string::npos && !parseFlagValue(relayUpstream.substr(colon + 1), upstreamPort)) {
+            std::cerr << "Bad port in --relay " << relayUpstream << "\n";
+            return 1;
+        }
+#ifdef _WIN32
+        WSADATA wsData;
+        WSAStartup(MAKEWORD(2, 2), &wsData);
+#endif
+        SpectatorFeed relay(nullptr, config.spectatorPort);
+        relay.setUpstream(relayUpstream.substr(0, colon), upstreamPort, relayMatch);
+        if (!relay.start()) return 1;
+
+        std::cout << "Spectator relay on port " << config.spectatorPort << ". Type 'stats' for statistics, or press Enter to stop...\n";
+        std::string command;
+        while (std::getline(std::cin, command) && command == "stats") {
+            relay.printStats(std::cout);
+        }
+        relay.stop();
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return 0;
+    }
+
+    Server server(config);
     server.start();
 
-    std::cout << "Press Enter to stop the server...\n";
-    std::cin.get();
+    std::cout << "Type 'stats' for load statistics, 'checkpoint' to save the matches, 'bots N' to add bots, or press Enter to stop the server...\n";
+    std::string command;
+    while (std::getline(std::cin, command) && (command == "stats" || command == "checkpoint" || command.rfind("bots ", 0) == 0)) {
+        if (command == "checkpoint") {
+            server.requestCheckpoint();
+        }
+        else if (command.rfind("bots ", 0) == 0) {
+            unsigned count = 0;
+            std::istringstream(command.substr(5)) >> count;
+            server.addBots(count);
+        }
+        else {
+            server.printStats();
+        }
+    }
 
     server.stop();
 
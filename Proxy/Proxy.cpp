@@ -0,0 +1,939 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <map>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <deque>
+#include <queue>
+#include <random>
+#include <cmath>
+#include <csignal>
+
+// Platform-specific includes
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h> // Include this header for InetPton
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define SHUT_WR SD_SEND
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#define SOCKET int
+#define INVALID_SOCKET -1
+#define SOCKET_ERROR -1
+#define closesocket close
+#define WSAPoll poll
+typedef pollfd WSAPOLLFD;
+#endif
+
+// Linux gets epoll; everything else polls the whole socket list
+#ifdef __linux__
+#include <sys/epoll.h>
+#define PROXY_EPOLL
+#endif
+
+#define PORT 54000
+
+// Proxy Constants
+const uint16_t DEFAULT_UPSTREAM_PORT = PORT + 10; // Where the server runs with --port behind the proxy
+const size_t PROXY_CHUNK_SIZE = 64 * 1024;        // Bytes read per recv() call
+const size_t PROXY_SEGMENT_SIZE = 1448;           // Impairments apply per segment, like a TCP MSS on Ethernet
+const size_t PROXY_MAX_BUFFERED = 4 * 1024 * 1024; // A direction stops reading above this, so the sender feels backpressure
+const size_t PROXY_MAX_EVENTS = 256;              // Readiness events taken per wait
+const int PROXY_MAX_WAIT_MS = 100;                // Longest wait, so stop() is noticed
+const uint64_t PROXY_MIN_RTO_MICROS = 200000;     // Lost segments arrive at least this much later
+const unsigned PROXY_MAX_RETRANSMITS = 15;        // Like Linux's tcp_retries2, so total loss cannot stall a segment forever
+const double PARETO_SHAPE = 2.0;                  // Pareto jitter has this shape, so its mean is the jitter setting
+
+// Delay Distributions
+// Each one adds to the base delay; jitter sets the spread
+enum DelayDistribution {
+    DELAY_CONSTANT, // Jitter ignored
+    DELAY_UNIFORM,  // Between 0 and jitter
+    DELAY_NORMAL,   // Jitter is the standard deviation, never below 0 in total
+    DELAY_PARETO    // Heavy tail with a mean of jitter
+};
+
+// Impairment Settings
+// One direction of every connection. Loss follows a Gilbert-Elliott chain:
+// each segment may move the link between a good and a bad state, and each
+// state has its own loss rate, so losses come in bursts. Plain random loss
+// is the same chain with no way into the bad state.
+struct Impairment {
+    double delayMs;
+    double jitterMs;
+    DelayDistribution distribution;
+    double goodLossPercent;  // Loss while in the good state
+    double badLossPercent;   // Loss while in the bad state
+    double enterBadPercent;  // Per segment, good to bad
+    double leaveBadPercent;  // Per segment, bad to good
+    double reorderPercent;
+    uint64_t bandwidthKbps;  // 0 for no limit
+
+    Impairment() : delayMs(0), jitterMs(0), distribution(DELAY_UNIFORM), goodLossPercent(0), badLossPercent(0),
+        enterBadPercent(0), leaveBadPercent(100), reorderPercent(0), bandwidthKbps(0) {}
+};
+
+// Proxy Configuration
+struct ProxyConfig {
+    uint16_t listenPort;
+    std::string upstreamHost;
+    uint16_t upstreamPort;
+    uint64_t seed;
+    Impairment up;   // Client to server
+    Impairment down; // Server to client
+
+    ProxyConfig() : listenPort(PORT), upstreamHost("127.0.0.1"), upstreamPort(DEFAULT_UPSTREAM_PORT), seed(1) {}
+};
+
+// Poller
+// Readiness for every socket the proxy owns, level-triggered. Each socket is
+// registered with a key the caller picks, which comes back with its events.
+class Poller {
+public:
+    enum Interest { READABLE = 1, WRITABLE = 2 };
+
+    struct Ready {
+        uint64_t key;
+        int events;  // Interest bits
+        bool failed; // Error or hangup
+    };
+
+private:
+#ifdef PROXY_EPOLL
+    int epollFD;
+    std::vector<epoll_event> events;
+#else
+    std::vector<WSAPOLLFD> fds;
+    std::vector<uint64_t> keys;
+#endif
+
+public:
+    Poller();
+    ~Poller();
+
+    bool open();
+    void add(SOCKET socket, uint64_t key, int interest);
+    void modify(SOCKET socket, uint64_t key, int interest);
+    void remove(SOCKET socket);
+    // Replaces out with what is ready, waiting at most timeoutMs
+    void wait(std::vector<Ready>& out, int timeoutMs);
+};
+
+// Impaired Direction
+// Bytes read from one socket on their way to the other. Reads are cut into
+// segments, and each segment gets a release time from the impairment: it
+// waits its turn for the bandwidth, then takes the delay. A TCP stream
+// cannot lose or reorder bytes, so loss and reordering show up as what TCP
+// would make of them: a lost segment arrives a retransmission timeout
+// later, a reordered one a little later, and either way the segments behind
+// it wait, since delivery stays in order.
+class ImpairedDirection {
+private:
+    struct Segment {
+        uint64_t release; // Steady clock microseconds
+        uint32_t size;
+    };
+
+    const Impairment& impairment;
+    std::mt19937_64 random;
+    std::vector<uint8_t> buffer;
+    size_t bufferStart;
+    std::deque<Segment> segments; // Not released yet, in order
+    size_t releasedBytes;         // At the front of the buffer, ready to write
+    uint64_t busyUntil;
+    uint64_t lastRelease;
+    bool bad;                     // Gilbert-Elliott state
+    uint64_t rtoMicros;
+
+    double sampleDelayMicros();
+    bool sampleLoss();
+
+public:
+    bool sourceClosed;
+    bool shutDown;   // Destination told of the close, once everything before it was written
+
+    // Stats, summed into the proxy's after each pass
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t segmentsIn;
+    uint64_t segmentsLost;
+    uint64_t segmentsReordered;
+    uint64_t delaySumMicros;
+    uint64_t delayMaxMicros;
+
+    ImpairedDirection(const Impairment& settings, uint64_t seed);
+
+    void accept(const uint8_t* data, size_t size, uint64_t now);
+    void release(uint64_t now);
+    // Writes what has been released; returns false if the socket failed
+    bool writeTo(SOCKET socket, bool& blocked);
+
+    size_t buffered() const { return buffer.size() - bufferStart; }
+    bool hasReleased() const { return releasedBytes > 0; }
+    bool isEmpty() const { return buffered() == 0; }
+    bool isFinished() const { return sourceClosed && shutDown; }
+    // 0 if nothing is waiting
+    uint64_t nextRelease() const { return segments.empty() ? 0 : segments.front().release; }
+};
+
+// Proxy
+// Accepts clients on the listen port and opens a connection upstream for
+// each, then shuttles bytes between the two through an impaired direction
+// each way. Everything runs on one thread that waits for readiness or the
+// next segment release, whichever comes first. Release times sit in a
+// min-heap, so a wakeup only touches the sessions that have something to do.
+// A side that closes is passed on as a half-close once the bytes delayed
+// before it are out, and the session ends when both sides have closed.
+class Proxy {
+private:
+    struct Session {
+        uint64_t id;
+        SOCKET client;
+        SOCKET upstream;
+        ImpairedDirection up;
+        ImpairedDirection down;
+        bool connecting;    // Upstream connect() still in progress
+        int clientInterest; // -1 once the socket is done and out of the poller
+        int upstreamInterest;
+        uint64_t scheduled; // Earliest release queued for the session, 0 for none
+        uint64_t touched;   // Pass that last handled the session
+
+        Session(uint64_t sessionID, SOCKET clientSocket, SOCKET upstreamSocket, const ProxyConfig& config);
+    };
+
+    // A session with a segment due at release
+    struct Due {
+        uint64_t release;
+        uint64_t sessionID;
+
+        bool operator>(const Due& other) const { return release > other.release; }
+    };
+
+    ProxyConfig config;
+    SOCKET listeningSocket;
+    Poller poller;
+    std::map<uint64_t, std::unique_ptr<Session>> sessions;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> releases;
+    uint64_t nextSessionID;
+    uint64_t pass;
+    std::vector<uint8_t> readBuffer;
+    std::thread thread;
+    std::atomic<bool> isRunning;
+    std::chrono::steady_clock::time_point startedAt;
+
+    void run();
+    void acceptClients();
+    bool finishConnect(Session& session);
+    bool pump(Session& session, bool fromClient, uint64_t now);
+    bool flush(Session& session);
+    bool service(Session& session, uint64_t now);
+    void updateInterest(Session& session);
+    void closeSession(uint64_t id);
+    void collectStats(Session& session);
+
+public:
+    // Metrics
+    std::atomic<uint64_t> connectionsAccepted;
+    std::atomic<uint64_t> connectionsFailed; // Upstream would not take them
+    std::atomic<uint64_t> connectionsOpen;
+    std::atomic<uint64_t> upBytes;
+    std::atomic<uint64_t> downBytes;
+    std::atomic<uint64_t> segmentsLost;
+    std::atomic<uint64_t> segmentsReordered;
+    std::atomic<uint64_t> segmentsDelayed;
+    std::atomic<uint64_t> delaySumMicros;
+    std::atomic<uint64_t> delayMaxMicros;
+
+    Proxy(const ProxyConfig& proxyConfig);
+
+    bool start();
+    void stop();
+    void printStats(std::ostream& out);
+};
+
+// Socket Helpers
+bool setNonBlocking(SOCKET sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+bool lastErrorWouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// A non-blocking connect() that has started and will finish later
+bool lastErrorInProgress() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+// The proxy adds its own delays, so Nagle's would only add more
+void setNoDelay(SOCKET sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+}
+
+uint64_t nowMicros() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Poller
+
+#ifdef PROXY_EPOLL
+
+Poller::Poller() : epollFD(-1), events(PROXY_MAX_EVENTS) {}
+
+Poller::~Poller() {
+    if (epollFD != -1) close(epollFD);
+}
+
+bool Poller::open() {
+    epollFD = epoll_create1(0);
+    return epollFD != -1;
+}
+
+uint32_t epollMask(int interest) {
+    return ((interest & Poller::READABLE) ? EPOLLIN : 0u) | ((interest & Poller::WRITABLE) ? EPOLLOUT : 0u);
+}
+
+void Poller::add(SOCKET socket, uint64_t key, int interest) {
+    epoll_event event{};
+    event.events = epollMask(interest);
+    event.data.u64 = key;
+    epoll_ctl(epollFD, EPOLL_CTL_ADD, socket, &event);
+}
+
+void Poller::modify(SOCKET socket, uint64_t key, int interest) {
+    epoll_event event{};
+    event.events = epollMask(interest);
+    event.data.u64 = key;
+    epoll_ctl(epollFD, EPOLL_CTL_MOD, socket, &event);
+}
+
+void Poller::remove(SOCKET socket) {
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, socket, nullptr);
+}
+
+void Poller::wait(std::vector<Ready>& out, int timeoutMs) {
+    out.clear();
+    int count = epoll_wait(epollFD, events.data(), (int)events.size(), timeoutMs);
+    for (int i = 0; i < count; i++) {
+        int ready = ((events[i].events & EPOLLIN) ? READABLE : 0) | ((events[i].events & EPOLLOUT) ? WRITABLE : 0);
+        out.push_back(Ready{ events[i].data.u64, ready, (events[i].events & (EPOLLERR | EPOLLHUP)) != 0 });
+    }
+}
+
+#else
+
+Poller::Poller() {}
+
+Poller::~Poller() {}
+
+bool Poller::open() {
+    return true;
+}
+
+short pollMask(int interest) {
+    return (short)(((interest & Poller::READABLE) ? POLLIN : 0) | ((interest & Poller::WRITABLE) ? POLLOUT : 0));
+}
+
+void Poller::add(SOCKET socket, uint64_t key, int interest) {
+    WSAPOLLFD fd{};
+    fd.fd = socket;
+    fd.events = pollMask(interest);
+    fds.push_back(fd);
+    keys.push_back(key);
+}
+
+void Poller::modify(SOCKET socket, uint64_t key, int interest) {
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (fds[i].fd != socket) continue;
+        fds[i].events = pollMask(interest);
+        keys[i] = key;
+        return;
+    }
+}
+
+void Poller::remove(SOCKET socket) {
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (fds[i].fd != socket) continue;
+        fds[i] = fds.back();
+        keys[i] = keys.back();
+        fds.pop_back();
+        keys.pop_back();
+        return;
+    }
+}
+
+void Poller::wait(std::vector<Ready>& out, int timeoutMs) {
+    out.clear();
+    if (fds.empty()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+        return;
+    }
+    if (WSAPoll(fds.data(), (unsigned long)fds.size(), timeoutMs) <= 0) return;
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (fds[i].revents == 0) continue;
+        int ready = ((fds[i].revents & POLLIN) ? READABLE : 0) | ((fds[i].revents & POLLOUT) ? WRITABLE : 0);
+        out.push_back(Ready{ keys[i], ready, (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0 });
+    }
+}
+
+#endif
+
+// Impaired Direction
+
+ImpairedDirection::ImpairedDirection(const Impairment& settings, uint64_t seed)
+    : impairment(settings), random(seed), bufferStart(0), releasedBytes(0), busyUntil(0), lastRelease(0), bad(false),
+    sourceClosed(false), shutDown(false), bytesIn(0), bytesOut(0), segmentsIn(0), segmentsLost(0), segmentsReordered(0),
+    delaySumMicros(0), delayMaxMicros(0) {
+    rtoMicros = std::max(PROXY_MIN_RTO_MICROS, (uint64_t)((2 * settings.delayMs + 4 * settings.jitterMs) * 1000));
+}
+
+double ImpairedDirection::sampleDelayMicros() {
+    double jitter = impairment.jitterMs * 1000;
+    double extra = 0;
+    switch (impairment.distribution) {
+    case DELAY_CONSTANT:
+        break;
+    case DELAY_UNIFORM:
+        extra = std::uniform_real_distribution<double>(0, jitter)(random);
+        break;
+    case DELAY_NORMAL:
+        extra = std::normal_distribution<double>(0, jitter)(random);
+        break;
+    case DELAY_PARETO: {
+        // Scaled so the mean extra delay is the jitter
+        double u = std::uniform_real_distribution<double>(0, 1)(random);
+        extra = jitter * (PARETO_SHAPE - 1) * (std::pow(1 - u, -1 / PARETO_SHAPE) - 1);
+        break;
+    }
+    }
+    return std::max(0.0, impairment.delayMs * 1000 + extra);
+}
+
+// Steps the Gilbert-Elliott chain one segment and draws that segment's fate
+bool ImpairedDirection::sampleLoss() {
+    std::uniform_real_distribution<double> percent(0, 100);
+    if (impairment.enterBadPercent > 0 || bad) {
+        if (bad) bad = percent(random) >= impairment.leaveBadPercent;
+        else bad = percent(random) < impairment.enterBadPercent;
+    }
+    double loss = bad ? impairment.badLossPercent : impairment.goodLossPercent;
+    return loss > 0 && percent(random) < loss;
+}
+
+void ImpairedDirection::accept(const uint8_t* data, size_t size, uint64_t now) {
+    if (bufferStart > 0 && bufferStart >= buffer.size() / 2) {
+        buffer.erase(buffer.begin(), buffer.begin() + bufferStart);
+        bufferStart = 0;
+    }
+    buffer.insert(buffer.end(), data, data + size);
+    bytesIn += size;
+
+    for (size_t offset = 0; offset < size; offset += PROXY_SEGMENT_SIZE) {
+        size_t segmentSize = std::min(PROXY_SEGMENT_SIZE, size - offset);
+        uint64_t sent = std::max(now, busyUntil);
+        if (impairment.bandwidthKbps > 0) sent += (uint64_t)segmentSize * 8000 / impairment.bandwidthKbps;
+        busyUntil = sent;
+
+        uint64_t arrival = sent + (uint64_t)sampleDelayMicros();
+        // A segment lost again on retransmission waits another timeout
+        for (unsigned attempt = 0; attempt < PROXY_MAX_RETRANSMITS && sampleLoss(); attempt++) {
+            arrival += rtoMicros;
+            segmentsLost++;
+        }
+        if (impairment.reorderPercent > 0 &&
+            std::uniform_real_distribution<double>(0, 100)(random) < impairment.reorderPercent) {
+            arrival += (uint64_t)std::uniform_real_distribution<double>(0, impairment.delayMs * 1000 + impairment.jitterMs * 1000 + 1000)(random);
+            segmentsReordered++;
+        }
+
+        uint64_t release = std::max(arrival, lastRelease);
+        lastRelease = release;
+        segments.push_back(Segment{ release, (uint32_t)segmentSize });
+        segmentsIn++;
+        delaySumMicros += release - now;
+        delayMaxMicros = std::max(delayMaxMicros, release - now);
+    }
+}
+
+void ImpairedDirection::release(uint64_t now) {
+    while (!segments.empty() && segments.front().release <= now) {
+        releasedBytes += segments.front().size;
+        segments.pop_front();
+    }
+}
+
+bool ImpairedDirection::writeTo(SOCKET socket, bool& blocked) {
+    blocked = false;
+    while (releasedBytes > 0) {
+        int bytesSent = ::send(socket, (const char*)buffer.data() + bufferStart, (int)releasedBytes, 0);
+        if (bytesSent > 0) {
+            bufferStart += bytesSent;
+            releasedBytes -= bytesSent;
+            bytesOut += bytesSent;
+            continue;
+        }
+        if (bytesSent < 0 && lastErrorWouldBlock()) {
+            blocked = true;
+            return true;
+        }
+        return false;
+    }
+    if (bufferStart == buffer.size()) {
+        buffer.clear();
+        bufferStart = 0;
+    }
+    return true;
+}
+
+// Proxy
+
+// Each session's directions get their own generator, so a connection's
+// impairments only depend on the seed and the order it was accepted in
+Proxy::Session::Session(uint64_t sessionID, SOCKET clientSocket, SOCKET upstreamSocket, const ProxyConfig& config)
+    : id(sessionID), client(clientSocket), upstream(upstreamSocket), up(config.up, config.seed * 1000003 + sessionID * 2),
+    down(config.down, config.seed * 1000003 + sessionID * 2 + 1), connecting(true), clientInterest(0),
+    upstreamInterest(Poller::WRITABLE), scheduled(0), touched(0) {}
+
+Proxy::Proxy(const ProxyConfig& proxyConfig)
+    : config(proxyConfig), listeningSocket(INVALID_SOCKET), nextSessionID(1), pass(0), readBuffer(PROXY_CHUNK_SIZE),
+    isRunning(false), connectionsAccepted(0), connectionsFailed(0), connectionsOpen(0), upBytes(0), downBytes(0),
+    segmentsLost(0), segmentsReordered(0), segmentsDelayed(0), delaySumMicros(0), delayMaxMicros(0) {}
+
+bool Proxy::start() {
+    if (!poller.open()) {
+        std::cerr << "Error creating poller.\n";
+        return false;
+    }
+
+    listeningSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listeningSocket == INVALID_SOCKET) {
+        std::cerr << "Error creating socket.\n";
+        return false;
+    }
+    int one = 1;
+    setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+
+    sockaddr_in hint{};
+    hint.sin_family = AF_INET;
+    hint.sin_port = htons(config.listenPort);
+    hint.sin_addr.s_addr = INADDR_ANY;
+    if (bind(listeningSocket, (sockaddr*)&hint, sizeof(hint)) == SOCKET_ERROR ||
+        listen(listeningSocket, SOMAXCONN) == SOCKET_ERROR || !setNonBlocking(listeningSocket)) {
+        std::cerr << "Error listening on port " << config.listenPort << ".\n";
+        closesocket(listeningSocket);
+        listeningSocket = INVALID_SOCKET;
+        return false;
+    }
+    // Key 0 is the listening socket; sessions use their ID times two, plus one for the upstream side
+    poller.add(listeningSocket, 0, Poller::READABLE);
+
+    startedAt = std::chrono::steady_clock::now();
+    isRunning = true;
+    thread = std::thread(&Proxy::run, this);
+    return true;
+}
+
+void Proxy::stop() {
+    if (!isRunning) return;
+    isRunning = false;
+    if (thread.joinable()) thread.join();
+
+    std::vector<uint64_t> ids;
+    for (const auto& entry : sessions) ids.push_back(entry.first);
+    for (uint64_t id : ids) closeSession(id);
+    if (listeningSocket != INVALID_SOCKET) {
+        closesocket(listeningSocket);
+        listeningSocket = INVALID_SOCKET;
+    }
+}
+
+void Proxy::run() {
+    std::vector<Poller::Ready> ready;
+    std::vector<Session*> active;
+    std::vector<uint64_t> finished;
+
+    while (isRunning) {
+        // Sleep until something is readable or writable, or the next segment is due
+        uint64_t now = nowMicros();
+        int timeoutMs = PROXY_MAX_WAIT_MS;
+        if (!releases.empty()) {
+            uint64_t nextRelease = releases.top().release;
+            timeoutMs = nextRelease <= now ? 0 : (int)std::min<uint64_t>((nextRelease - now + 999) / 1000, PROXY_MAX_WAIT_MS);
+        }
+        poller.wait(ready, timeoutMs);
+
+        now = nowMicros();
+        pass++;
+        for (const Poller::Ready& event : ready) {
+            if (event.key == 0) {
+                acceptClients();
+                continue;
+            }
+            auto found = sessions.find(event.key / 2);
+            if (found == sessions.end()) continue;
+            Session& session = *found->second;
+
+            bool fromClient = event.key % 2 == 0;
+            bool open = true;
+            if (session.connecting) {
+                if (!fromClient) open = finishConnect(session);
+            }
+            else if ((event.events & Poller::READABLE) || event.failed) {
+                open = pump(session, fromClient, now);
+            }
+            if (!open) {
+                finished.push_back(session.id);
+                session.touched = pass;
+            }
+            else if (session.touched != pass) {
+                session.touched = pass;
+                active.push_back(&session);
+            }
+        }
+
+        // Sessions with a segment due; entries of closed sessions and ones
+        // replaced by an earlier release are stale
+        while (!releases.empty() && releases.top().release <= now) {
+            Due due = releases.top();
+            releases.pop();
+            auto found = sessions.find(due.sessionID);
+            if (found == sessions.end() || found->second->scheduled != due.release) continue;
+            Session& session = *found->second;
+            session.scheduled = 0;
+            if (session.touched != pass) {
+                session.touched = pass;
+                active.push_back(&session);
+            }
+        }
+
+        for (Session* session : active) {
+            if (!service(*session, now)) finished.push_back(session->id);
+        }
+        active.clear();
+
+        for (uint64_t id : finished) closeSession(id);
+        finished.clear();
+    }
+}
+
+// Starts a non-blocking connect upstream for every client waiting; the
+// session joins the poller at once and starts forwarding when the connect
+// finishes, so a slow upstream never stalls the other sessions
+void Proxy::acceptClients() {
+    while (true) {
+        SOCKET client = accept(listeningSocket, nullptr, nullptr);
+        if (client == INVALID_SOCKET) return;
+
+        SOCKET upstream = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in hint{};
+        hint.sin_family = AF_INET;
+        hint.sin_port = htons(config.upstreamPort);
+        inet_pton(AF_INET, config.upstreamHost.c_str(), &hint.sin_addr);
+        if (upstream == INVALID_SOCKET || !setNonBlocking(upstream) ||
+            (connect(upstream, (sockaddr*)&hint, sizeof(hint)) == SOCKET_ERROR && !lastErrorInProgress())) {
+            std::cerr << "Error connecting to " << config.upstreamHost << ":" << config.upstreamPort << ".\n";
+            if (upstream != INVALID_SOCKET) closesocket(upstream);
+            closesocket(client);
+            connectionsFailed.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        setNonBlocking(client);
+        setNoDelay(client);
+        setNoDelay(upstream);
+
+        // The client is not read until there is somewhere to send its bytes
+        uint64_t id = nextSessionID++;
+        sessions[id].reset(new Session(id, client, upstream, config));
+        poller.add(client, id * 2, 0);
+        poller.add(upstream, id * 2 + 1, Poller::WRITABLE);
+        connectionsOpen.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Returns false if the upstream refused the session
+bool Proxy::finishConnect(Session& session) {
+    int error = 0;
+    socklen_t errorSize = sizeof(error);
+    if (getsockopt(session.upstream, SOL_SOCKET, SO_ERROR, (char*)&error, &errorSize) == SOCKET_ERROR || error != 0) {
+        std::cerr << "Error connecting to " << config.upstreamHost << ":" << config.upstreamPort << ".\n";
+        connectionsFailed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    session.connecting = false;
+    connectionsAccepted.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Reads what one side has into the direction that leads away from it.
+// Returns false if the session has to end now.
+bool Proxy::pump(Session& session, bool fromClient, uint64_t now) {
+    SOCKET source = fromClient ? session.client : session.upstream;
+    ImpairedDirection& direction = fromClient ? session.up : session.down;
+    while (!direction.sourceClosed && direction.buffered() < PROXY_MAX_BUFFERED) {
+        int bytesRead = recv(source, (char*)readBuffer.data(), (int)readBuffer.size(), 0);
+        if (bytesRead > 0) {
+            direction.accept(readBuffer.data(), bytesRead, now);
+            continue;
+        }
+        if (bytesRead < 0 && lastErrorWouldBlock()) break;
+        if (bytesRead < 0) return false;
+        direction.sourceClosed = true;
+    }
+    return true;
+}
+
+bool Proxy::flush(Session& session) {
+    bool blocked;
+    if (!session.up.writeTo(session.upstream, blocked)) return false;
+    if (!session.down.writeTo(session.client, blocked)) return false;
+    collectStats(session);
+    return true;
+}
+
+// Releases and writes what is due, passes on closes, and queues the next
+// release. Returns false once the session is over.
+bool Proxy::service(Session& session, uint64_t now) {
+    if (session.connecting) return true;
+
+    session.up.release(now);
+    session.down.release(now);
+    if (!flush(session)) return false;
+
+    for (ImpairedDirection* direction : { &session.up, &session.down }) {
+        if (direction->sourceClosed && !direction->shutDown && direction->isEmpty()) {
+            shutdown(direction == &session.up ? session.upstream : session.client, SHUT_WR);
+            direction->shutDown = true;
+        }
+    }
+    if (session.up.isFinished() && session.down.isFinished()) return false;
+    updateInterest(session);
+
+    uint64_t next = 0;
+    for (const ImpairedDirection* direction : { &session.up, &session.down }) {
+        uint64_t release = direction->nextRelease();
+        if (release != 0 && (next == 0 || release < next)) next = release;
+    }
+    if (next != 0 && (session.scheduled == 0 || next < session.scheduled)) {
+        releases.push(Due{ next, session.id });
+        session.scheduled = next;
+    }
+    return true;
+}
+
+// Reads stop on a side while the direction away from it is full; writes are
+// watched only while released bytes are stuck behind a full socket buffer.
+// A side closed both ways leaves the poller, which would otherwise keep
+// reporting its hangup while the other direction drains.
+void Proxy::updateInterest(Session& session) {
+    int clientInterest = (!session.up.sourceClosed && session.up.buffered() < PROXY_MAX_BUFFERED ? Poller::READABLE : 0) |
+        (session.down.hasReleased() ? Poller::WRITABLE : 0);
+    int upstreamInterest = (!session.down.sourceClosed && session.down.buffered() < PROXY_MAX_BUFFERED ? Poller::READABLE : 0) |
+        (session.up.hasReleased() ? Poller::WRITABLE : 0);
+    if (session.up.sourceClosed && session.down.shutDown) clientInterest = -1;
+    if (session.down.sourceClosed && session.up.shutDown) upstreamInterest = -1;
+
+    if (clientInterest != session.clientInterest) {
+        if (clientInterest == -1) poller.remove(session.client);
+        else poller.modify(session.client, session.id * 2, clientInterest);
+        session.clientInterest = clientInterest;
+    }
+    if (upstreamInterest != session.upstreamInterest) {
+        if (upstreamInterest == -1) poller.remove(session.upstream);
+        else poller.modify(session.upstream, session.id * 2 + 1, upstreamInterest);
+        session.upstreamInterest = upstreamInterest;
+    }
+}
+
+void Proxy::closeSession(uint64_t id) {
+    auto found = sessions.find(id);
+    if (found == sessions.end()) return;
+    Session& session = *found->second;
+    collectStats(session);
+    if (session.clientInterest != -1) poller.remove(session.client);
+    if (session.upstreamInterest != -1) poller.remove(session.upstream);
+    closesocket(session.client);
+    closesocket(session.upstream);
+    sessions.erase(found);
+    connectionsOpen.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Moves a session's counts into the totals the stats command reads
+void Proxy::collectStats(Session& session) {
+    for (ImpairedDirection* direction : { &session.up, &session.down }) {
+        (direction == &session.up ? upBytes : downBytes).fetch_add(direction->bytesOut, std::memory_order_relaxed);
+        segmentsLost.fetch_add(direction->segmentsLost, std::memory_order_relaxed);
+        segmentsReordered.fetch_add(direction->segmentsReordered, std::memory_order_relaxed);
+        segmentsDelayed.fetch_add(direction->segmentsIn, std::memory_order_relaxed);
+        delaySumMicros.fetch_add(direction->delaySumMicros, std::memory_order_relaxed);
+        if (direction->delayMaxMicros > delayMaxMicros.load(std::memory_order_relaxed)) {
+            delayMaxMicros.store(direction->delayMaxMicros, std::memory_order_relaxed);
+        }
+        direction->bytesOut = 0;
+        direction->segmentsLost = 0;
+        direction->segmentsReordered = 0;
+        direction->segmentsIn = 0;
+        direction->delaySumMicros = 0;
+    }
+}
+
+void Proxy::printStats(std::ostream& out) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startedAt).count();
+    uint64_t up = upBytes.load(std::memory_order_relaxed);
+    uint64_t down = downBytes.load(std::memory_order_relaxed);
+    uint64_t segments = segmentsDelayed.load(std::memory_order_relaxed);
+    out << "Connections: " << connectionsOpen.load(std::memory_order_relaxed) << " open, "
+        << connectionsAccepted.load(std::memory_order_relaxed) << " accepted, "
+        << connectionsFailed.load(std::memory_order_relaxed) << " refused upstream\n";
+    out << "Forwarded: " << up / 1024 << " KB up, " << down / 1024 << " KB down ("
+        << (seconds > 0 ? (up + down) / seconds / (1024 * 1024) : 0.0) << " MB/s average)\n";
+    out << "Segments: " << segments << ", " << segmentsLost.load(std::memory_order_relaxed) << " lost, "
+        << segmentsReordered.load(std::memory_order_relaxed) << " reordered; added delay mean "
+        << (segments ? delaySumMicros.load(std::memory_order_relaxed) / segments / 1000.0 : 0.0) << " ms, max "
+        << delayMaxMicros.load(std::memory_order_relaxed) / 1000.0 << " ms\n";
+}
+
+// Reads a whole flag value: digits only (and a decimal point for fractional
+// settings), so a typo or an out-of-range number is refused instead of
+// throwing out of std::stoul
+template <typename T>
+bool parseFlagValue(const std::string& text, T& value) {
+    const char* allowed = std::is_floating_point<T>::value ? "0123456789." : "0123456789";
+    std::istringstream in(text);
+    return !text.empty() && text.find_first_not_of(allowed) == std::string::npos && (in >> value) &&
+        in.peek() == std::char_traits<char>::eof();
+}
+
+// Applies a setting to the up direction, the down one, or both; false if the
+// value does not parse
+bool setImpairment(ProxyConfig& config, const std::string& scope, const std::string& name, const std::string& value) {
+    for (Impairment* impairment : { &config.up, &config.down }) {
+        if ((scope == "up" && impairment != &config.up) || (scope == "down" && impairment != &config.down)) continue;
+
+        if (name == "delay") {
+            if (!parseFlagValue(value, impairment->delayMs)) return false;
+        }
+        else if (name == "jitter") {
+            if (!parseFlagValue(value, impairment->jitterMs)) return false;
+        }
+        else if (name == "distribution") {
+            impairment->distribution = value == "constant" ? DELAY_CONSTANT : value == "normal" ? DELAY_NORMAL :
+                value == "pareto" ? DELAY_PARETO : DELAY_UNIFORM;
+        }
+        else if (name == "loss") {
+            if (!parseFlagValue(value, impairment->goodLossPercent)) return false;
+        }
+        else if (name == "burst") {
+            // enter,leave,loss: percent per segment into the bad state, out of it, and lost while in it
+            size_t first = value.find(',');
+            size_t second = value.find(',', first + 1);
+            if (first == std::string::npos || second == std::string::npos ||
+                !parseFlagValue(value.substr(0, first), impairment->enterBadPercent) ||
+                !parseFlagValue(value.substr(first + 1, second - first - 1), impairment->leaveBadPercent) ||
+                !parseFlagValue(value.substr(second + 1), impairment->badLossPercent)) {
+                return false;
+            }
+        }
+        else if (name == "reorder") {
+            if (!parseFlagValue(value, impairment->reorderPercent)) return false;
+        }
+        else if (name == "bandwidth") {
+            if (!parseFlagValue(value, impairment->bandwidthKbps)) return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    ProxyConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool valid = true;
+        if (arg == "--listen" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], config.listenPort);
+        }
+        else if (arg == "--upstream" && i + 1 < argc) {
+            // host[:port] of the server, started with --port
+            std::string upstream = argv[++i];
+            size_t colon = upstream.find(':');
+            config.upstreamHost = upstream.substr(0, colon);
+            if (colon != std::string::npos) valid = parseFlagValue(upstream.substr(colon + 1), config.upstreamPort);
+        }
+        else if (arg == "--seed" && i + 1 < argc) {
+            valid = parseFlagValue(argv[++i], config.seed);
+        }
+        else if (arg.rfind("--", 0) == 0 && i + 1 < argc) {
+            // --delay 50 sets both directions, --up-delay 50 and --down-delay 50 one each
+            std::string name = arg.substr(2);
+            std::string scope = "both";
+            if (name.rfind("up-", 0) == 0) {
+                scope = "up";
+                name = name.substr(3);
+            }
+            else if (name.rfind("down-", 0) == 0) {
+                scope = "down";
+                name = name.substr(5);
+            }
+            valid = setImpairment(config, scope, name, argv[++i]);
+        }
+
+        if (!valid) {
+            std::cerr << "Bad value for " << arg << ": " << argv[i] << "\n";
+            return 1;
+        }
+    }
+
+#ifdef _WIN32
+    WSADATA wsData;
+    WSAStartup(MAKEWORD(2, 2), &wsData);
+#else
+    // Peers vanish mid-write all the time in a proxy
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    Proxy proxy(config);
+    if (!proxy.start()) return 1;
+
+    std::cout << "Proxying port " << config.listenPort << " to " << config.upstreamHost << ":" << config.upstreamPort
+        << ". Type 'stats' for statistics, or press Enter to stop...\n";
+    std::string command;
+    while (std::getline(std::cin, command) && command == "stats") {
+        proxy.printStats(std::cout);
+    }
+
+    proxy.stop();
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}